@@ -0,0 +1,149 @@
+#include "twmailer-affinity.h"
+
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+
+#define NODE_DIRECTORY "/sys/devices/system/node"
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool parseCpuList(const std::string &text, std::vector<int> &cpus)
+{
+   cpus.clear();
+   size_t start = 0;
+   while (start < text.size())
+   {
+      size_t end = text.find(',', start);
+      if (end == std::string::npos)
+      {
+         end = text.size();
+      }
+      std::string part = text.substr(start, end - start);
+      start = end + 1;
+      if (part.empty() || part.find_first_not_of("0123456789-") != std::string::npos)
+      {
+         return false;
+      }
+
+      size_t dash = part.find('-');
+      int first = atoi(part.c_str());
+      int last = dash == std::string::npos ? first : atoi(part.c_str() + dash + 1);
+      if (dash == 0 || dash + 1 == part.size() || first > last || last >= CPU_SETSIZE)
+      {
+         return false;
+      }
+      for (int cpu = first; cpu <= last; cpu++)
+      {
+         cpus.push_back(cpu);
+      }
+   }
+   std::sort(cpus.begin(), cpus.end());
+   cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+   return !cpus.empty();
+}
+
+// inverse of parseCpuList, runs of consecutive CPUs become ranges
+std::string formatCpuList(const std::vector<int> &cpus)
+{
+   std::string text;
+   for (size_t i = 0; i < cpus.size(); i++)
+   {
+      size_t last = i;
+      while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1)
+      {
+         last++;
+      }
+      text += (text.empty() ? "" : ",") + std::to_string(cpus[i]);
+      if (last > i)
+      {
+         text += "-" + std::to_string(cpus[last]);
+      }
+      i = last;
+   }
+   return text;
+}
+
+//====================================================================================================================
+
+std::vector<int> allowedCpus()
+{
+   cpu_set_t allowed;
+   CPU_ZERO(&allowed);
+   sched_getaffinity(0, sizeof(allowed), &allowed);
+   std::vector<int> cpus;
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+   {
+      if (CPU_ISSET(cpu, &allowed))
+      {
+         cpus.push_back(cpu);
+      }
+   }
+   return cpus;
+}
+
+std::vector<NumaNode> numaNodes(const std::vector<int> &cpus)
+{
+   std::vector<NumaNode> nodes;
+   DIR *directory = opendir(NODE_DIRECTORY);
+   struct dirent *entry;
+   while (directory != NULL && (entry = readdir(directory)) != NULL)
+   {
+      if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9')
+      {
+         continue;
+      }
+      std::ifstream file(std::string(NODE_DIRECTORY "/") + entry->d_name + "/cpulist");
+      std::string line;
+      std::vector<int> nodeCpus;
+      if (!std::getline(file, line) || !parseCpuList(line, nodeCpus))
+      {
+         continue; // memory-only node
+      }
+
+      NumaNode node;
+      node.id = atoi(entry->d_name + 4);
+      for (int cpu : nodeCpus)
+      {
+         if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+         {
+            node.cpus.push_back(cpu);
+         }
+      }
+      if (!node.cpus.empty())
+      {
+         nodes.push_back(node);
+      }
+   }
+   if (directory != NULL)
+   {
+      closedir(directory);
+   }
+
+   std::sort(nodes.begin(), nodes.end(), [](const NumaNode &a, const NumaNode &b) { return a.id < b.id; });
+   if (nodes.empty() && !cpus.empty())
+   {
+      NumaNode node;
+      node.cpus = cpus;
+      nodes.push_back(node);
+   }
+   return nodes;
+}
+
+//====================================================================================================================
+
+int pinThread(const std::vector<int> &cpus)
+{
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   for (int cpu : cpus)
+   {
+      CPU_SET(cpu, &set);
+   }
+   return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
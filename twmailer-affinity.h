@@ -0,0 +1,29 @@
+#ifndef TWMAILER_AFFINITY_H
+#define TWMAILER_AFFINITY_H
+
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// CPU sets and NUMA nodes for placing acceptors and workers. Nodes are read from
+// /sys/devices/system/node, so no libnuma is needed; a machine without that directory
+// is one node holding every CPU. Memory follows the threads: Linux places a page on the
+// node of the thread that first touches it, so buffers allocated by a pinned worker
+// stay local.
+
+struct NumaNode
+{
+   int id = 0;
+   std::vector<int> cpus;
+};
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}; false on malformed lists
+bool parseCpuList(const std::string &text, std::vector<int> &cpus);
+std::string formatCpuList(const std::vector<int> &cpus);
+
+std::vector<int> allowedCpus();                                   // affinity mask of this process
+std::vector<NumaNode> numaNodes(const std::vector<int> &cpus);    // nodes holding any of cpus, only those cpus
+
+int pinThread(const std::vector<int> &cpus);                      // calling thread, 0 or the error number
+
+#endif
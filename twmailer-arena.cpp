@@ -0,0 +1,108 @@
+#include "twmailer-arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+thread_local Arena commandArena;
+
+///////////////////////////////////////////////////////////////////////////////
+
+void *Arena::allocate(size_t size, size_t alignment)
+{
+   if (!blocks.empty())
+   {
+      size_t start = (offset + alignment - 1) & ~(alignment - 1);
+      if (start + size <= blocks.back().size)
+      {
+         offset = start + size;
+         return blocks.back().data.get() + start;
+      }
+      usedBefore += offset;
+   }
+
+   // blocks double, so a command needing much memory costs few allocations even the first time
+   size_t next = blocks.empty() ? blockSize : blocks.back().size * 2;
+   while (next < size + alignment)
+   {
+      next *= 2;
+   }
+   blocks.push_back({std::unique_ptr<char[]>(new char[next]), next});
+   size_t start = ((alignment - (uintptr_t)blocks.back().data.get() % alignment) % alignment);
+   offset = start + size;
+   return blocks.back().data.get() + start;
+}
+
+const char *Arena::join(std::initializer_list<std::string_view> parts)
+{
+   size_t length = 0;
+   for (std::string_view part : parts)
+   {
+      length += part.size();
+   }
+   char *text = allocateText(length);
+   char *end = text;
+   for (std::string_view part : parts)
+   {
+      memcpy(end, part.data(), part.size());
+      end += part.size();
+   }
+   *end = '\0';
+   return text;
+}
+
+// Several blocks are replaced by one as large as all of them together, so the next command of
+// the same size fits without growing
+void Arena::reset()
+{
+   if (blocks.size() > 1)
+   {
+      size_t total = capacity();
+      blocks.clear();
+      blocks.push_back({std::unique_ptr<char[]>(new char[total]), total});
+   }
+   offset = 0;
+   usedBefore = 0;
+}
+
+size_t Arena::capacity() const
+{
+   size_t total = 0;
+   for (const Block &block : blocks)
+   {
+      total += block.size;
+   }
+   return total;
+}
+
+//====================================================================================================================
+
+static thread_local uint64_t allocations = 0;
+
+uint64_t allocationCount()
+{
+   return allocations;
+}
+
+// new[], nothrow new and the library's containers all end up here
+void *operator new(size_t size)
+{
+   allocations++;
+   void *pointer = malloc(size == 0 ? 1 : size);
+   if (pointer == nullptr)
+   {
+      throw std::bad_alloc();
+   }
+   return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+   free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+   free(pointer);
+}
@@ -0,0 +1,60 @@
+#ifndef TWMAILER_ARENA_H
+#define TWMAILER_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Bump allocator for the temporaries of one command (paths, scratch buffers). Memory is
+// handed out by moving an offset and given back all at once with reset(). After the first
+// commands the arena has grown to one block large enough for them and allocates no more.
+
+#define ARENA_BLOCK_SIZE 4096
+
+class Arena
+{
+public:
+   explicit Arena(size_t blockSize = ARENA_BLOCK_SIZE) : blockSize(blockSize) {}
+   Arena(const Arena &) = delete;
+   Arena &operator=(const Arena &) = delete;
+
+   void *allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+   char *allocateText(size_t length) { return (char *)allocate(length + 1, 1); } // room for the '\0'
+   const char *join(std::initializer_list<std::string_view> parts);               // '\0' terminated
+   void reset();                      // everything allocated so far becomes invalid
+
+   size_t used() const { return usedBefore + offset; } // bytes handed out since the last reset
+   size_t capacity() const;
+
+private:
+   struct Block
+   {
+      std::unique_ptr<char[]> data;
+      size_t size;
+   };
+
+   std::vector<Block> blocks; // the last one is being filled
+   size_t offset = 0;         // into the last block
+   size_t usedBefore = 0;     // bytes used in the blocks before the last
+   size_t blockSize;
+};
+
+// The arena of the worker running the current command. A session only ever runs on one worker
+// at a time and keeps nothing across commands, so one arena per worker thread serves all of its
+// sessions, is first touched on the worker's NUMA node and idle connections hold none.
+// processTextCommands() and processFrames() reset it after every command.
+extern thread_local Arena commandArena;
+
+///////////////////////////////////////////////////////////////////////////////
+// Allocation counting: the global operator new counts the calls of every thread, so the
+// allocations of a command are the difference of two readings on the thread running it.
+
+uint64_t allocationCount();
+
+#endif
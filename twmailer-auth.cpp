@@ -0,0 +1,306 @@
+#include "twmailer-auth.h"
+#include "twmailer-crypto.h"
+#include "twmailer-log.h"
+
+#include <ldap.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+
+///////////////////////////////////////////////////////////////////////////////
+
+// "ldap", "ldap:<uri>", "local:<file>" or "none"
+std::unique_ptr<Authenticator> createAuthenticator(const std::string &spec)
+{
+   if (spec == "ldap")
+   {
+      return std::make_unique<LdapAuthenticator>(DEFAULT_LDAP_URI);
+   }
+   if (spec.rfind("ldap:", 0) == 0)
+   {
+      return std::make_unique<LdapAuthenticator>(spec.substr(5));
+   }
+   if (spec.rfind("local:", 0) == 0)
+   {
+      auto local = std::make_unique<LocalAuthenticator>();
+      if (!local->load(spec.substr(6)))
+      {
+         return nullptr;
+      }
+      return local;
+   }
+   if (spec == "none")
+   {
+      return std::make_unique<AllowAllAuthenticator>();
+   }
+   return nullptr;
+}
+
+//====================================================================================================================
+
+bool LdapAuthenticator::authenticate(std::string username, std::string password)
+{
+   //std::cout << username << std::endl << password << std::endl;
+   std::string filter_username = "(uid=" + username + "*)";
+   const char *ldapUri = uri.c_str();
+   const int ldapVersion = LDAP_VERSION3;
+
+   const char *ldapSearchBaseDomainComponent = "dc=technikum-wien,dc=at";
+   const char *ldapSearchFilter = filter_username.c_str();
+   ber_int_t ldapSearchScope = LDAP_SCOPE_SUBTREE;
+   const char *ldapSearchResultAttributes[] = {"uid", "cn", NULL};
+
+   int rc = 0;
+   username = "uid=" + username + ",ou=people,dc=technikum-wien,dc=at";
+
+   LDAP *ldapHandle;
+   rc = ldap_initialize(&ldapHandle, ldapUri);
+   if (rc != LDAP_SUCCESS)
+   {
+      logError("ldap_init failed");
+      return false;
+   }
+   logDebug("connected to LDAP server {}", ldapUri);
+
+   rc = ldap_set_option(
+       ldapHandle,
+       LDAP_OPT_PROTOCOL_VERSION, // OPTION
+       &ldapVersion);             // IN-Value
+   if (rc != LDAP_OPT_SUCCESS)
+   {
+      logError("ldap_set_option(PROTOCOL_VERSION): {}", ldap_err2string(rc));
+      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+      return false;
+   }
+
+   rc = ldap_start_tls_s(
+       ldapHandle,
+       NULL,
+       NULL);
+   if (rc != LDAP_SUCCESS)
+   {
+      logError("ldap_start_tls_s(): {}", ldap_err2string(rc));
+      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+      return false;
+   }
+
+   BerValue bindCredentials;
+   bindCredentials.bv_val = (char *)password.c_str();
+   bindCredentials.bv_len = strlen(password.c_str());
+   BerValue *servercredp;
+   rc = ldap_sasl_bind_s(
+       ldapHandle,
+       username.c_str(),
+       LDAP_SASL_SIMPLE,
+       &bindCredentials,
+       NULL,
+       NULL,
+       &servercredp);
+   if (rc != LDAP_SUCCESS)
+   {
+      logInfo("LDAP bind error: {}", ldap_err2string(rc));
+      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+      return false;
+   }
+
+   LDAPMessage *searchResult;
+   rc = ldap_search_ext_s(
+       ldapHandle,
+       ldapSearchBaseDomainComponent,
+       ldapSearchScope,
+       ldapSearchFilter,
+       (char **)ldapSearchResultAttributes,
+       0,
+       NULL,
+       NULL,
+       NULL,
+       500,
+       &searchResult);
+   if (rc != LDAP_SUCCESS)
+   {
+      logError("LDAP search error: {}", ldap_err2string(rc));
+      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+      return false;
+   }
+
+   logDebug("Total results: {}", ldap_count_entries(ldapHandle, searchResult));
+
+   LDAPMessage *searchResultEntry;
+   for (searchResultEntry = ldap_first_entry(ldapHandle, searchResult);
+        searchResultEntry != NULL;
+        searchResultEntry = ldap_next_entry(ldapHandle, searchResultEntry))
+   {
+      logDebug("DN: {}", ldap_get_dn(ldapHandle, searchResultEntry));
+
+      BerElement *ber;
+      char *searchResultEntryAttribute;
+      for (searchResultEntryAttribute = ldap_first_attribute(ldapHandle, searchResultEntry, &ber);
+           searchResultEntryAttribute != NULL;
+           searchResultEntryAttribute = ldap_next_attribute(ldapHandle, searchResultEntry, ber))
+      {
+         BerValue **vals;
+         if ((vals = ldap_get_values_len(ldapHandle, searchResultEntry, searchResultEntryAttribute)) != NULL)
+         {
+            for (int i = 0; i < ldap_count_values_len(vals); i++)
+            {
+               logDebug("   {}: {}", searchResultEntryAttribute, vals[i]->bv_val);
+            }
+            ldap_value_free_len(vals);
+         }
+
+         ldap_memfree(searchResultEntryAttribute);
+      }
+      if (ber != NULL)
+      {
+         ber_free(ber, 0);
+      }
+   }
+
+   ldap_msgfree(searchResult);
+
+   ldap_unbind_ext_s(ldapHandle, NULL, NULL);
+   return true;
+}
+
+//====================================================================================================================
+
+// Every line is <username>:<salt hex>:<sha256(salt + password) hex>, lines starting with '#' are ignored
+bool LocalAuthenticator::load(const std::string &path)
+{
+   std::ifstream file(path);
+   if (!file)
+   {
+      logError("Error opening user file {}: {}", path, LogErrno{errno});
+      return false;
+   }
+
+   std::string line;
+   int lineNumber = 0;
+   while (std::getline(file, line))
+   {
+      lineNumber++;
+      if (line.empty() || line[0] == '#')
+      {
+         continue;
+      }
+
+      size_t first = line.find(':');
+      size_t second = first == std::string::npos ? std::string::npos : line.find(':', first + 1);
+      Entry entry;
+      if (second != std::string::npos)
+      {
+         entry.salt = fromHex(line.substr(first + 1, second - first - 1));
+         entry.hash = fromHex(line.substr(second + 1));
+      }
+      if (first == 0 || entry.salt.empty() || entry.hash.size() != SHA256_LENGTH)
+      {
+         logError("{}:{}: malformed user entry", path, lineNumber);
+         return false;
+      }
+      users[line.substr(0, first)] = entry;
+   }
+
+   logInfo("loaded {} local users from {}", users.size(), path);
+   return true;
+}
+
+bool LocalAuthenticator::authenticate(std::string username, std::string password)
+{
+   auto it = users.find(username);
+   if (it == users.end())
+   {
+      // hash anyway, so unknown users take as long as wrong passwords
+      equalConstantTime(sha256(password), std::string(SHA256_LENGTH, '\0'));
+      return false;
+   }
+   return equalConstantTime(sha256(it->second.salt + password), it->second.hash);
+}
+
+bool LocalAuthenticator::makeEntry(const std::string &username, const std::string &password, std::string &entry)
+{
+   std::string salt;
+   if (!randomBytes(16, salt))
+   {
+      logError("Error generating a salt: {}", LogErrno{errno});
+      return false;
+   }
+   entry = username + ":" + toHex(salt) + ":" + toHex(sha256(salt + password));
+   return true;
+}
+
+//====================================================================================================================
+
+bool TicketSigner::generateKey()
+{
+   if (!randomBytes(TICKET_KEY_LENGTH, key))
+   {
+      logError("Error generating the ticket key: {}", LogErrno{errno});
+      return false;
+   }
+   return true;
+}
+
+bool TicketSigner::loadKey(const std::string &path)
+{
+   std::ifstream file(path);
+   std::string line;
+   if (!file || !std::getline(file, line))
+   {
+      logError("Error reading ticket key {}: {}", path, LogErrno{errno});
+      return false;
+   }
+   while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+   {
+      line.pop_back();
+   }
+   std::string loaded = fromHex(line);
+   if (loaded.size() < TICKET_KEY_LENGTH)
+   {
+      logError("{}: ticket key needs at least {} hex encoded bytes", path, TICKET_KEY_LENGTH);
+      return false;
+   }
+   key = loaded;
+   return true;
+}
+
+std::string TicketSigner::issue(const std::string &username, int64_t expires) const
+{
+   std::string signedPart = username + ":" + std::to_string(expires);
+   return signedPart + ":" + toHex(hmacSha256(key, signedPart));
+}
+
+// Split from the right, usernames may contain ':'
+bool TicketSigner::verify(std::string_view ticket, int64_t now, std::string &username) const
+{
+   size_t macStart = ticket.rfind(':');
+   if (key.empty() || macStart == std::string_view::npos || macStart == 0)
+   {
+      return false;
+   }
+   size_t expiryStart = ticket.rfind(':', macStart - 1);
+   if (expiryStart == std::string_view::npos || expiryStart == 0 || expiryStart + 1 == macStart)
+   {
+      return false;
+   }
+
+   int64_t expires = 0;
+   for (size_t i = expiryStart + 1; i < macStart; i++)
+   {
+      if (ticket[i] < '0' || ticket[i] > '9' || expires > (INT64_MAX - 9) / 10)
+      {
+         return false;
+      }
+      expires = expires * 10 + (ticket[i] - '0');
+   }
+
+   std::string signedPart(ticket.substr(0, macStart));
+   if (!equalConstantTime(toHex(hmacSha256(key, signedPart)), std::string(ticket.substr(macStart + 1))) ||
+       expires <= now)
+   {
+      return false;
+   }
+   username.assign(ticket.substr(0, expiryStart));
+   return true;
+}
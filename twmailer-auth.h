@@ -0,0 +1,92 @@
+#ifndef TWMAILER_AUTH_H
+#define TWMAILER_AUTH_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+///////////////////////////////////////////////////////////////////////////////
+// LOGIN is checked by one of these, selected with --auth on the command line
+
+#define DEFAULT_LDAP_URI "ldap://ldap.technikum-wien.at:389"
+
+class Authenticator
+{
+public:
+   virtual ~Authenticator() = default;
+   // called from worker threads, must be safe to call concurrently
+   virtual bool authenticate(std::string username, std::string password) = 0;
+   virtual const char *name() const = 0;
+};
+
+// binds against the directory, one connection per login
+class LdapAuthenticator : public Authenticator
+{
+public:
+   explicit LdapAuthenticator(const std::string &uri) : uri(uri) {}
+   bool authenticate(std::string username, std::string password) override;
+   const char *name() const override { return "ldap"; }
+
+private:
+   std::string uri;
+};
+
+// salted SHA-256 hashes from a file, loaded once at startup and read-only afterwards
+class LocalAuthenticator : public Authenticator
+{
+public:
+   bool load(const std::string &path);
+   bool authenticate(std::string username, std::string password) override;
+   const char *name() const override { return "local"; }
+
+   // a line for the user file, used by --hash-password. false without a random salt
+   static bool makeEntry(const std::string &username, const std::string &password, std::string &entry);
+
+private:
+   struct Entry
+   {
+      std::string salt;
+      std::string hash;
+   };
+   std::unordered_map<std::string, Entry> users;
+};
+
+// development and benchmarks only, accepts every username and password
+class AllowAllAuthenticator : public Authenticator
+{
+public:
+   bool authenticate(std::string, std::string) override { return true; }
+   const char *name() const override { return "none"; }
+};
+
+std::unique_ptr<Authenticator> createAuthenticator(const std::string &spec);
+
+///////////////////////////////////////////////////////////////////////////////
+// Session tickets: LOGIN hands one out on request and RESUME accepts it instead of the password
+// until it expires, checked here without the authenticator.
+//
+//    <username>:<expiry, unix seconds>:<hex HMAC-SHA256 of "<username>:<expiry>">
+//
+// The key is random for every start unless --ticket-key=<file> loads one, which keeps tickets
+// valid across --takeover restarts and between servers sharing the file.
+
+#define TICKET_KEY_LENGTH 32
+
+class TicketSigner
+{
+public:
+   bool generateKey(); // false without a random key, the server must not start
+   bool loadKey(const std::string &path); // hex, at least TICKET_KEY_LENGTH bytes
+
+   std::string issue(const std::string &username, int64_t expires) const;
+   // username is set if the ticket is genuine and not expired at now
+   bool verify(std::string_view ticket, int64_t now, std::string &username) const;
+
+private:
+   std::string key; // read-only once the workers run
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include "twmailer-bench.h"
+
+// Microbenchmarks of the storage and parsing functions of the server, linked against its code:
+//
+// ./bin/bench [--dir /tmp] [--max-mailbox 100000] [--max-blacklist 1000000] [--seconds 0.5]
+//             [--label <commit>] [--only findFile|list|read|writeToFile|parseSend|emailSend|checkBlacklist|
+//                                        verifyTicket]
+//
+// Every result is one JSON object per line with latencies in nanoseconds. The server functions
+// log to stdout, so that goes to /dev/null while measuring and the results use a copy of it.
+
+namespace fs = std::filesystem;
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+   Options options;
+   if (!parseOptions(argc, argv, options))
+   {
+      fprintf(stderr, "usage: %s [--dir path] [--max-mailbox n] [--max-blacklist n] [--seconds s]\n"
+                      "          [--label text] [--only benchmark]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   string scratch = options.directory + "/twmailer-bench-XXXXXX";
+   if (mkdtemp(&scratch[0]) == NULL)
+   {
+      perror("mkdtemp");
+      return EXIT_FAILURE;
+   }
+   // checkBlacklist() opens BLACKLIST relative to the working directory
+   if (chdir(scratch.c_str()) == -1)
+   {
+      perror("chdir");
+      return EXIT_FAILURE;
+   }
+
+   FILE *results = fdopen(dup(STDOUT_FILENO), "w");
+   int devNull = open("/dev/null", O_WRONLY);
+   if (results == NULL || devNull == -1 || dup2(devNull, STDOUT_FILENO) == -1)
+   {
+      perror("redirecting stdout");
+      return EXIT_FAILURE;
+   }
+   close(devNull);
+
+   Reporter reporter(results, options);
+   benchMailbox(reporter, options, scratch);
+   benchWrite(reporter, scratch);
+   benchSend(reporter, scratch);
+   benchBlacklist(reporter, options);
+   benchTickets(reporter);
+
+   fclose(results);
+   std::error_code error;
+   fs::remove_all(scratch, error);
+   return EXIT_SUCCESS;
+}
+
+//====================================================================================================================
+
+template <typename Operation>
+void Reporter::run(const char *name, uint64_t size, Operation &&operation)
+{
+   if (!wants(name))
+   {
+      return;
+   }
+
+   operation(); // warm up caches, the page cache and commandArena
+   commandArena.reset();
+
+   // the server resets commandArena after every command, so do the benchmarks
+   Histogram latency;
+   uint64_t allocationsBefore = allocationCount();
+   auto start = std::chrono::steady_clock::now();
+   auto budget = std::chrono::duration<double>(options.seconds);
+   while (latency.count() < MAX_ITERATIONS &&
+          (latency.count() < MIN_ITERATIONS || std::chrono::steady_clock::now() - start < budget))
+   {
+      auto before = std::chrono::steady_clock::now();
+      operation();
+      latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before).count());
+      commandArena.reset();
+   }
+   double allocations = (double)(allocationCount() - allocationsBefore) / latency.count();
+
+   fprintf(output,
+           "{\"label\":\"%s\",\"benchmark\":\"%s\",\"size\":%lu,\"iterations\":%lu,\"mean_ns\":%.0f,"
+           "\"p50_ns\":%lu,\"p99_ns\":%lu,\"min_ns\":%lu,\"max_ns\":%lu,\"allocations\":%.1f}\n",
+           options.label.c_str(), name, (unsigned long)size, (unsigned long)latency.count(), latency.mean(),
+           (unsigned long)latency.percentile(50), (unsigned long)latency.percentile(99),
+           (unsigned long)latency.min(), (unsigned long)latency.max(), allocations);
+   fflush(output);
+}
+
+//====================================================================================================================
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+   for (int i = 1; i < argc; i++)
+   {
+      string option = argv[i];
+      if (i + 1 >= argc)
+      {
+         return false;
+      }
+      string value = argv[++i];
+
+      if (option == "--dir")
+      {
+         options.directory = value;
+      }
+      else if (option == "--max-mailbox")
+      {
+         options.maxMailbox = (size_t)atol(value.c_str());
+      }
+      else if (option == "--max-blacklist")
+      {
+         options.maxBlacklist = (size_t)atol(value.c_str());
+      }
+      else if (option == "--seconds")
+      {
+         options.seconds = atof(value.c_str());
+      }
+      else if (option == "--label")
+      {
+         options.label = value;
+      }
+      else if (option == "--only")
+      {
+         options.only = value;
+      }
+      else
+      {
+         return false;
+      }
+   }
+   return options.seconds > 0;
+}
+
+// minimum, minimum * factor, ... up to maximum
+std::vector<uint64_t> sizesUpTo(uint64_t minimum, uint64_t maximum, uint64_t factor)
+{
+   std::vector<uint64_t> sizes;
+   for (uint64_t size = minimum; size <= maximum; size *= factor)
+   {
+      sizes.push_back(size);
+   }
+   return sizes;
+}
+
+//====================================================================================================================
+
+// Grows the mailbox to count messages, named by uuid like emailSend() does
+void fillMailbox(const string &path, size_t count, size_t &filled, std::mt19937 &random)
+{
+   for (; filled < count; filled++)
+   {
+      uuid_t uuid;
+      char uuidString[37];
+      uuid_generate(uuid);
+      uuid_unparse(uuid, uuidString);
+      writeToFile((path + "/" + uuidString).c_str(), "sender" + to_string(random() % 100),
+                  "subject " + to_string(filled), string(200, 'x'));
+   }
+}
+
+void benchMailbox(Reporter &reporter, const Options &options, const string &baseDirectory)
+{
+   if (!reporter.wants("findFile") && !reporter.wants("list") && !reporter.wants("read"))
+   {
+      return; // filling the mailboxes takes longer than measuring them
+   }
+
+   string path = baseDirectory + "/" + BENCH_USER;
+   createDirIfNotCreated(BENCH_USER, baseDirectory);
+   std::mt19937 random(42);
+   size_t filled = 0;
+
+   for (uint64_t size : sizesUpTo(10, options.maxMailbox, 10))
+   {
+      fillMailbox(path, size, filled, random);
+
+      // a random message each time, findFile() is linear in its position
+      reporter.run("findFile", size, [&]() { findFile(path, random() % size + 1); });
+      reporter.run("list", size, [&]() { list(BENCH_USER, baseDirectory); });
+      reporter.run("read", size, [&]() { read(BENCH_USER, baseDirectory, random() % size + 1); });
+   }
+}
+
+//====================================================================================================================
+
+void benchWrite(Reporter &reporter, const string &baseDirectory)
+{
+   string path = baseDirectory + "/write";
+   fs::create_directory(path);
+   uint64_t written = 0;
+
+   for (uint64_t size : sizesUpTo(64, 1024 * 1024, 16))
+   {
+      string message(size, 'x');
+      reporter.run("writeToFile", size, [&]() {
+         writeToFile((path + "/" + to_string(written++)).c_str(), "sender", "subject", message);
+      });
+   }
+   std::error_code error;
+   fs::remove_all(path, error);
+}
+
+//====================================================================================================================
+
+// The argument lines of a text SEND with a message of messageSize bytes in 64 byte lines
+string sendCommand(size_t messageSize)
+{
+   string command = "receiver\nsubject\n";
+   for (size_t written = 0; written < messageSize; written += 64)
+   {
+      command += string(std::min<size_t>(63, messageSize - written), 'x') + "\n";
+   }
+   return command + ".\n";
+}
+
+void benchSend(Reporter &reporter, const string &baseDirectory)
+{
+   for (uint64_t size : sizesUpTo(64, 1024 * 1024, 16))
+   {
+      string command = sendCommand(size);
+      std::vector<std::string_view> args;
+      reporter.run("parseSend", size, [&]() {
+         parseTextArguments(Opcode::SEND, command, args);
+      });
+   }
+
+   // validation, uuid, directory check and the write, the receiver grows by one message per call
+   for (uint64_t size : sizesUpTo(64, 1024 * 1024, 16))
+   {
+      string message(size, 'x');
+      string receiver = "send" + to_string(size);
+      reporter.run("emailSend", size, [&]() { emailSend("sender", baseDirectory, receiver, "subject", message); });
+      std::error_code error;
+      fs::remove_all(baseDirectory + "/" + receiver, error);
+   }
+}
+
+//====================================================================================================================
+
+void writeBlacklist(size_t entries)
+{
+   std::ofstream blacklist(BLACKLIST);
+   for (size_t i = 0; i < entries; i++)
+   {
+      blacklist << "10." << (i >> 16 & 0xff) << "." << (i >> 8 & 0xff) << "." << (i & 0xff) << "\n";
+   }
+}
+
+void benchBlacklist(Reporter &reporter, const Options &options)
+{
+   if (!reporter.wants("checkBlacklist"))
+   {
+      return;
+   }
+   for (uint64_t size : sizesUpTo(10, options.maxBlacklist, 10))
+   {
+      writeBlacklist(size);
+      // an address that is not listed is the common case and has to read the whole list
+      reporter.run("checkBlacklist", size, [&]() { checkBlacklist("192.168.0.1"); });
+   }
+   remove(BLACKLIST);
+}
+
+//====================================================================================================================
+
+// what RESUME costs instead of the authenticator, size is the length of the username
+void benchTickets(Reporter &reporter)
+{
+   TicketSigner signer;
+   if (!signer.generateKey())
+   {
+      return;
+   }
+   for (uint64_t size : {8, 64, 512})
+   {
+      string ticket = signer.issue(string(size, 'u'), (int64_t)time(nullptr) + 3600);
+      string username;
+      reporter.run("verifyTicket", size, [&]() { signer.verify(ticket, time(nullptr), username); });
+   }
+}
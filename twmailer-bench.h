@@ -0,0 +1,67 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <uuid/uuid.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+
+#include "twmailer-server.h"
+#include "twmailer-histogram.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define MIN_ITERATIONS 3
+#define MAX_ITERATIONS 1000000
+#define BENCH_USER "bench"
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct Options
+{
+   string directory = "/tmp";     // scratch mailboxes and blacklist are created below it
+   size_t maxMailbox = 100000;    // largest synthetic mailbox, in messages
+   size_t maxBlacklist = 1000000; // largest synthetic blacklist, in entries
+   double seconds = 0.5;          // time spent per benchmark and size
+   string label;                  // copied into every result, e.g. the commit
+   string only;                   // run only benchmarks with this name
+};
+
+// One line of JSON per benchmark and size on the original stdout, so runs can be diffed and plotted
+class Reporter
+{
+public:
+   Reporter(FILE *output, const Options &options) : output(output), options(options) {}
+
+   bool wants(const char *name) const { return options.only.empty() || options.only == name; }
+   template <typename Operation>
+   void run(const char *name, uint64_t size, Operation &&operation);
+
+private:
+   FILE *output;
+   const Options &options;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool parseOptions(int argc, char *argv[], Options &options);
+std::vector<uint64_t> sizesUpTo(uint64_t minimum, uint64_t maximum, uint64_t factor);
+void fillMailbox(const string &path, size_t count, size_t &filled, std::mt19937 &random);
+void writeBlacklist(size_t entries);
+string sendCommand(size_t messageSize);
+void benchMailbox(Reporter &reporter, const Options &options, const string &baseDirectory);
+void benchWrite(Reporter &reporter, const string &baseDirectory);
+void benchSend(Reporter &reporter, const string &baseDirectory);
+void benchBlacklist(Reporter &reporter, const Options &options);
+void benchTickets(Reporter &reporter);
@@ -0,0 +1,134 @@
+#include "twmailer-capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define CAPTURE_BUFFER (64 * 1024) // stdio buffer of the writer
+#define CAPTURE_CHUNK 4096         // read size of the reader, decodeFrame() moves the rest of the buffer per record
+
+bool CaptureWriter::open(const std::string &path)
+{
+   file = fopen(path.c_str(), "wb");
+   if (file == nullptr)
+   {
+      perror("unable to open capture file");
+      return false;
+   }
+   setvbuf(file, nullptr, _IOFBF, CAPTURE_BUFFER);
+   fputs(CAPTURE_MAGIC, file);
+   start = std::chrono::steady_clock::now();
+   return true;
+}
+
+void CaptureWriter::close()
+{
+   std::lock_guard<std::mutex> lock(mutex);
+   if (file != nullptr)
+   {
+      fclose(file);
+      file = nullptr;
+   }
+}
+
+void CaptureWriter::record(CaptureRecord record)
+{
+   if (record.opcode == Opcode::LOGIN && record.args.size() >= 2)
+   {
+      record.args[1] = CAPTURE_REDACTED;
+   }
+   // a ticket is as good as the password until it expires, only "<username>:<expiry>:" is kept
+   if (record.opcode == Opcode::RESUME && record.args.size() == 1)
+   {
+      size_t signature = record.args[0].rfind(':');
+      record.args[0] = record.args[0].substr(0, signature == std::string::npos ? 0 : signature + 1) + CAPTURE_REDACTED;
+   }
+
+   Frame frame;
+   frame.code = (uint8_t)record.opcode;
+   frame.requestId = record.session;
+   frame.fields.reserve(record.args.size() + 3);
+   frame.fields.push_back(std::to_string(record.offsetMicros));
+   frame.fields.push_back(std::to_string(record.serviceMicros));
+   frame.fields.push_back(std::to_string((int)record.status));
+   for (std::string &arg : record.args)
+   {
+      frame.fields.push_back(std::move(arg));
+   }
+   std::string encoded = encodeFrame(frame);
+
+   std::lock_guard<std::mutex> lock(mutex);
+   if (file != nullptr && fwrite(encoded.data(), 1, encoded.size(), file) != encoded.size())
+   {
+      perror("capture write failed");
+   }
+}
+
+void CaptureWriter::endSession(uint32_t session)
+{
+   CaptureRecord record;
+   record.session = session;
+   record.opcode = Opcode::QUIT;
+   record.offsetMicros = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start).count();
+   this->record(record);
+}
+
+//====================================================================================================================
+
+CaptureReader::~CaptureReader()
+{
+   if (file != nullptr)
+   {
+      fclose(file);
+   }
+}
+
+bool CaptureReader::open(const std::string &path)
+{
+   file = fopen(path.c_str(), "rb");
+   if (file == nullptr)
+   {
+      perror("unable to open capture file");
+      return false;
+   }
+
+   char magic[sizeof(CAPTURE_MAGIC)] = {0};
+   if (fread(magic, 1, sizeof(CAPTURE_MAGIC) - 1, file) != sizeof(CAPTURE_MAGIC) - 1 ||
+       strcmp(magic, CAPTURE_MAGIC) != 0)
+   {
+      fprintf(stderr, "%s is not a capture file\n", path.c_str());
+      return false;
+   }
+   return true;
+}
+
+int CaptureReader::next(CaptureRecord &record)
+{
+   Frame frame;
+   int rc;
+   while ((rc = decodeFrame(buffer, frame)) == 0)
+   {
+      char chunk[CAPTURE_CHUNK];
+      size_t size = fread(chunk, 1, sizeof(chunk), file);
+      if (size == 0)
+      {
+         // a server that was killed may leave half a record behind
+         return buffer.empty() ? 0 : -1;
+      }
+      buffer.append(chunk, size);
+   }
+   if (rc == -1 || frame.fields.size() < 3)
+   {
+      return -1;
+   }
+
+   record.session = frame.requestId;
+   record.opcode = (Opcode)frame.code;
+   record.offsetMicros = strtoull(frame.fields[0].c_str(), nullptr, 10);
+   record.serviceMicros = strtoull(frame.fields[1].c_str(), nullptr, 10);
+   record.status = (Status)atoi(frame.fields[2].c_str());
+   record.args.assign(std::make_move_iterator(frame.fields.begin() + 3), std::make_move_iterator(frame.fields.end()));
+   return 1;
+}
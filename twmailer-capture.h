@@ -0,0 +1,69 @@
+#ifndef TWMAILER_CAPTURE_H
+#define TWMAILER_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "twmailer-protocol.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Capture files: the magic line, then one protocol v2 frame per executed command with
+// code = opcode, request id = session and the fields
+//    <microseconds since capture start> <service time in microseconds> <status> <arguments...>
+// A session that disconnects gets a record with opcode QUIT and no arguments.
+
+#define CAPTURE_MAGIC "TWMAILER-CAPTURE 1\n"
+#define CAPTURE_REDACTED "redacted"
+
+struct CaptureRecord
+{
+   uint32_t session = 0;
+   Opcode opcode = Opcode::NONE;
+   uint64_t offsetMicros = 0;
+   uint64_t serviceMicros = 0;
+   Status status = Status::OK;
+   std::vector<std::string> args;
+};
+
+// Shared by all workers, records are appended under one mutex in the order commands finish
+class CaptureWriter
+{
+public:
+   bool open(const std::string &path);
+   bool isOpen() const { return file != nullptr; }
+   void close();
+
+   uint32_t newSession() { return ++sessions; }
+   std::chrono::steady_clock::time_point started() const { return start; }
+   // LOGIN passwords and the signatures of RESUME tickets are replaced by CAPTURE_REDACTED
+   // before anything is written
+   void record(CaptureRecord record);
+   void endSession(uint32_t session);
+
+private:
+   FILE *file = nullptr;
+   std::mutex mutex;
+   std::atomic<uint32_t> sessions{0};
+   std::chrono::steady_clock::time_point start;
+};
+
+class CaptureReader
+{
+public:
+   ~CaptureReader();
+   bool open(const std::string &path);
+   // 1 record read, 0 end of file, -1 malformed file
+   int next(CaptureRecord &record);
+
+private:
+   FILE *file = nullptr;
+   std::string buffer;
+};
+
+#endif
@@ -7,8 +7,57 @@ int main(int argc, char *argv[])
    int create_socket;
    char buffer[BUF];
    struct sockaddr_in address;
+   struct sockaddr_un localAddress;
    int size;
    int isQuit;
+   bool useV2 = false;
+   bool batch = false;
+   string batchFile;
+   string username = getenv("TWMAILER_USER") ? getenv("TWMAILER_USER") : "";
+   int passwordFd = -1;
+   string ticketFile; // --ticket-file=<path>, batch mode keeps its session ticket there
+   uint32_t requestId = 0;
+   string inbuf;
+
+   // options may appear anywhere, the remaining arguments are <ip> <port> or the path of the server's --unix socket
+   vector<string> positional;
+   for (int i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "--v2") == 0)
+      {
+         useV2 = true;
+      }
+      else if (strcmp(argv[i], "--batch") == 0)
+      {
+         batch = true;
+      }
+      else if (strncmp(argv[i], "--batch=", 8) == 0)
+      {
+         batch = true;
+         batchFile = argv[i] + 8;
+      }
+      else if (strncmp(argv[i], "--user=", 7) == 0)
+      {
+         username = argv[i] + 7;
+      }
+      else if (strncmp(argv[i], "--password-fd=", 14) == 0)
+      {
+         passwordFd = atoi(argv[i] + 14);
+      }
+      else if (strncmp(argv[i], "--ticket-file=", 14) == 0)
+      {
+         ticketFile = argv[i] + 14;
+      }
+      else
+      {
+         positional.push_back(argv[i]);
+      }
+   }
+
+   // batch mode keeps stdout for results, everything else goes to stderr
+   FILE *info = batch ? stderr : stdout;
+   useV2 = useV2 || batch;
+   bool local = !positional.empty() && positional[0].find('/') != string::npos;
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A SOCKET
@@ -16,7 +65,7 @@ int main(int argc, char *argv[])
    // https://man7.org/linux/man-pages/man7/ip.7.html
    // https://man7.org/linux/man-pages/man7/tcp.7.html
    // IPv4, TCP (connection oriented), IP (same as server)
-   if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   if ((create_socket = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM, 0)) == -1)
    {
       perror("Socket error");
       return EXIT_FAILURE;
@@ -28,30 +77,42 @@ int main(int argc, char *argv[])
    memset(&address, 0, sizeof(address)); // init storage with 0
    address.sin_family = AF_INET;         // IPv4
    // https://man7.org/linux/man-pages/man3/htons.3.html
-   if(argc < 2)
+   if(positional.size() < 2)
    {
       address.sin_port = htons(PORT);
    }
    else
    {
-      address.sin_port = htons(atoi(argv[2]));
+      address.sin_port = htons(atoi(positional[1].c_str()));
    }
    // https://man7.org/linux/man-pages/man3/inet_aton.3.html
-   if (argc < 2)
+   if (positional.empty())
    {
       inet_aton("127.0.0.1", &address.sin_addr);
    }
    else
    {
-      inet_aton(argv[1], &address.sin_addr);
+      inet_aton(positional[0].c_str(), &address.sin_addr);
    }
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A CONNECTION
    // https://man7.org/linux/man-pages/man2/connect.2.html
+   // https://man7.org/linux/man-pages/man7/unix.7.html
+   memset(&localAddress, 0, sizeof(localAddress));
+   localAddress.sun_family = AF_UNIX;
+   if (local && positional[0].size() >= sizeof(localAddress.sun_path))
+   {
+      fprintf(stderr, "socket path too long: %s\n", positional[0].c_str());
+      return EXIT_FAILURE;
+   }
+   else if (local)
+   {
+      strcpy(localAddress.sun_path, positional[0].c_str());
+   }
    if (connect(create_socket,
-               (struct sockaddr *)&address,
-               sizeof(address)) == -1)
+               local ? (struct sockaddr *)&localAddress : (struct sockaddr *)&address,
+               local ? sizeof(localAddress) : sizeof(address)) == -1)
    {
       // https://man7.org/linux/man-pages/man3/perror.3.html
       perror("Connect error - no server available");
@@ -59,8 +120,8 @@ int main(int argc, char *argv[])
    }
 
    // ignore return value of printf
-   printf("Connection with server (%s) established\n",
-          inet_ntoa(address.sin_addr));
+   fprintf(info, "Connection with server (%s) established\n",
+           local ? localAddress.sun_path : inet_ntoa(address.sin_addr));
 
    ////////////////////////////////////////////////////////////////////////////
    // RECEIVE DATA
@@ -72,12 +133,67 @@ int main(int argc, char *argv[])
    }
    else if (size == 0)
    {
-      printf("Server closed remote socket\n"); // ignore error
+      fprintf(info, "Server closed remote socket\n"); // ignore error
    }
    else
    {
       buffer[size] = '\0';
-      printf("%s", buffer); // ignore error
+      fprintf(info, "%s", buffer); // ignore error
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // SWITCH TO BINARY PROTOCOL
+   if (useV2)
+   {
+      string hello = string(V2_HELLO) + "\n";
+      string answer;
+      if (!sendAll(create_socket, hello))
+      {
+         perror("send error");
+         close(create_socket);
+         return EXIT_FAILURE;
+      }
+      while (answer.find('\n') == string::npos)
+      {
+         size = recv(create_socket, buffer, BUF - 1, 0);
+         if (size <= 0)
+         {
+            break;
+         }
+         answer.append(buffer, size);
+      }
+      if (answer != "OK\n")
+      {
+         fprintf(stderr, "server does not support protocol v2\n");
+         close(create_socket);
+         return EXIT_FAILURE;
+      }
+      fprintf(info, "Switched to protocol v2\n");
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // NON-INTERACTIVE MODE
+   if (batch)
+   {
+      string password = readPassword(passwordFd);
+      int rc;
+      if (batchFile.empty())
+      {
+         rc = runBatch(create_socket, cin, username, password, ticketFile);
+      }
+      else
+      {
+         ifstream input(batchFile);
+         if (!input)
+         {
+            perror("unable to open batch file");
+            close(create_socket);
+            return EXIT_FAILURE;
+         }
+         rc = runBatch(create_socket, input, username, password, ticketFile);
+      }
+      close(create_socket);
+      return rc;
    }
 
    string message;
@@ -89,13 +205,68 @@ int main(int argc, char *argv[])
       checkCommand(message);
       isQuit = strcmp(message.c_str(), "QUIT") == 0;
 
-      if (message != "")
+      if (message == "IDLE")
+      {
+         if (!idle(create_socket, useV2, requestId, inbuf))
+         {
+            printf("Server closed remote socket\n"); // ignore error
+            break;
+         }
+      }
+      else if (message != "" && useV2)
+      {
+         // ranges become several requests, all sent before the first reply is awaited
+         vector<Frame> requests = expandRequest(toFrame(message, 0), requestId);
+         string out;
+         for (const Frame &request : requests)
+         {
+            out += encodeFrame(request);
+         }
+         if (!sendAll(create_socket, out))
+         {
+            perror("send error");
+            break;
+         }
+
+         bool closed = false;
+         for (const Frame &request : requests)
+         {
+            // MREAD streams one frame per message and ends with a frame holding only the count
+            Frame response;
+            do
+            {
+               if (!receiveFrame(create_socket, inbuf, response))
+               {
+                  closed = true;
+                  break;
+               }
+               printFrame((Opcode)request.code, response);
+            } while ((Opcode)request.code == Opcode::MREAD && response.code == (uint8_t)Status::OK &&
+                     response.fields.size() != 1);
+            if (closed)
+            {
+               break;
+            }
+         }
+         if (closed)
+         {
+            printf("Server closed remote socket\n"); // ignore error
+            break;
+         }
+      }
+      else if (message != "" && isRange(message))
+      {
+         printf("ERROR: Message ranges need protocol v2 (start with --v2)\n");
+      }
+      else if (message != "")
       {
          //////////////////////////////////////////////////////////////////////
          // SEND DATA
          // https://man7.org/linux/man-pages/man2/send.2.html
          // send will fail if connection is closed, but does not set
          // the error of send, but still the count of bytes sent
+         // every command ends with a newline so the server can tell pipelined commands apart
+         message += "\n";
          if ((send(create_socket, message.c_str(), message.size(), 0)) == -1)
          {
             // in case the server is gone offline we will still not enter
@@ -242,7 +413,31 @@ void checkCommand(string &message)
       return;
    }
 
-   else if(message == "QUIT")
+   else if(message == "MREAD" || message == "MDEL")
+   {
+      cout << "Message-Numbers (e.g. 1-5,8): ";
+      getline(cin, buffer, '\n');
+      message = message + "\n" + buffer;
+      return;
+   }
+
+   else if(message == "RESUME")
+   {
+      cout << "Ticket: ";
+      getline(cin, buffer, '\n');
+      message = message + "\n" + buffer;
+      return;
+   }
+
+   else if(message == "CONFIG")
+   {
+      cout << "Setting (name=value, empty to list): ";
+      getline(cin, buffer, '\n');
+      message = message + "\n" + buffer;
+      return;
+   }
+
+   else if(message == "QUIT" || message == "IDLE" || message == "STATS")
    {
       return;
    }
@@ -255,6 +450,556 @@ void checkCommand(string &message)
    return;
 }
 
+//====================================================================================================================
+
+bool sendAll(int socket, const string &data)
+{
+   size_t sent = 0;
+   while (sent < data.size())
+   {
+      ssize_t rc = send(socket, data.data() + sent, data.size() - sent, 0);
+      if (rc == -1)
+      {
+         return false;
+      }
+      sent += rc;
+   }
+   return true;
+}
+
+//====================================================================================================================
+
+// Turns the lines gathered by checkCommand() into a v2 request, the SEND message ends at the '.' line
+Frame toFrame(const string &message, uint32_t requestId)
+{
+   Frame frame;
+   frame.requestId = requestId;
+
+   vector<string> lines;
+   size_t start = 0;
+   while (start <= message.size())
+   {
+      size_t end = message.find('\n', start);
+      if (end == string::npos)
+      {
+         end = message.size();
+      }
+      lines.push_back(message.substr(start, end - start));
+      start = end + 1;
+   }
+
+   Opcode opcode = opcodeFromName(lines[0]);
+   frame.code = (uint8_t)opcode;
+   if (opcode == Opcode::SEND && lines.size() >= 3)
+   {
+      frame.fields = {lines[1], lines[2]};
+      string body;
+      for (size_t i = 3; i < lines.size() && lines[i] != "."; i++)
+      {
+         body += (i > 3 ? "\n" : "") + lines[i];
+      }
+      frame.fields.push_back(body);
+   }
+   else
+   {
+      frame.fields.assign(lines.begin() + 1, lines.end());
+   }
+   return frame;
+}
+
+//====================================================================================================================
+
+bool isRange(const string &message)
+{
+   return (message.rfind("READ\n", 0) == 0 || message.rfind("DEL\n", 0) == 0) &&
+          message.find_first_of("-,") != string::npos;
+}
+
+// READ/DEL over a range like "1-5,8" turns into one request per message. Deletes run from the
+// highest number down, so removing one message does not shift the numbers still to be deleted.
+vector<Frame> expandRequest(const Frame &frame, uint32_t &requestId)
+{
+   vector<Frame> requests;
+   vector<int> numbers;
+   Opcode opcode = (Opcode)frame.code;
+
+   if ((opcode == Opcode::READ || opcode == Opcode::DEL) && frame.fields.size() == 1 &&
+       frame.fields[0].find_first_of("-,") != string::npos && parseMessageRange(frame.fields[0], numbers))
+   {
+      if (opcode == Opcode::DEL)
+      {
+         sort(numbers.begin(), numbers.end(), std::greater<int>());
+         numbers.erase(unique(numbers.begin(), numbers.end()), numbers.end());
+      }
+      for (int number : numbers)
+      {
+         Frame request = frame;
+         request.requestId = ++requestId;
+         request.fields = {to_string(number)};
+         requests.push_back(request);
+      }
+      return requests;
+   }
+
+   requests.push_back(frame);
+   requests.back().requestId = ++requestId;
+   return requests;
+}
+
+//====================================================================================================================
+
+bool receiveFrame(int socket, string &inbuf, Frame &frame)
+{
+   char buffer[BUF];
+   int rc;
+   while ((rc = decodeFrame(inbuf, frame)) == 0)
+   {
+      int size = recv(socket, buffer, BUF, 0);
+      if (size <= 0)
+      {
+         return false;
+      }
+      inbuf.append(buffer, size);
+   }
+   return rc == 1;
+}
+
+//====================================================================================================================
+
+void printFrame(Opcode opcode, const Frame &frame)
+{
+   Status status = (Status)frame.code;
+   if (status != Status::OK)
+   {
+      printf("<< ERR %s [%u]\n", statusName(status), frame.requestId);
+      return;
+   }
+
+   if (opcode == Opcode::LIST)
+   {
+      printf("<< Number of emails: %zu\n", frame.fields.size());
+      for (size_t i = 0; i < frame.fields.size(); i++)
+      {
+         printf("%zu: %s\n", i + 1, frame.fields[i].c_str());
+      }
+   }
+   else if (opcode == Opcode::MREAD && frame.fields.size() == 4)
+   {
+      printf("<< Message-Number: %s\nSender: %s\nSubject: %s\nMessage: %s\n",
+             frame.fields[0].c_str(), frame.fields[1].c_str(), frame.fields[2].c_str(), frame.fields[3].c_str());
+   }
+   else if (opcode == Opcode::MREAD && frame.fields.size() == 1)
+   {
+      printf("<< Number of emails: %s\n", frame.fields[0].c_str());
+   }
+   else if (opcode == Opcode::STATS || opcode == Opcode::CONFIG)
+   {
+      printf("<< OK\n");
+      for (const string &line : frame.fields)
+      {
+         printf("%s\n", line.c_str());
+      }
+   }
+   else if (opcode == Opcode::READ && frame.fields.size() == 3)
+   {
+      printf("<< Sender: %s\nSubject: %s\nMessage: %s\n",
+             frame.fields[0].c_str(), frame.fields[1].c_str(), frame.fields[2].c_str());
+   }
+   else
+   {
+      printf("<< OK\n");
+   }
+}
+
+//====================================================================================================================
+
+// Waits for new mail notifications until the user presses enter, then ends IDLE with DONE
+bool idle(int socket, bool useV2, uint32_t &requestId, string &inbuf)
+{
+   char buffer[BUF];
+   uint32_t idleId = ++requestId;
+   uint32_t doneId = 0;
+   bool confirmed = false;
+   Frame frame;
+
+   frame.code = (uint8_t)Opcode::IDLE;
+   frame.requestId = idleId;
+   if (!sendAll(socket, useV2 ? encodeFrame(frame) : string("IDLE\n")))
+   {
+      return false;
+   }
+   printf("Waiting for new messages, press enter to stop...\n");
+
+   struct pollfd fds[2];
+   fds[0].fd = STDIN_FILENO;
+   fds[0].events = POLLIN;
+   fds[1].fd = socket;
+   fds[1].events = POLLIN;
+
+   while (true)
+   {
+      // replies that are already buffered do not show up in poll()
+      if (useV2)
+      {
+         int rc;
+         while ((rc = decodeFrame(inbuf, frame)) == 1)
+         {
+            if (doneId != 0 && frame.requestId == doneId)
+            {
+               printf("<< %s\n", statusName((Status)frame.code));
+               return true;
+            }
+            if (frame.code != (uint8_t)Status::OK)
+            {
+               printf("<< ERR %s\n", statusName((Status)frame.code));
+               return true;
+            }
+            if (frame.fields.size() == 1)
+            {
+               printf("<< new message %s\n", frame.fields[0].c_str());
+            }
+         }
+         if (rc == -1)
+         {
+            return false;
+         }
+      }
+      else
+      {
+         size_t end;
+         while ((end = inbuf.find('\n')) != string::npos)
+         {
+            string line = inbuf.substr(0, end);
+            inbuf.erase(0, end + 1);
+            // the first OK confirms IDLE, the second one answers DONE
+            if (line == "OK" && !confirmed)
+            {
+               confirmed = true;
+               continue;
+            }
+            printf("<< %s\n", line.c_str());
+            if (line == "OK" || line == "ERR")
+            {
+               return true;
+            }
+         }
+      }
+
+      if (poll(fds, 2, -1) == -1)
+      {
+         return false;
+      }
+
+      if (doneId == 0 && (fds[0].revents & POLLIN))
+      {
+         string line;
+         getline(cin, line, '\n');
+         frame.code = (uint8_t)Opcode::DONE;
+         frame.requestId = doneId = ++requestId;
+         frame.fields.clear();
+         if (!sendAll(socket, useV2 ? encodeFrame(frame) : string("DONE\n")))
+         {
+            return false;
+         }
+         fds[0].fd = -1; // poll ignores negative descriptors
+      }
+
+      if (fds[1].revents & (POLLIN | POLLHUP))
+      {
+         int size = recv(socket, buffer, BUF, 0);
+         if (size <= 0)
+         {
+            return false;
+         }
+         inbuf.append(buffer, size);
+      }
+   }
+}
+
+//====================================================================================================================
+
+// TWMAILER_PASSWORD, or the first line readable from the given descriptor (e.g. --password-fd=3 3<secret)
+string readPassword(int passwordFd)
+{
+   if (passwordFd < 0)
+   {
+      return getenv("TWMAILER_PASSWORD") ? getenv("TWMAILER_PASSWORD") : "";
+   }
+
+   string password;
+   char ch;
+   while (read(passwordFd, &ch, 1) == 1 && ch != '\n')
+   {
+      password += ch;
+   }
+   return password;
+}
+
+// First line of the ticket file, empty if there is none yet
+string loadTicket(const string &path)
+{
+   string ticket;
+   ifstream file(path);
+   getline(file, ticket);
+   return ticket;
+}
+
+// The ticket logs in like the password until it expires, so only the owner may read the file
+void saveTicket(const string &path, const string &ticket)
+{
+   int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   string line = ticket + "\n";
+   if (fd == -1 || write(fd, line.data(), line.size()) != (ssize_t)line.size())
+   {
+      perror("unable to save session ticket");
+   }
+   if (fd != -1)
+   {
+      close(fd);
+   }
+}
+
+//====================================================================================================================
+
+// Batch fields are separated by tabs, so tabs, newlines and backslashes inside a field are escaped
+string escapeField(const string &field)
+{
+   string escaped;
+   for (char ch : field)
+   {
+      switch (ch)
+      {
+      case '\\':
+         escaped += "\\\\";
+         break;
+      case '\t':
+         escaped += "\\t";
+         break;
+      case '\n':
+         escaped += "\\n";
+         break;
+      case '\r':
+         escaped += "\\r";
+         break;
+      default:
+         escaped += ch;
+      }
+   }
+   return escaped;
+}
+
+string unescapeField(const string &field)
+{
+   string text;
+   for (size_t i = 0; i < field.size(); i++)
+   {
+      if (field[i] != '\\' || i + 1 == field.size())
+      {
+         text += field[i];
+         continue;
+      }
+      switch (field[++i])
+      {
+      case 't':
+         text += '\t';
+         break;
+      case 'n':
+         text += '\n';
+         break;
+      case 'r':
+         text += '\r';
+         break;
+      default:
+         text += field[i];
+      }
+   }
+   return text;
+}
+
+//====================================================================================================================
+
+// One result line per reply: <input line> TAB <command> TAB <status> [TAB <field>]...
+static void printResult(size_t line, Opcode opcode, const Frame &frame)
+{
+   string result = to_string(line) + "\t" + opcodeName(opcode) + "\t" + statusName((Status)frame.code);
+   for (const string &field : frame.fields)
+   {
+      result += "\t" + escapeField(field);
+   }
+   result += "\n";
+   fwrite(result.data(), 1, result.size(), stdout);
+}
+
+// Reads one command per line (COMMAND TAB argument TAB ...), logs in first and pipelines everything
+// over protocol v2 with at most BATCH_WINDOW requests in flight. Returns EXIT_FAILURE if any command failed.
+// With a ticket file the saved session ticket is tried first (RESUME); if it is missing or rejected,
+// LOGIN asks for a new one and saves it for the next run.
+int runBatch(int socket, istream &input, const string &username, const string &password, const string &ticketFile)
+{
+   struct Pending
+   {
+      size_t line;
+      Opcode opcode;
+   };
+   std::deque<Pending> pending;
+   string inbuf;
+   string out;
+   uint32_t requestId = 0;
+   bool failed = false;
+
+   // a reply for every request that is in flight, MREAD streams several
+   auto receiveOne = [&]() -> bool
+   {
+      Frame response;
+      do
+      {
+         if (!receiveFrame(socket, inbuf, response))
+         {
+            return false;
+         }
+         if (pending.front().opcode == Opcode::LOGIN && response.code == (uint8_t)Status::OK &&
+             response.fields.size() == 1 && !ticketFile.empty())
+         {
+            saveTicket(ticketFile, response.fields[0]);
+            response.fields.clear(); // not on stdout
+         }
+         printResult(pending.front().line, pending.front().opcode, response);
+      } while (pending.front().opcode == Opcode::MREAD && response.code == (uint8_t)Status::OK &&
+               response.fields.size() != 1);
+
+      failed = failed || response.code != (uint8_t)Status::OK;
+      pending.pop_front();
+      return true;
+   };
+
+   auto queue = [&](size_t line, const Frame &request) -> bool
+   {
+      out += encodeFrame(request);
+      pending.push_back({line, (Opcode)request.code});
+      if (pending.size() < BATCH_WINDOW)
+      {
+         return true;
+      }
+      if (!sendAll(socket, out))
+      {
+         return false;
+      }
+      out.clear();
+      while (pending.size() > BATCH_WINDOW / 2)
+      {
+         if (!receiveOne())
+         {
+            return false;
+         }
+      }
+      return true;
+   };
+
+   // the reply to RESUME decides whether LOGIN is needed, so it is not pipelined
+   string ticket = ticketFile.empty() ? "" : loadTicket(ticketFile);
+   bool resumed = false;
+   if (!ticket.empty())
+   {
+      Frame resume;
+      resume.code = (uint8_t)Opcode::RESUME;
+      resume.requestId = ++requestId;
+      resume.fields = {ticket};
+      Frame response;
+      if (!sendAll(socket, encodeFrame(resume)) || !receiveFrame(socket, inbuf, response))
+      {
+         return EXIT_FAILURE;
+      }
+      resumed = response.code == (uint8_t)Status::OK;
+      if (resumed)
+      {
+         printResult(0, Opcode::RESUME, response);
+      }
+   }
+
+   if (!resumed)
+   {
+      Frame login;
+      login.code = (uint8_t)Opcode::LOGIN;
+      login.requestId = ++requestId;
+      login.fields = {username, password};
+      if (!ticketFile.empty())
+      {
+         login.fields.push_back("ticket");
+      }
+      if (!queue(0, login))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+
+   string line;
+   size_t lineNumber = 0;
+   while (getline(input, line))
+   {
+      lineNumber++;
+      if (!line.empty() && line.back() == '\r')
+      {
+         line.pop_back();
+      }
+      if (line.empty() || line[0] == '#')
+      {
+         continue;
+      }
+
+      Frame request;
+      request.requestId = ++requestId;
+      size_t start = 0;
+      while (start <= line.size())
+      {
+         size_t end = line.find('\t', start);
+         if (end == string::npos)
+         {
+            end = line.size();
+         }
+         request.fields.push_back(unescapeField(line.substr(start, end - start)));
+         start = end + 1;
+      }
+
+      Opcode opcode = opcodeFromName(request.fields[0]);
+      request.fields.erase(request.fields.begin());
+      if (opcode == Opcode::NONE || opcode == Opcode::LOGIN || opcode == Opcode::QUIT ||
+          opcode == Opcode::IDLE || opcode == Opcode::DONE || opcode == Opcode::RESUME)
+      {
+         fprintf(stderr, "line %zu: unsupported command\n", lineNumber);
+         failed = true;
+         continue;
+      }
+      request.code = (uint8_t)opcode;
+
+      if (!queue(lineNumber, request))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+
+   Frame quit;
+   quit.code = (uint8_t)Opcode::QUIT;
+   quit.requestId = ++requestId;
+   out += encodeFrame(quit);
+   pending.push_back({lineNumber + 1, Opcode::QUIT});
+   if (!sendAll(socket, out))
+   {
+      return EXIT_FAILURE;
+   }
+   while (!pending.empty())
+   {
+      if (!receiveOne())
+      {
+         return EXIT_FAILURE;
+      }
+   }
+
+   fflush(stdout);
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//====================================================================================================================
+
 int getch()
 {
     int ch;
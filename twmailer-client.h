@@ -2,17 +2,25 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
 
 
 #include <string>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+
+#include "twmailer-protocol.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -21,11 +29,25 @@
 #define PASSWORD_LENGTH 80
 #define SUBJECT_LENGTH 80
 #define PORT 6543
+#define BATCH_WINDOW 256 // batch mode requests in flight before replies are collected
 
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 
 void checkCommand(string &message);
+bool sendAll(int socket, const string &data);
+Frame toFrame(const string &message, uint32_t requestId);
+bool isRange(const string &message);
+vector<Frame> expandRequest(const Frame &frame, uint32_t &requestId);
+bool receiveFrame(int socket, string &inbuf, Frame &frame);
+void printFrame(Opcode opcode, const Frame &frame);
+bool idle(int socket, bool useV2, uint32_t &requestId, string &inbuf);
+string readPassword(int passwordFd);
+string loadTicket(const string &path);
+void saveTicket(const string &path, const string &ticket);
+string escapeField(const string &field);
+string unescapeField(const string &field);
+int runBatch(int socket, istream &input, const string &username, const string &password, const string &ticketFile);
 int getch();
 std::string getpass();
\ No newline at end of file
@@ -0,0 +1,57 @@
+#include "twmailer-config.h"
+
+#include <stdio.h>
+
+#include <fstream>
+
+///////////////////////////////////////////////////////////////////////////////
+
+static std::string trimmed(const std::string &text)
+{
+   size_t start = text.find_first_not_of(" \t\r");
+   if (start == std::string::npos)
+   {
+      return "";
+   }
+   size_t end = text.find_last_not_of(" \t\r");
+   return text.substr(start, end - start + 1);
+}
+
+bool readConfigFile(const std::string &path, std::vector<std::string> &options)
+{
+   std::ifstream file(path);
+   if (!file)
+   {
+      fprintf(stderr, "unable to read config file %s\n", path.c_str());
+      return false;
+   }
+
+   std::string line;
+   int number = 0;
+   while (std::getline(file, line))
+   {
+      number++;
+      line = trimmed(line.substr(0, line.find('#')));
+      if (line.empty())
+      {
+         continue;
+      }
+
+      size_t equals = line.find('=');
+      std::string name = trimmed(line.substr(0, equals));
+      if (name.empty() || name.find_first_of(" \t") != std::string::npos)
+      {
+         fprintf(stderr, "%s:%d: expected \"name = value\"\n", path.c_str(), number);
+         return false;
+      }
+      if (equals == std::string::npos)
+      {
+         options.push_back("--" + name);
+      }
+      else
+      {
+         options.push_back("--" + name + "=" + trimmed(line.substr(equals + 1)));
+      }
+   }
+   return true;
+}
@@ -0,0 +1,21 @@
+#ifndef TWMAILER_CONFIG_H
+#define TWMAILER_CONFIG_H
+
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Server configuration file (--config=<file>). Every line is an option without its leading "--":
+//
+//    # comment
+//    port = 6543
+//    auth = local:/etc/twmailer/passwords
+//    max-threads = 64
+//    perf-counters
+//
+// The lines become "--port=6543" ... and are parsed before the command line, which overrides them.
+
+// false if the file cannot be read or a line is not "name" or "name = value"
+bool readConfigFile(const std::string &path, std::vector<std::string> &options);
+
+#endif
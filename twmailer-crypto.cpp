@@ -0,0 +1,215 @@
+#include "twmailer-crypto.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+static const uint32_t roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotateRight(uint32_t value, int bits)
+{
+   return (value >> bits) | (value << (32 - bits));
+}
+
+static void compress(uint32_t state[8], const unsigned char block[64])
+{
+   uint32_t w[64];
+   for (int i = 0; i < 16; i++)
+   {
+      w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+             (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+   }
+   for (int i = 16; i < 64; i++)
+   {
+      uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+   }
+
+   uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+   uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+   for (int i = 0; i < 64; i++)
+   {
+      uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+      uint32_t choice = (e & f) ^ (~e & g);
+      uint32_t temp1 = h + s1 + choice + roundConstants[i] + w[i];
+      uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+      uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t temp2 = s0 + majority;
+      h = g;
+      g = f;
+      f = e;
+      e = d + temp1;
+      d = c;
+      c = b;
+      b = a;
+      a = temp1 + temp2;
+   }
+
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+   state[4] += e;
+   state[5] += f;
+   state[6] += g;
+   state[7] += h;
+}
+
+std::string sha256(const std::string &data)
+{
+   uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+   size_t full = data.size() / 64 * 64;
+   for (size_t offset = 0; offset < full; offset += 64)
+   {
+      compress(state, (const unsigned char *)data.data() + offset);
+   }
+
+   // padding: 0x80, zeros, message length in bits as big endian u64
+   unsigned char tail[128];
+   memset(tail, 0, sizeof(tail));
+   size_t rest = data.size() - full;
+   memcpy(tail, data.data() + full, rest);
+   tail[rest] = 0x80;
+   size_t tailLength = rest + 1 + 8 <= 64 ? 64 : 128;
+   uint64_t bits = (uint64_t)data.size() * 8;
+   for (int i = 0; i < 8; i++)
+   {
+      tail[tailLength - 1 - i] = (unsigned char)(bits >> (8 * i));
+   }
+   compress(state, tail);
+   if (tailLength == 128)
+   {
+      compress(state, tail + 64);
+   }
+
+   std::string digest(SHA256_LENGTH, '\0');
+   for (int i = 0; i < 8; i++)
+   {
+      digest[i * 4] = (char)(state[i] >> 24);
+      digest[i * 4 + 1] = (char)(state[i] >> 16);
+      digest[i * 4 + 2] = (char)(state[i] >> 8);
+      digest[i * 4 + 3] = (char)state[i];
+   }
+   return digest;
+}
+
+// sha256((key ^ opad) + sha256((key ^ ipad) + message)), keys longer than a block are hashed first
+std::string hmacSha256(const std::string &key, const std::string &message)
+{
+   std::string block = key.size() > SHA256_BLOCK_LENGTH ? sha256(key) : key;
+   block.resize(SHA256_BLOCK_LENGTH, '\0');
+
+   std::string inner(SHA256_BLOCK_LENGTH, '\0');
+   std::string outer(SHA256_BLOCK_LENGTH, '\0');
+   for (int i = 0; i < SHA256_BLOCK_LENGTH; i++)
+   {
+      inner[i] = (char)(block[i] ^ 0x36);
+      outer[i] = (char)(block[i] ^ 0x5c);
+   }
+   return sha256(outer + sha256(inner + message));
+}
+
+//====================================================================================================================
+
+std::string toHex(const std::string &bytes)
+{
+   static const char digits[] = "0123456789abcdef";
+   std::string hex;
+   hex.reserve(bytes.size() * 2);
+   for (unsigned char byte : bytes)
+   {
+      hex += digits[byte >> 4];
+      hex += digits[byte & 0x0f];
+   }
+   return hex;
+}
+
+static int hexValue(char digit)
+{
+   if (digit >= '0' && digit <= '9')
+   {
+      return digit - '0';
+   }
+   if (digit >= 'a' && digit <= 'f')
+   {
+      return digit - 'a' + 10;
+   }
+   if (digit >= 'A' && digit <= 'F')
+   {
+      return digit - 'A' + 10;
+   }
+   return -1;
+}
+
+std::string fromHex(const std::string &hex)
+{
+   std::string bytes;
+   if (hex.size() % 2 != 0)
+   {
+      return bytes;
+   }
+   for (size_t i = 0; i < hex.size(); i += 2)
+   {
+      int high = hexValue(hex[i]);
+      int low = hexValue(hex[i + 1]);
+      if (high < 0 || low < 0)
+      {
+         return "";
+      }
+      bytes += (char)(high << 4 | low);
+   }
+   return bytes;
+}
+
+//====================================================================================================================
+
+// bytes is only valid on true, a salt or key must never fall back to zeros
+bool randomBytes(size_t length, std::string &bytes)
+{
+   bytes.assign(length, '\0');
+   size_t filled = 0;
+   while (filled < length)
+   {
+      ssize_t got = getrandom(&bytes[filled], length - filled, 0);
+      if (got == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         bytes.clear();
+         return false;
+      }
+      filled += (size_t)got;
+   }
+   return true;
+}
+
+// runtime does not depend on where the first difference is
+bool equalConstantTime(const std::string &a, const std::string &b)
+{
+   if (a.size() != b.size())
+   {
+      return false;
+   }
+   unsigned char difference = 0;
+   for (size_t i = 0; i < a.size(); i++)
+   {
+      difference |= (unsigned char)(a[i] ^ b[i]);
+   }
+   return difference == 0;
+}
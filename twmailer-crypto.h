@@ -0,0 +1,21 @@
+#ifndef TWMAILER_CRYPTO_H
+#define TWMAILER_CRYPTO_H
+
+#include <stdint.h>
+
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// SHA-256 (FIPS 180-4), kept in the tree so the server needs no crypto library
+
+#define SHA256_LENGTH 32
+#define SHA256_BLOCK_LENGTH 64
+
+std::string sha256(const std::string &data);   // raw 32 byte digest
+std::string hmacSha256(const std::string &key, const std::string &message); // RFC 2104, raw 32 bytes
+std::string toHex(const std::string &bytes);
+std::string fromHex(const std::string &hex);   // empty on invalid input
+[[nodiscard]] bool randomBytes(size_t length, std::string &bytes); // getrandom(2), false and errno set on failure
+bool equalConstantTime(const std::string &a, const std::string &b);
+
+#endif
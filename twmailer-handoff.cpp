@@ -0,0 +1,156 @@
+#include "twmailer-handoff.h"
+#include "twmailer-log.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+static bool unixAddress(const std::string &path, struct sockaddr_un &address)
+{
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (path.size() >= sizeof(address.sun_path))
+   {
+      logError("handoff socket path too long: {}", path);
+      return false;
+   }
+   strcpy(address.sun_path, path.c_str());
+   return true;
+}
+
+// Only processes of the same user may connect, sendListeners() checks the peer as well
+int openHandoffListener(const std::string &path)
+{
+   struct sockaddr_un address;
+   if (!unixAddress(path, address))
+   {
+      return -1;
+   }
+   int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (listener == -1)
+   {
+      logErrno("handoff socket");
+      return -1;
+   }
+
+   unlink(path.c_str()); // left over from a process that did not hand off
+   mode_t previous = umask(0077);
+   int rc = bind(listener, (struct sockaddr *)&address, sizeof(address));
+   umask(previous);
+   if (rc == -1 || listen(listener, 1) == -1)
+   {
+      logErrno("handoff socket bind");
+      close(listener);
+      return -1;
+   }
+   return listener;
+}
+
+//====================================================================================================================
+
+bool sendListeners(int connection, const std::vector<int> &sockets)
+{
+   struct ucred peer;
+   socklen_t length = sizeof(peer);
+   if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &length) == -1 || peer.uid != getuid())
+   {
+      logWarn("handoff refused to a process of another user");
+      return false;
+   }
+   if (sockets.empty() || sockets.size() > HANDOFF_MAX_SOCKETS)
+   {
+      return false;
+   }
+
+   std::string header = std::string(HANDOFF_MAGIC) + " " + std::to_string(sockets.size()) + "\n";
+   struct iovec data = {(void *)header.data(), header.size()};
+   char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+   memset(control, 0, sizeof(control));
+
+   struct msghdr message;
+   memset(&message, 0, sizeof(message));
+   message.msg_iov = &data;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = CMSG_SPACE(sizeof(int) * sockets.size());
+
+   struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+   rights->cmsg_level = SOL_SOCKET;
+   rights->cmsg_type = SCM_RIGHTS;
+   rights->cmsg_len = CMSG_LEN(sizeof(int) * sockets.size());
+   memcpy(CMSG_DATA(rights), sockets.data(), sizeof(int) * sockets.size());
+
+   if (sendmsg(connection, &message, MSG_NOSIGNAL) != (ssize_t)header.size())
+   {
+      logErrno("handoff sendmsg");
+      return false;
+   }
+   return true;
+}
+
+bool receiveListeners(const std::string &path, std::vector<int> &sockets)
+{
+   struct sockaddr_un address;
+   if (!unixAddress(path, address))
+   {
+      return false;
+   }
+   int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (connection == -1 || connect(connection, (struct sockaddr *)&address, sizeof(address)) == -1)
+   {
+      logErrno("handoff connect");
+      if (connection != -1)
+      {
+         close(connection);
+      }
+      return false;
+   }
+
+   char header[64];
+   struct iovec data = {header, sizeof(header) - 1};
+   char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_SOCKETS)];
+   struct msghdr message;
+   memset(&message, 0, sizeof(message));
+   message.msg_iov = &data;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+
+   ssize_t size = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+   close(connection);
+   if (size <= 0)
+   {
+      logError("handoff: no listening sockets received");
+      return false;
+   }
+   header[size] = '\0';
+
+   for (struct cmsghdr *rights = CMSG_FIRSTHDR(&message); rights != nullptr; rights = CMSG_NXTHDR(&message, rights))
+   {
+      if (rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS)
+      {
+         size_t count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+         int received[HANDOFF_MAX_SOCKETS];
+         memcpy(received, CMSG_DATA(rights), sizeof(int) * count);
+         sockets.insert(sockets.end(), received, received + count);
+      }
+   }
+   if (strncmp(header, HANDOFF_MAGIC " ", strlen(HANDOFF_MAGIC) + 1) != 0 ||
+       (size_t)atoi(header + strlen(HANDOFF_MAGIC) + 1) != sockets.size() || (message.msg_flags & MSG_CTRUNC) != 0)
+   {
+      logError("handoff: unexpected message");
+      for (int socket : sockets)
+      {
+         close(socket);
+      }
+      sockets.clear();
+      return false;
+   }
+   return true;
+}
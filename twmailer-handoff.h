@@ -0,0 +1,20 @@
+#ifndef TWMAILER_HANDOFF_H
+#define TWMAILER_HANDOFF_H
+
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Listening socket handoff for restarts without refused connections. The running server listens on a
+// Unix socket (--handoff=<path>); a new server started with --takeover=<path> connects and receives all
+// listening sockets in one SCM_RIGHTS message. Connections keep queueing in the shared backlog while
+// the old process drains and the new one starts accepting.
+
+#define HANDOFF_MAGIC "TWMAILER-LISTENERS"
+#define HANDOFF_MAX_SOCKETS 64
+
+int openHandoffListener(const std::string &path);                     // -1 on errors
+bool sendListeners(int connection, const std::vector<int> &sockets);
+bool receiveListeners(const std::string &path, std::vector<int> &sockets);
+
+#endif
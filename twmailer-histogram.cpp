@@ -0,0 +1,105 @@
+#include "twmailer-histogram.h"
+
+#define HALF_BUCKET (1 << (HISTOGRAM_SUB_BUCKET_BITS - 1))
+
+///////////////////////////////////////////////////////////////////////////////
+
+Histogram::Histogram() : counts(HISTOGRAM_BUCKETS, 0)
+{
+}
+
+//====================================================================================================================
+
+size_t Histogram::indexOf(uint64_t value)
+{
+   if (value < (1 << HISTOGRAM_SUB_BUCKET_BITS))
+   {
+      return (size_t)value;
+   }
+   // shift the value so that it keeps HISTOGRAM_SUB_BUCKET_BITS significant bits
+   int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+   return (size_t)(shift + 1) * HALF_BUCKET + (size_t)((value >> shift) - HALF_BUCKET);
+}
+
+uint64_t Histogram::highestValueAt(size_t index)
+{
+   if (index < (1 << HISTOGRAM_SUB_BUCKET_BITS))
+   {
+      return index;
+   }
+   int shift = (int)(index / HALF_BUCKET) - 1;
+   uint64_t subBucket = index % HALF_BUCKET + HALF_BUCKET;
+   return ((subBucket + 1) << shift) - 1;
+}
+
+//====================================================================================================================
+
+void Histogram::record(uint64_t value, uint64_t times)
+{
+   counts[indexOf(value)] += times;
+   total += times;
+   sum += value * times;
+   if (value < minimum)
+   {
+      minimum = value;
+   }
+   if (value > maximum)
+   {
+      maximum = value;
+   }
+}
+
+void Histogram::merge(const Histogram &other)
+{
+   for (size_t i = 0; i < counts.size(); i++)
+   {
+      counts[i] += other.counts[i];
+   }
+   total += other.total;
+   sum += other.sum;
+   if (other.total > 0 && other.minimum < minimum)
+   {
+      minimum = other.minimum;
+   }
+   if (other.maximum > maximum)
+   {
+      maximum = other.maximum;
+   }
+}
+
+void Histogram::reset()
+{
+   counts.assign(counts.size(), 0);
+   total = 0;
+   sum = 0;
+   minimum = UINT64_MAX;
+   maximum = 0;
+}
+
+//====================================================================================================================
+
+uint64_t Histogram::percentile(double percent) const
+{
+   if (total == 0)
+   {
+      return 0;
+   }
+
+   uint64_t wanted = (uint64_t)(percent / 100.0 * total + 0.5);
+   if (wanted == 0)
+   {
+      wanted = 1;
+   }
+
+   uint64_t seen = 0;
+   for (size_t i = 0; i < counts.size(); i++)
+   {
+      seen += counts[i];
+      if (seen >= wanted)
+      {
+         uint64_t value = highestValueAt(i);
+         return value < maximum ? value : maximum;
+      }
+   }
+   return maximum;
+}
@@ -0,0 +1,47 @@
+#ifndef TWMAILER_HISTOGRAM_H
+#define TWMAILER_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Latency histogram in the style of HdrHistogram: values below 128 are counted
+// exactly, above that every power of two is split into 64 buckets, so any
+// recorded value is reported with less than 1.6% error over the full 64 bit
+// range while recording stays a shift and an increment.
+
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 2) << (HISTOGRAM_SUB_BUCKET_BITS - 1))
+
+class Histogram
+{
+public:
+   Histogram();
+
+   void record(uint64_t value, uint64_t times = 1);
+   void merge(const Histogram &other);
+   void reset();
+
+   uint64_t count() const { return total; }
+   uint64_t min() const { return total == 0 ? 0 : minimum; }
+   uint64_t max() const { return maximum; }
+   double mean() const { return total == 0 ? 0 : (double)sum / total; }
+   // smallest recorded value such that percent of all values are less or equal
+   uint64_t percentile(double percent) const;
+
+   // bucket access for exporters (e.g. cumulative Prometheus buckets)
+   static size_t indexOf(uint64_t value);
+   static uint64_t highestValueAt(size_t index);
+   uint64_t countAt(size_t index) const { return counts[index]; }
+
+private:
+   std::vector<uint64_t> counts;
+   uint64_t total = 0;
+   uint64_t sum = 0;
+   uint64_t minimum = UINT64_MAX;
+   uint64_t maximum = 0;
+};
+
+#endif
@@ -0,0 +1,559 @@
+#include "twmailer-loadgen.h"
+
+// Open-loop load generator: requests are scheduled at a fixed rate whether or not the server keeps up,
+// spread round robin over many non-blocking protocol v2 sessions driven by one epoll loop.
+//
+// ./bin/loadgen --connections 1000 --rate 20000 --duration 30 --mix 5,40,30,20,5
+//
+// Start the server with --auth=none so LOGIN does not leave the machine.
+
+static const char *commandNames[] = {"LOGIN", "SEND", "LIST", "READ", "DEL"};
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+   Options options;
+   if (!parseOptions(argc, argv, options))
+   {
+      fprintf(stderr, "usage: %s [--host ip] [--port n] [--unix path] [--connections n] [--rate req/s] [--duration s]\n"
+                      "          [--users n] [--size bytes] [--password pw] [--mix login,send,list,read,del]\n"
+                      "          [--cpus list] [--server-stats prefix,...]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   // thousands of sessions need as many descriptors
+   struct rlimit limit;
+   if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+   {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+   }
+   signal(SIGPIPE, SIG_IGN);
+
+   int rc = options.cpus.empty() ? 0 : pinThread(options.cpus);
+   if (rc != 0)
+   {
+      fprintf(stderr, "could not pin to CPUs %s: %s\n", formatCpuList(options.cpus).c_str(), strerror(rc));
+      return EXIT_FAILURE;
+   }
+
+   int epollFd = epoll_create1(0);
+   if (epollFd == -1)
+   {
+      perror("epoll error");
+      return EXIT_FAILURE;
+   }
+
+   CommandStats stats[5];
+   std::mt19937 random(42);
+
+   std::vector<Connection> connections(options.connections);
+   for (int i = 0; i < options.connections; i++)
+   {
+      connections[i].index = i;
+      connections[i].user = "lg" + to_string(i % options.users);
+      if (!openConnection(connections[i], options, epollFd))
+      {
+         return EXIT_FAILURE;
+      }
+      // every session starts with its LOGIN, it is measured like any other request
+      queueRequest(connections[i], Opcode::LOGIN, options, random);
+   }
+
+   int mixTotal = 0;
+   for (int weight : options.mix)
+   {
+      mixTotal += weight;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   auto stop = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                           std::chrono::duration<double>(options.duration));
+   auto deadline = stop + std::chrono::seconds(DRAIN_SECONDS);
+   auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+       std::chrono::duration<double>(1.0 / options.rate));
+   auto nextRequest = start;
+   uint64_t scheduled = 0;
+   size_t nextConnection = 0;
+   epoll_event events[MAX_EVENTS];
+
+   while (true)
+   {
+      auto now = std::chrono::steady_clock::now();
+
+      // schedule everything that is due, even if the server is behind
+      while (nextRequest <= now && nextRequest < stop)
+      {
+         int pick = std::uniform_int_distribution<int>(0, mixTotal - 1)(random);
+         int command = 0;
+         while (pick >= options.mix[command])
+         {
+            pick -= options.mix[command++];
+         }
+
+         Connection &connection = connections[nextConnection++ % connections.size()];
+         if (connection.fd != -1)
+         {
+            queueRequest(connection, (Opcode)(command + 1), options, random);
+            connection.inflight.back().scheduled = nextRequest;
+            if (connection.connected && !flush(connection, epollFd))
+            {
+               stats[command].errors++;
+            }
+         }
+         scheduled++;
+         nextRequest += interval;
+      }
+
+      bool pending = false;
+      for (const Connection &connection : connections)
+      {
+         pending = pending || (connection.fd != -1 && !connection.inflight.empty());
+      }
+      if ((now >= stop && !pending) || now >= deadline)
+      {
+         break;
+      }
+
+      int timeout = 100;
+      if (nextRequest < stop)
+      {
+         timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(nextRequest - now).count();
+      }
+      int count = epoll_wait(epollFd, events, MAX_EVENTS, timeout < 0 ? 0 : timeout);
+      for (int i = 0; i < count; i++)
+      {
+         Connection &connection = connections[events[i].data.u32];
+         if (connection.fd == -1)
+         {
+            continue;
+         }
+
+         bool ok = true;
+         if (events[i].events & EPOLLOUT)
+         {
+            if (!connection.connected)
+            {
+               int error = 0;
+               socklen_t length = sizeof(error);
+               getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+               connection.connected = error == 0;
+               ok = connection.connected;
+            }
+            ok = ok && flush(connection, epollFd);
+         }
+         if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+         {
+            ok = receive(connection, stats, epollFd);
+         }
+         if (!ok)
+         {
+            // requests that will never be answered count as errors
+            for (const Outstanding &lost : connection.inflight)
+            {
+               stats[(int)lost.opcode - 1].errors++;
+            }
+            connection.inflight.clear();
+            close(connection.fd);
+            connection.fd = -1;
+         }
+      }
+   }
+
+   uint64_t lost = 0;
+   for (Connection &connection : connections)
+   {
+      lost += connection.inflight.size();
+      if (connection.fd != -1)
+      {
+         close(connection.fd);
+      }
+   }
+
+   double seconds = std::chrono::duration<double>(std::min(std::chrono::steady_clock::now(), stop) - start).count();
+   report(stats, seconds, scheduled, lost);
+   close(epollFd);
+   if (!options.serverStats.empty())
+   {
+      printServerStats(options);
+   }
+   return EXIT_SUCCESS;
+}
+
+//====================================================================================================================
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+   for (int i = 1; i < argc; i++)
+   {
+      string option = argv[i];
+      if (i + 1 >= argc)
+      {
+         return false;
+      }
+      string value = argv[++i];
+
+      if (option == "--host")
+      {
+         options.host = value;
+      }
+      else if (option == "--port")
+      {
+         options.port = atoi(value.c_str());
+      }
+      else if (option == "--unix")
+      {
+         options.unixPath = value;
+      }
+      else if (option == "--connections")
+      {
+         options.connections = atoi(value.c_str());
+      }
+      else if (option == "--rate")
+      {
+         options.rate = atof(value.c_str());
+      }
+      else if (option == "--duration")
+      {
+         options.duration = atof(value.c_str());
+      }
+      else if (option == "--users")
+      {
+         options.users = atoi(value.c_str());
+      }
+      else if (option == "--size")
+      {
+         options.messageSize = (size_t)atol(value.c_str());
+      }
+      else if (option == "--password")
+      {
+         options.password = value;
+      }
+      else if (option == "--cpus")
+      {
+         if (!parseCpuList(value, options.cpus))
+         {
+            return false;
+         }
+      }
+      else if (option == "--server-stats")
+      {
+         options.serverStats = value;
+      }
+      else if (option == "--mix")
+      {
+         if (!parseMix(value, options.mix))
+         {
+            return false;
+         }
+      }
+      else
+      {
+         return false;
+      }
+   }
+   return options.connections > 0 && options.rate > 0 && options.duration > 0 && options.users > 0;
+}
+
+bool parseMix(const string &text, int mix[5])
+{
+   int total = 0;
+   size_t start = 0;
+   for (int i = 0; i < 5; i++)
+   {
+      size_t end = text.find(',', start);
+      if ((end == string::npos) != (i == 4))
+      {
+         return false;
+      }
+      mix[i] = atoi(text.substr(start, end - start).c_str());
+      if (mix[i] < 0)
+      {
+         return false;
+      }
+      total += mix[i];
+      start = end + 1;
+   }
+   return total > 0;
+}
+
+//====================================================================================================================
+
+// Socket connected (or connecting, with SOCK_NONBLOCK in flags) to host:port or the --unix socket, -1 on errors
+int connectToServer(const Options &options, int flags)
+{
+   struct sockaddr_storage address;
+   socklen_t length;
+   memset(&address, 0, sizeof(address));
+   if (!options.unixPath.empty())
+   {
+      struct sockaddr_un *local = (struct sockaddr_un *)&address;
+      local->sun_family = AF_UNIX;
+      if (options.unixPath.size() >= sizeof(local->sun_path))
+      {
+         fprintf(stderr, "socket path too long: %s\n", options.unixPath.c_str());
+         return -1;
+      }
+      strcpy(local->sun_path, options.unixPath.c_str());
+      length = sizeof(struct sockaddr_un);
+   }
+   else
+   {
+      struct sockaddr_in *remote = (struct sockaddr_in *)&address;
+      remote->sin_family = AF_INET;
+      remote->sin_port = htons(options.port);
+      if (inet_aton(options.host.c_str(), &remote->sin_addr) == 0)
+      {
+         fprintf(stderr, "invalid host %s\n", options.host.c_str());
+         return -1;
+      }
+      length = sizeof(struct sockaddr_in);
+   }
+
+   int fd = socket(address.ss_family, SOCK_STREAM | flags, 0);
+   if (fd == -1)
+   {
+      perror("Socket error");
+      return -1;
+   }
+   if (address.ss_family == AF_INET)
+   {
+      int noDelay = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+   }
+
+   if (connect(fd, (struct sockaddr *)&address, length) == -1 && errno != EINPROGRESS)
+   {
+      perror("Connect error - no server available");
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+bool openConnection(Connection &connection, const Options &options, int epollFd)
+{
+   connection.fd = connectToServer(options, SOCK_NONBLOCK);
+   if (connection.fd == -1)
+   {
+      return false;
+   }
+
+   // switch to v2 right away, the server answers the pipelined hello after its welcome text
+   connection.outbuf = string(V2_HELLO) + "\n";
+   connection.writing = true;
+
+   epoll_event event;
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN | EPOLLOUT;
+   event.data.u32 = connection.index;
+   if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connection.fd, &event) == -1)
+   {
+      perror("epoll_ctl");
+      return false;
+   }
+   return true;
+}
+
+//====================================================================================================================
+
+void queueRequest(Connection &connection, Opcode opcode, const Options &options, std::mt19937 &random)
+{
+   Frame request;
+   request.code = (uint8_t)opcode;
+   request.requestId = ++connection.nextId;
+
+   switch (opcode)
+   {
+   case Opcode::LOGIN:
+      request.fields = {connection.user, options.password};
+      break;
+   case Opcode::SEND:
+   {
+      string receiver = "lg" + to_string(std::uniform_int_distribution<int>(0, options.users - 1)(random));
+      request.fields = {receiver, "load " + to_string(request.requestId), string(options.messageSize, 'x')};
+      break;
+   }
+   case Opcode::READ:
+   case Opcode::DEL:
+      // the first messages are the ones most likely to exist
+      request.fields = {to_string(std::uniform_int_distribution<int>(1, 3)(random))};
+      break;
+   default:
+      break;
+   }
+
+   connection.outbuf += encodeFrame(request);
+   connection.inflight.push_back({request.requestId, opcode, std::chrono::steady_clock::now()});
+}
+
+//====================================================================================================================
+
+bool flush(Connection &connection, int epollFd)
+{
+   while (!connection.outbuf.empty())
+   {
+      ssize_t sent = send(connection.fd, connection.outbuf.data(), connection.outbuf.size(), MSG_NOSIGNAL);
+      if (sent == -1)
+      {
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+         {
+            return false;
+         }
+         break;
+      }
+      connection.outbuf.erase(0, sent);
+   }
+
+   // only ask for EPOLLOUT while something is left over
+   bool writing = !connection.outbuf.empty();
+   if (writing != connection.writing)
+   {
+      epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+      event.data.u32 = connection.index;
+      if (epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event) == -1)
+      {
+         return false;
+      }
+      connection.writing = writing;
+   }
+   return true;
+}
+
+//====================================================================================================================
+
+bool receive(Connection &connection, CommandStats stats[], int epollFd)
+{
+   char buffer[BUF];
+   ssize_t size = recv(connection.fd, buffer, BUF, 0);
+   if (size == 0 || (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+   {
+      return false;
+   }
+   if (size > 0)
+   {
+      connection.inbuf.append(buffer, size);
+   }
+
+   // welcome text ("...\r\n...\r\n") and the "OK\n" of the hello come before the first frame
+   if (connection.handshake)
+   {
+      // turned away by the server's admission control instead of the welcome
+      if (connection.inbuf.compare(0, 5, "BUSY ") == 0)
+      {
+         fprintf(stderr, "connection %u rejected: %s", connection.index, connection.inbuf.c_str());
+         return false;
+      }
+      size_t end = connection.inbuf.find("\r\nOK\n");
+      if (end == string::npos)
+      {
+         return true;
+      }
+      connection.inbuf.erase(0, end + 5);
+      connection.handshake = false;
+   }
+
+   auto now = std::chrono::steady_clock::now();
+   Frame response;
+   int rc;
+   while ((rc = decodeFrame(connection.inbuf, response)) == 1)
+   {
+      if (connection.inflight.empty() || connection.inflight.front().requestId != response.requestId)
+      {
+         fprintf(stderr, "unexpected reply %u\n", response.requestId);
+         return false;
+      }
+      Outstanding request = connection.inflight.front();
+      connection.inflight.pop_front();
+
+      CommandStats &command = stats[(int)request.opcode - 1];
+      command.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - request.scheduled).count());
+      // a missing message is an expected answer under a random READ/DEL mix
+      if (response.code != (uint8_t)Status::OK && response.code != (uint8_t)Status::ERR_NOT_FOUND)
+      {
+         command.errors++;
+      }
+   }
+   return rc != -1 && flush(connection, epollFd);
+}
+
+//====================================================================================================================
+
+void report(const CommandStats stats[], double seconds, uint64_t scheduled, uint64_t lost)
+{
+   uint64_t completed = 0;
+   Histogram all;
+
+   printf("%-6s %10s %8s %10s %10s %10s %10s %10s %10s\n",
+          "cmd", "count", "errors", "req/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+   for (int i = 0; i < 5; i++)
+   {
+      const Histogram &latency = stats[i].latency;
+      completed += latency.count();
+      all.merge(latency);
+      printf("%-6s %10lu %8lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+             commandNames[i], (unsigned long)latency.count(), (unsigned long)stats[i].errors,
+             latency.count() / seconds, latency.percentile(50) / 1e3, latency.percentile(90) / 1e3,
+             latency.percentile(99) / 1e3, latency.percentile(99.9) / 1e3, latency.max() / 1e3);
+   }
+   printf("%-6s %10lu %8s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+          "all", (unsigned long)completed, "", completed / seconds, all.percentile(50) / 1e3,
+          all.percentile(90) / 1e3, all.percentile(99) / 1e3, all.percentile(99.9) / 1e3, all.max() / 1e3);
+   printf("scheduled %lu requests in %.1f s, %lu without reply\n",
+          (unsigned long)scheduled, seconds, (unsigned long)lost);
+}
+
+//====================================================================================================================
+
+// Asks the server for STATS (text protocol, the server only answers local clients) and prints the lines
+// starting with one of the prefixes, e.g. where the workers ran next to the latencies they caused
+void printServerStats(const Options &options)
+{
+   int fd = connectToServer(options, 0);
+   struct timeval timeout = {2, 0};
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   if (fd == -1 || send(fd, "STATS\n", 6, 0) != 6)
+   {
+      perror("server stats");
+      if (fd != -1)
+      {
+         close(fd);
+      }
+      return;
+   }
+
+   string text;
+   char buffer[BUF];
+   ssize_t size;
+   while (text.find("\n.\n") == string::npos && text.find("ERR\n") == string::npos &&
+          (size = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+   {
+      text.append(buffer, size);
+   }
+   close(fd);
+
+   printf("\nserver:\n");
+   size_t start = 0;
+   while (start < text.size())
+   {
+      size_t end = text.find('\n', start);
+      string line = text.substr(start, end == string::npos ? string::npos : end - start);
+      start = end == string::npos ? text.size() : end + 1;
+      size_t from = 0;
+      while (from <= options.serverStats.size())
+      {
+         size_t comma = options.serverStats.find(',', from);
+         string prefix = options.serverStats.substr(from, comma == string::npos ? string::npos : comma - from);
+         from = comma == string::npos ? options.serverStats.size() + 1 : comma + 1;
+         if (!prefix.empty() && line.compare(0, prefix.size(), prefix) == 0)
+         {
+            printf("  %s\n", line.c_str());
+            break;
+         }
+      }
+   }
+}
@@ -0,0 +1,93 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <random>
+
+#include "twmailer-protocol.h"
+#include "twmailer-histogram.h"
+#include "twmailer-affinity.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define PORT 6543
+#define BUF 16384
+#define MAX_EVENTS 256
+#define DRAIN_SECONDS 5 // how long replies are awaited after the last request
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct Options
+{
+   string host = "127.0.0.1";
+   int port = PORT;
+   string unixPath;            // connect to the server's --unix socket instead of host:port
+   int connections = 16;
+   double rate = 1000;         // requests per second over all connections
+   double duration = 10;       // seconds
+   int users = 16;             // mailboxes lg0 .. lg<users-1>
+   size_t messageSize = 256;
+   string password = "loadgen";
+   // weights of LOGIN, SEND, LIST, READ, DEL
+   int mix[5] = {5, 40, 30, 20, 5};
+   vector<int> cpus;           // run only on these, keeps the generator off the server's CPUs
+   string serverStats;         // STATS line prefixes printed after the run, e.g. "placement,perf"
+};
+
+// A request on the wire, latency counts from when it was scheduled, not when it was sent
+struct Outstanding
+{
+   uint32_t requestId;
+   Opcode opcode;
+   std::chrono::steady_clock::time_point scheduled;
+};
+
+struct Connection
+{
+   uint32_t index = 0;        // position in the connection table, stored in the epoll event
+   int fd = -1;
+   bool connected = false;
+   bool handshake = true;     // still expecting the text welcome and the "OK" for V2
+   string user;
+   string inbuf;
+   string outbuf;
+   bool writing = false;      // registered for EPOLLOUT because outbuf did not fit into the socket
+   uint32_t nextId = 0;
+   std::deque<Outstanding> inflight;
+};
+
+struct CommandStats
+{
+   Histogram latency;          // nanoseconds
+   uint64_t errors = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool parseOptions(int argc, char *argv[], Options &options);
+bool parseMix(const string &text, int mix[5]);
+int connectToServer(const Options &options, int flags);
+bool openConnection(Connection &connection, const Options &options, int epollFd);
+void queueRequest(Connection &connection, Opcode opcode, const Options &options, std::mt19937 &random);
+bool flush(Connection &connection, int epollFd);
+bool receive(Connection &connection, CommandStats stats[], int epollFd);
+void report(const CommandStats stats[], double seconds, uint64_t scheduled, uint64_t lost);
+void printServerStats(const Options &options);
@@ -0,0 +1,207 @@
+#include "twmailer-log.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <chrono>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define LOG_IDLE_MICROSECONDS 1000 // pause of the logger thread when all rings were empty
+
+Logger logger;
+
+static const char *levelNames[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+namespace
+{
+// Hands the ring back when its thread exits, records left in it are still written
+struct RingLease
+{
+   LogRing *ring = nullptr;
+   ~RingLease()
+   {
+      if (ring != nullptr)
+      {
+         logger.release(ring);
+      }
+   }
+};
+
+thread_local RingLease lease;
+}
+
+//====================================================================================================================
+
+void startLogger()
+{
+   logger.start();
+}
+
+void stopLogger()
+{
+   logger.stop();
+}
+
+static const char *levelOptions[] = {"debug", "info", "warn", "error"};
+
+bool setLogLevel(const std::string &name)
+{
+   for (int i = 0; i < 4; i++)
+   {
+      if (name == levelOptions[i])
+      {
+         logger.level = i;
+         return true;
+      }
+   }
+   return false;
+}
+
+const char *logLevelName()
+{
+   return levelOptions[logger.level];
+}
+
+//====================================================================================================================
+
+void Logger::start()
+{
+   if (!running.exchange(true))
+   {
+      thread = std::thread(&Logger::run, this);
+   }
+}
+
+void Logger::stop()
+{
+   if (running.exchange(false))
+   {
+      thread.join();
+   }
+}
+
+LogRing &Logger::local()
+{
+   if (lease.ring == nullptr)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (freeRings.empty())
+      {
+         rings.push_back(std::make_unique<LogRing>());
+         rings.back()->number = rings.size();
+         lease.ring = rings.back().get();
+      }
+      else
+      {
+         lease.ring = freeRings.back();
+         freeRings.pop_back();
+      }
+   }
+   return *lease.ring;
+}
+
+void Logger::release(LogRing *ring)
+{
+   std::lock_guard<std::mutex> lock(mutex);
+   freeRings.push_back(ring);
+}
+
+//====================================================================================================================
+
+void Logger::run()
+{
+   std::string out;
+   while (running)
+   {
+      if (!drain(out))
+      {
+         std::this_thread::sleep_for(std::chrono::microseconds(LOG_IDLE_MICROSECONDS));
+      }
+   }
+   drain(out); // whatever came in while stopping
+}
+
+// "{}" takes the next argument, surplus arguments are ignored and missing ones print as "{}"
+static void formatRecord(std::string &out, const LogRecord &record, unsigned thread)
+{
+   char prefix[64];
+   time_t seconds = record.timestamp / 1000000000;
+   struct tm local;
+   localtime_r(&seconds, &local);
+   size_t length = strftime(prefix, sizeof(prefix), "%H:%M:%S", &local);
+   snprintf(prefix + length, sizeof(prefix) - length, ".%06ld %s t%u ",
+            (long)(record.timestamp % 1000000000 / 1000), levelNames[record.level & 3], thread);
+   out += prefix;
+
+   size_t next = 0;
+   for (const char *c = record.format; *c != '\0'; c++)
+   {
+      if (c[0] != '{' || c[1] != '}' || next >= record.argCount)
+      {
+         out += *c;
+         continue;
+      }
+      c++;
+
+      const LogArg &arg = record.args[next++];
+      char number[32];
+      switch (arg.type)
+      {
+      case LogArgType::INT:
+         snprintf(number, sizeof(number), "%lld", (long long)arg.i);
+         out += number;
+         break;
+      case LogArgType::UINT:
+         snprintf(number, sizeof(number), "%llu", (unsigned long long)arg.u);
+         out += number;
+         break;
+      case LogArgType::DOUBLE:
+         snprintf(number, sizeof(number), "%g", arg.d);
+         out += number;
+         break;
+      case LogArgType::STRING:
+         out.append(record.text + arg.text.offset, arg.text.length);
+         break;
+      case LogArgType::ERRNO:
+         out += strerror((int)arg.i); // only this thread calls strerror
+         break;
+      }
+   }
+   out += '\n';
+}
+
+// Writes out every ring, returns whether there was anything
+bool Logger::drain(std::string &out)
+{
+   out.clear();
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const auto &ring : rings)
+      {
+         uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+         uint64_t head = ring->head.load(std::memory_order_acquire);
+         for (; tail < head; tail++)
+         {
+            formatRecord(out, ring->records[tail % LOG_RING_SIZE], ring->number);
+         }
+         ring->tail.store(tail, std::memory_order_release);
+
+         uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+         if (dropped != ring->reportedDrops)
+         {
+            out += "logger: t" + std::to_string(ring->number) + " dropped " +
+                   std::to_string(dropped - ring->reportedDrops) + " lines\n";
+            ring->reportedDrops = dropped;
+         }
+      }
+   }
+
+   if (out.empty())
+   {
+      return false;
+   }
+   fwrite(out.data(), 1, out.size(), stdout);
+   fflush(stdout);
+   return true;
+}
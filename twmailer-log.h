@@ -0,0 +1,248 @@
+#ifndef TWMAILER_LOG_H
+#define TWMAILER_LOG_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Asynchronous logger. A call copies its format pointer and arguments into a ring
+// buffer owned by the calling thread; the background thread started by startLogger()
+// formats and writes them. Nothing on the calling side takes a lock or touches stdio,
+// a full ring drops the line and counts it instead of blocking.
+//
+//    logInfo("client connected from {}:{}", ip, port);   // "{}" is replaced by the next argument
+//    logErrno("recv error");                             // like perror()
+//
+// The names are not LOG_INFO and friends because <syslog.h>, pulled in by <ldap.h>, defines those.
+// Levels below LOG_LEVEL are compiled out (build with -DLOG_LEVEL=0 to keep logDebug),
+// levels below the runtime level (--log-level) are skipped with one comparison.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SIZE 1024   // records per thread, power of two
+#define LOG_MAX_ARGS 6
+#define LOG_TEXT_BYTES 128   // string arguments of one record together, longer ones are cut
+
+enum class LogArgType : uint8_t
+{
+   INT,
+   UINT,
+   DOUBLE,
+   STRING,
+   ERRNO
+};
+
+struct LogArg
+{
+   LogArgType type;
+   union
+   {
+      int64_t i;
+      uint64_t u;
+      double d;
+      struct
+      {
+         uint16_t offset;
+         uint16_t length;
+      } text;
+   };
+};
+
+// errno captured at the call, turned into text by the logger thread
+struct LogErrno
+{
+   int value;
+};
+
+struct LogRecord
+{
+   int64_t timestamp;        // nanoseconds since the epoch
+   const char *format;       // must be a string literal, it is read later
+   uint8_t level;
+   uint8_t argCount;
+   uint16_t textLength;
+   LogArg args[LOG_MAX_ARGS];
+   char text[LOG_TEXT_BYTES];
+};
+
+// Single producer (the owning thread), single consumer (the logger thread)
+struct LogRing
+{
+   LogRecord records[LOG_RING_SIZE];
+   std::atomic<uint64_t> head{0};    // next record the producer writes
+   std::atomic<uint64_t> tail{0};    // next record the consumer reads
+   std::atomic<uint64_t> dropped{0};
+   uint64_t reportedDrops = 0;       // consumer only
+   unsigned number = 0;              // shown as t<number> in every line
+};
+
+class Logger
+{
+public:
+   ~Logger() { stop(); }
+
+   void start();
+   void stop();                      // writes everything still buffered
+   LogRing &local();
+   void release(LogRing *ring);
+
+   std::atomic<int> level{LOG_LEVEL_INFO};
+
+private:
+   void run();
+   bool drain(std::string &out);
+
+   std::mutex mutex; // for rings and freeRings, taken once per thread
+   std::vector<std::unique_ptr<LogRing>> rings;
+   std::vector<LogRing *> freeRings;
+   std::thread thread;
+   std::atomic<bool> running{false};
+};
+
+extern Logger logger;
+
+void startLogger();
+void stopLogger();
+bool setLogLevel(const std::string &name); // debug, info, warn or error
+const char *logLevelName();
+
+///////////////////////////////////////////////////////////////////////////////
+// argument capture
+
+inline void logCapture(LogRecord &record, LogArg &arg, const char *text, size_t length)
+{
+   size_t room = LOG_TEXT_BYTES - record.textLength;
+   length = length < room ? length : room;
+   memcpy(record.text + record.textLength, text, length);
+   arg.type = LogArgType::STRING;
+   arg.text.offset = record.textLength;
+   arg.text.length = (uint16_t)length;
+   record.textLength += (uint16_t)length;
+}
+
+inline void logCapture(LogRecord &record, LogArg &arg, const char *value)
+{
+   logCapture(record, arg, value == nullptr ? "(null)" : value, value == nullptr ? 6 : strlen(value));
+}
+
+inline void logCapture(LogRecord &record, LogArg &arg, const std::string &value)
+{
+   logCapture(record, arg, value.data(), value.size());
+}
+
+inline void logCapture(LogRecord &record, LogArg &arg, std::string_view value)
+{
+   logCapture(record, arg, value.data(), value.size());
+}
+
+inline void logCapture(LogRecord &, LogArg &arg, LogErrno value)
+{
+   arg.type = LogArgType::ERRNO;
+   arg.i = value.value;
+}
+
+template <typename T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+inline void logCapture(LogRecord &, LogArg &arg, T value)
+{
+   if (std::is_floating_point<T>::value)
+   {
+      arg.type = LogArgType::DOUBLE;
+      arg.d = (double)value;
+   }
+   else if (std::is_signed<T>::value)
+   {
+      arg.type = LogArgType::INT;
+      arg.i = (int64_t)value;
+   }
+   else
+   {
+      arg.type = LogArgType::UINT;
+      arg.u = (uint64_t)value;
+   }
+}
+
+template <typename... Args>
+void logWrite(int level, const char *format, const Args &...args)
+{
+   static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+   LogRing &ring = logger.local();
+   uint64_t head = ring.head.load(std::memory_order_relaxed);
+   if (head - ring.tail.load(std::memory_order_acquire) >= LOG_RING_SIZE)
+   {
+      ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return;
+   }
+
+   LogRecord &record = ring.records[head % LOG_RING_SIZE];
+   timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   record.timestamp = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+   record.format = format;
+   record.level = (uint8_t)level;
+   record.argCount = (uint8_t)sizeof...(Args);
+   record.textLength = 0;
+   size_t index = 0;
+   (logCapture(record, record.args[index++], args), ...);
+   (void)index;
+
+   ring.head.store(head + 1, std::memory_order_release);
+}
+
+#define LOG_AT(severity, ...)                                           \
+   do                                                                   \
+   {                                                                    \
+      if ((severity) >= logger.level.load(std::memory_order_relaxed))   \
+      {                                                                 \
+         logWrite(severity, __VA_ARGS__);                               \
+      }                                                                 \
+   } while (0)
+
+// still type checked, but never emitted
+#define LOG_OFF(...)                \
+   do                               \
+   {                                \
+      if (false)                    \
+      {                             \
+         logWrite(0, __VA_ARGS__);  \
+      }                             \
+   } while (0)
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define logDebug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define logDebug(...) LOG_OFF(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define logInfo(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define logInfo(...) LOG_OFF(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define logWarn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define logWarn(...) LOG_OFF(__VA_ARGS__)
+#endif
+
+#define logError(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define logErrno(message) logError("{}: {}", message, LogErrno{errno})
+
+#endif
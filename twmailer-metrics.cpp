@@ -0,0 +1,487 @@
+#include "twmailer-metrics.h"
+#include "twmailer-trace.h"
+
+#include <stdio.h>
+
+#include <chrono>
+
+///////////////////////////////////////////////////////////////////////////////
+
+Metrics metrics;
+
+// Prometheus bucket bounds in seconds, the HDR buckets are folded into these
+static const double bucketBounds[] = {25e-6, 50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3,
+                                      25e-3, 50e-3, 100e-3, 250e-3, 500e-3, 1, 2.5, 5, 10};
+
+static const char *const rejectionNames[(int)Rejection::COUNT] = {"queue_full", "per_ip", "queue_wait"};
+const char *const laneNames[(int)Lane::COUNT] = {"auth", "write", "read"};
+
+// only the owning thread writes, so a plain load and store is enough and costs no lock prefix
+static inline void add(std::atomic<uint64_t> &counter, uint64_t value)
+{
+   counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+namespace
+{
+// Hands the shard back to the registry when its thread exits
+struct ShardLease
+{
+   MetricsShard *shard = nullptr;
+   ~ShardLease()
+   {
+      if (shard != nullptr)
+      {
+         metrics.release(shard);
+      }
+   }
+};
+
+thread_local ShardLease lease;
+}
+
+//====================================================================================================================
+
+void AtomicHistogram::record(uint64_t value)
+{
+   add(counts[Histogram::indexOf(value)], 1);
+   add(sum, value);
+}
+
+void AtomicHistogram::addTo(Histogram &histogram, uint64_t &total) const
+{
+   for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+   {
+      uint64_t count = counts[i].load(std::memory_order_relaxed);
+      if (count > 0)
+      {
+         histogram.record(Histogram::highestValueAt(i), count);
+      }
+   }
+   total += sum.load(std::memory_order_relaxed);
+}
+
+//====================================================================================================================
+
+MetricsShard &Metrics::local()
+{
+   if (lease.shard == nullptr)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (freeShards.empty())
+      {
+         shards.push_back(std::make_unique<MetricsShard>());
+         lease.shard = shards.back().get();
+      }
+      else
+      {
+         lease.shard = freeShards.back();
+         freeShards.pop_back();
+      }
+   }
+   return *lease.shard;
+}
+
+void Metrics::release(MetricsShard *shard)
+{
+   std::lock_guard<std::mutex> lock(mutex);
+   freeShards.push_back(shard);
+}
+
+// Mailbox commands and RESUME, not QUIT and the session control and admin commands in between
+static bool isCommand(int index)
+{
+   return index >= (int)Opcode::LOGIN && index < METRIC_COMMANDS && index != (int)Opcode::QUIT &&
+          (index <= (int)Opcode::MDEL || index == (int)Opcode::RESUME);
+}
+
+void Metrics::recordCommand(Opcode opcode, uint64_t nanoseconds, bool failed)
+{
+   int index = (int)opcode;
+   if (!isCommand(index))
+   {
+      return;
+   }
+   MetricsShard &shard = local();
+   shard.commands[index].record(nanoseconds);
+   if (failed)
+   {
+      add(shard.errors[index], 1);
+   }
+}
+
+void Metrics::recordAuth(uint64_t nanoseconds, bool failed)
+{
+   MetricsShard &shard = local();
+   shard.auth.record(nanoseconds);
+   if (failed)
+   {
+      add(shard.authFailures, 1);
+   }
+}
+
+void Metrics::recordLockWait(uint64_t nanoseconds)
+{
+   local().lockWait.record(nanoseconds);
+}
+
+void Metrics::recordLaneWait(Lane lane, uint64_t nanoseconds)
+{
+   local().laneWait[(int)lane].record(nanoseconds);
+}
+
+void Metrics::addBytesIn(uint64_t bytes)
+{
+   add(local().bytesIn, bytes);
+}
+
+void Metrics::addBytesOut(uint64_t bytes)
+{
+   add(local().bytesOut, bytes);
+}
+
+void Metrics::addSendCalls(uint64_t calls, bool stalled)
+{
+   MetricsShard &shard = local();
+   add(shard.sendCalls, calls);
+   if (stalled)
+   {
+      add(shard.sendStalls, 1);
+   }
+}
+
+void Metrics::addDeliveryBatch(uint64_t messages)
+{
+   MetricsShard &shard = local();
+   add(shard.deliveries, messages);
+   add(shard.deliveryBatches, 1);
+}
+
+void Metrics::recordRejection(Rejection reason)
+{
+   add(local().rejected[(int)reason], 1);
+}
+
+void Metrics::recordPerf(Opcode opcode, const uint64_t deltas[PERF_COUNTERS])
+{
+   int index = (int)opcode;
+   if (!isCommand(index))
+   {
+      return;
+   }
+   MetricsShard &shard = local();
+   for (int i = 0; i < PERF_COUNTERS; i++)
+   {
+      add(shard.perf[index][i], deltas[i]);
+   }
+   add(shard.perfSamples[index], 1);
+}
+
+void Metrics::recordAllocations(Opcode opcode, uint64_t count)
+{
+   int index = (int)opcode;
+   if (!isCommand(index))
+   {
+      return;
+   }
+   MetricsShard &shard = local();
+   add(shard.allocations[index], count);
+   add(shard.allocationSamples[index], 1);
+}
+
+//====================================================================================================================
+
+MetricsSnapshot Metrics::snapshot()
+{
+   MetricsSnapshot snapshot;
+   std::lock_guard<std::mutex> lock(mutex);
+   for (const auto &shard : shards)
+   {
+      for (int i = 0; i < METRIC_COMMANDS; i++)
+      {
+         shard->commands[i].addTo(snapshot.commands[i], snapshot.commandSums[i]);
+         snapshot.errors[i] += shard->errors[i].load(std::memory_order_relaxed);
+         snapshot.perfSamples[i] += shard->perfSamples[i].load(std::memory_order_relaxed);
+         snapshot.allocations[i] += shard->allocations[i].load(std::memory_order_relaxed);
+         snapshot.allocationSamples[i] += shard->allocationSamples[i].load(std::memory_order_relaxed);
+         for (int j = 0; j < PERF_COUNTERS; j++)
+         {
+            snapshot.perf[i][j] += shard->perf[i][j].load(std::memory_order_relaxed);
+         }
+      }
+      shard->auth.addTo(snapshot.auth, snapshot.authSum);
+      shard->lockWait.addTo(snapshot.lockWait, snapshot.lockWaitSum);
+      for (int i = 0; i < (int)Lane::COUNT; i++)
+      {
+         shard->laneWait[i].addTo(snapshot.laneWait[i], snapshot.laneWaitSums[i]);
+      }
+      snapshot.authFailures += shard->authFailures.load(std::memory_order_relaxed);
+      snapshot.bytesIn += shard->bytesIn.load(std::memory_order_relaxed);
+      snapshot.bytesOut += shard->bytesOut.load(std::memory_order_relaxed);
+      snapshot.sendCalls += shard->sendCalls.load(std::memory_order_relaxed);
+      snapshot.sendStalls += shard->sendStalls.load(std::memory_order_relaxed);
+      snapshot.deliveries += shard->deliveries.load(std::memory_order_relaxed);
+      snapshot.deliveryBatches += shard->deliveryBatches.load(std::memory_order_relaxed);
+      for (int i = 0; i < (int)Rejection::COUNT; i++)
+      {
+         snapshot.rejected[i] += shard->rejected[i].load(std::memory_order_relaxed);
+      }
+   }
+   return snapshot;
+}
+
+//====================================================================================================================
+
+std::string latencySummary(const Histogram &histogram)
+{
+   char line[160];
+   snprintf(line, sizeof(line), "count=%lu p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f",
+            (unsigned long)histogram.count(), histogram.percentile(50) / 1e3, histogram.percentile(90) / 1e3,
+            histogram.percentile(99) / 1e3, histogram.max() / 1e3);
+   return line;
+}
+
+std::vector<std::string> Metrics::summary(const Gauges &gauges)
+{
+   MetricsSnapshot snapshot = this->snapshot();
+   std::vector<std::string> lines;
+   lines.push_back("queue_depth " + std::to_string(gauges.queueDepth));
+   lines.push_back("threads_active " + std::to_string(gauges.activeThreads));
+   lines.push_back("threads_available " + std::to_string(gauges.availableThreads));
+   lines.push_back("idle_sessions " + std::to_string(gauges.idleSessions));
+   lines.push_back("bytes_in " + std::to_string(snapshot.bytesIn));
+   lines.push_back("bytes_out " + std::to_string(snapshot.bytesOut));
+   lines.push_back("send_calls " + std::to_string(snapshot.sendCalls));
+   lines.push_back("send_stalls " + std::to_string(snapshot.sendStalls));
+   lines.push_back("deliveries messages=" + std::to_string(snapshot.deliveries) +
+                   " batches=" + std::to_string(snapshot.deliveryBatches));
+   std::string rejected = "rejected";
+   for (int i = 0; i < (int)Rejection::COUNT; i++)
+   {
+      rejected += std::string(" ") + rejectionNames[i] + "=" + std::to_string(snapshot.rejected[i]);
+   }
+   lines.push_back(rejected);
+   for (int i = 0; i < METRIC_COMMANDS; i++)
+   {
+      if (isCommand(i))
+      {
+         lines.push_back(std::string(opcodeName((Opcode)i)) + " " + latencySummary(snapshot.commands[i]) +
+                         " errors=" + std::to_string(snapshot.errors[i]));
+      }
+   }
+   lines.push_back("auth " + latencySummary(snapshot.auth) + " failures=" + std::to_string(snapshot.authFailures));
+   lines.push_back("lock_wait " + latencySummary(snapshot.lockWait));
+   // the wait histogram only counts commands that found their lane full
+   for (int i = 0; i < (int)Lane::COUNT; i++)
+   {
+      lines.push_back(std::string("lane:") + laneNames[i] + " active=" + std::to_string(gauges.laneActive[i]) +
+                      " waiting=" + std::to_string(gauges.laneWaiting[i]) + " wait " + latencySummary(snapshot.laneWait[i]));
+   }
+
+   // averages per command, ipc tells CPU bound (high) from stalled on memory (low)
+   for (int i = 0; i < METRIC_COMMANDS && perfCountersEnabled(); i++)
+   {
+      uint64_t samples = snapshot.perfSamples[i];
+      if (!isCommand(i) || samples == 0)
+      {
+         continue;
+      }
+      std::string line = std::string("perf:") + opcodeName((Opcode)i) + " count=" + std::to_string(samples);
+      for (int j = 0; j < PERF_COUNTERS; j++)
+      {
+         if (perfCounterAvailable(j))
+         {
+            line += std::string(" ") + perfCounterNames[j] + "=" + std::to_string(snapshot.perf[i][j] / samples);
+         }
+      }
+      if (snapshot.perf[i][PERF_CYCLES] > 0)
+      {
+         char ipc[32];
+         snprintf(ipc, sizeof(ipc), " ipc=%.2f", (double)snapshot.perf[i][PERF_INSTRUCTIONS] / snapshot.perf[i][PERF_CYCLES]);
+         line += ipc;
+      }
+      lines.push_back(line);
+   }
+
+   // heap allocations per command from parsing to the formatted reply, 0 on the allocation-free paths
+   for (int i = 0; i < METRIC_COMMANDS; i++)
+   {
+      uint64_t samples = snapshot.allocationSamples[i];
+      if (isCommand(i) && samples > 0)
+      {
+         char line[96];
+         snprintf(line, sizeof(line), "alloc:%s count=%lu per_command=%.1f", opcodeName((Opcode)i),
+                  (unsigned long)samples, (double)snapshot.allocations[i] / samples);
+         lines.push_back(line);
+      }
+   }
+   return lines;
+}
+
+//====================================================================================================================
+
+// _bucket, _sum and _count lines of one histogram, labels is empty or e.g. command="LIST"
+static void appendHistogram(std::string &out, const char *name, const std::string &labels,
+                            const Histogram &histogram, uint64_t sum)
+{
+   std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+   char line[256];
+   uint64_t cumulative = 0;
+   size_t index = 0;
+   for (double bound : bucketBounds)
+   {
+      uint64_t boundNanos = (uint64_t)(bound * 1e9);
+      for (; index < HISTOGRAM_BUCKETS && Histogram::highestValueAt(index) <= boundNanos; index++)
+      {
+         cumulative += histogram.countAt(index);
+      }
+      snprintf(line, sizeof(line), "%s_bucket%sle=\"%g\"} %lu\n", name, prefix.c_str(), bound, (unsigned long)cumulative);
+      out += line;
+   }
+   snprintf(line, sizeof(line), "%s_bucket%sle=\"+Inf\"} %lu\n", name, prefix.c_str(), (unsigned long)histogram.count());
+   out += line;
+
+   std::string braces = labels.empty() ? "" : "{" + labels + "}";
+   snprintf(line, sizeof(line), "%s_sum%s %.9f\n%s_count%s %lu\n", name, braces.c_str(), sum / 1e9,
+            name, braces.c_str(), (unsigned long)histogram.count());
+   out += line;
+}
+
+static void appendMetric(std::string &out, const char *name, const char *type, const char *help, uint64_t value)
+{
+   out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n" +
+          name + " " + std::to_string(value) + "\n";
+}
+
+std::string Metrics::prometheus(const Gauges &gauges)
+{
+   MetricsSnapshot snapshot = this->snapshot();
+   std::string out;
+
+   out += "# HELP twmailer_command_duration_seconds Time spent executing a command.\n"
+          "# TYPE twmailer_command_duration_seconds histogram\n";
+   for (int i = 0; i < METRIC_COMMANDS; i++)
+   {
+      if (isCommand(i))
+      {
+         appendHistogram(out, "twmailer_command_duration_seconds", std::string("command=\"") + opcodeName((Opcode)i) + "\"",
+                         snapshot.commands[i], snapshot.commandSums[i]);
+      }
+   }
+   out += "# HELP twmailer_command_errors_total Commands answered with an error.\n"
+          "# TYPE twmailer_command_errors_total counter\n";
+   for (int i = 0; i < METRIC_COMMANDS; i++)
+   {
+      if (isCommand(i))
+      {
+         out += std::string("twmailer_command_errors_total{command=\"") + opcodeName((Opcode)i) + "\"} " +
+                std::to_string(snapshot.errors[i]) + "\n";
+      }
+   }
+
+   out += "# HELP twmailer_auth_duration_seconds Time spent checking credentials (LDAP or local).\n"
+          "# TYPE twmailer_auth_duration_seconds histogram\n";
+   appendHistogram(out, "twmailer_auth_duration_seconds", "", snapshot.auth, snapshot.authSum);
+   appendMetric(out, "twmailer_auth_failures_total", "counter", "Rejected credentials.", snapshot.authFailures);
+
+   out += "# HELP twmailer_lock_wait_seconds Time spent waiting for mailbox and directory locks.\n"
+          "# TYPE twmailer_lock_wait_seconds histogram\n";
+   appendHistogram(out, "twmailer_lock_wait_seconds", "", snapshot.lockWait, snapshot.lockWaitSum);
+
+   out += "# HELP twmailer_lane_wait_seconds Time commands waited for a slot of their full lane.\n"
+          "# TYPE twmailer_lane_wait_seconds histogram\n";
+   for (int i = 0; i < (int)Lane::COUNT; i++)
+   {
+      appendHistogram(out, "twmailer_lane_wait_seconds", std::string("lane=\"") + laneNames[i] + "\"",
+                      snapshot.laneWait[i], snapshot.laneWaitSums[i]);
+   }
+   out += "# HELP twmailer_lane_active Commands running per lane.\n# TYPE twmailer_lane_active gauge\n";
+   for (int i = 0; i < (int)Lane::COUNT; i++)
+   {
+      out += std::string("twmailer_lane_active{lane=\"") + laneNames[i] + "\"} " + std::to_string(gauges.laneActive[i]) + "\n";
+   }
+   out += "# HELP twmailer_lane_waiting Sessions waiting for a slot per lane.\n# TYPE twmailer_lane_waiting gauge\n";
+   for (int i = 0; i < (int)Lane::COUNT; i++)
+   {
+      out += std::string("twmailer_lane_waiting{lane=\"") + laneNames[i] + "\"} " + std::to_string(gauges.laneWaiting[i]) + "\n";
+   }
+
+   if (perfCountersEnabled())
+   {
+      out += "# HELP twmailer_perf_events_total Performance counter totals of executed commands.\n"
+             "# TYPE twmailer_perf_events_total counter\n";
+      for (int i = 0; i < METRIC_COMMANDS; i++)
+      {
+         for (int j = 0; j < PERF_COUNTERS; j++)
+         {
+            if (isCommand(i) && perfCounterAvailable(j))
+            {
+               out += std::string("twmailer_perf_events_total{command=\"") + opcodeName((Opcode)i) + "\",event=\"" +
+                      perfCounterNames[j] + "\"} " + std::to_string(snapshot.perf[i][j]) + "\n";
+            }
+         }
+      }
+      out += "# HELP twmailer_perf_commands_total Commands the performance counters were read for.\n"
+             "# TYPE twmailer_perf_commands_total counter\n";
+      for (int i = 0; i < METRIC_COMMANDS; i++)
+      {
+         if (isCommand(i))
+         {
+            out += std::string("twmailer_perf_commands_total{command=\"") + opcodeName((Opcode)i) + "\"} " +
+                   std::to_string(snapshot.perfSamples[i]) + "\n";
+         }
+      }
+   }
+
+   out += "# HELP twmailer_allocations_total Heap allocations made while handling commands.\n"
+          "# TYPE twmailer_allocations_total counter\n";
+   for (int i = 0; i < METRIC_COMMANDS; i++)
+   {
+      if (isCommand(i))
+      {
+         out += std::string("twmailer_allocations_total{command=\"") + opcodeName((Opcode)i) + "\"} " +
+                std::to_string(snapshot.allocations[i]) + "\n";
+      }
+   }
+
+   out += "# HELP twmailer_rejected_connections_total Connections answered with BUSY and closed.\n"
+          "# TYPE twmailer_rejected_connections_total counter\n";
+   for (int i = 0; i < (int)Rejection::COUNT; i++)
+   {
+      out += std::string("twmailer_rejected_connections_total{reason=\"") + rejectionNames[i] + "\"} " +
+             std::to_string(snapshot.rejected[i]) + "\n";
+   }
+
+   appendMetric(out, "twmailer_received_bytes_total", "counter", "Bytes received from clients.", snapshot.bytesIn);
+   appendMetric(out, "twmailer_sent_bytes_total", "counter", "Bytes sent to clients.", snapshot.bytesOut);
+   appendMetric(out, "twmailer_send_calls_total", "counter", "sendmsg() calls for replies and notifications.",
+                snapshot.sendCalls);
+   appendMetric(out, "twmailer_send_stalls_total", "counter", "Flushes that found the socket buffer full.",
+                snapshot.sendStalls);
+   appendMetric(out, "twmailer_deliveries_total", "counter", "Messages written by SEND.", snapshot.deliveries);
+   appendMetric(out, "twmailer_delivery_batches_total", "counter", "Batches of messages written under one mailbox lock hold.",
+                snapshot.deliveryBatches);
+   appendMetric(out, "twmailer_task_queue_depth", "gauge", "Sessions waiting for a worker.", gauges.queueDepth);
+   appendMetric(out, "twmailer_threads_active", "gauge", "Workers serving a session.", gauges.activeThreads);
+   appendMetric(out, "twmailer_threads_available", "gauge", "Workers waiting for a session.", gauges.availableThreads);
+   appendMetric(out, "twmailer_idle_sessions", "gauge", "Sessions parked in IDLE.", gauges.idleSessions);
+   return out;
+}
+
+//====================================================================================================================
+
+ProfiledLock lockMeasured(ProfiledMutex &mutex, const char *name)
+{
+   TraceScope span(name);
+   ProfiledLock lock(mutex, std::try_to_lock);
+   if (lock.owns_lock())
+   {
+      metrics.recordLockWait(0);
+      return lock;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   lock.lock();
+   metrics.recordLockWait(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+   return lock;
+}
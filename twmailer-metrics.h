@@ -0,0 +1,150 @@
+#ifndef TWMAILER_METRICS_H
+#define TWMAILER_METRICS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "twmailer-histogram.h"
+#include "twmailer-mutex.h"
+#include "twmailer-perf.h"
+#include "twmailer-protocol.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Server metrics. Every thread records into its own shard without locks or atomic
+// read-modify-write instructions; STATS and the Prometheus endpoint add up all shards.
+
+#define METRIC_COMMANDS ((int)Opcode::RESUME + 1) // command histograms are indexed by opcode
+
+// Why a connection was turned away with BUSY
+enum class Rejection
+{
+   QUEUE_FULL,        // --max-queue sessions already wait for a worker
+   PER_IP,            // --max-per-ip connections from this address
+   QUEUE_WAIT,        // waiting sessions are older than --queue-target
+   COUNT
+};
+
+// Scheduling lanes: each shard runs at most --lane-<name>=<n> commands of a lane at once, the
+// commands beyond that wait without holding a worker
+enum class Lane
+{
+   AUTH,  // LOGIN, waits for the directory server
+   WRITE, // SEND, DEL, MDEL
+   READ,  // LIST, READ, MREAD, RESUME
+   COUNT
+};
+
+extern const char *const laneNames[(int)Lane::COUNT];
+
+// Written only by the thread owning the shard, read by anyone
+struct AtomicHistogram
+{
+   std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS]{};
+   std::atomic<uint64_t> sum{0};
+
+   void record(uint64_t value);
+   void addTo(Histogram &histogram, uint64_t &total) const;
+};
+
+struct MetricsShard
+{
+   AtomicHistogram commands[METRIC_COMMANDS]; // nanoseconds
+   AtomicHistogram auth;                      // nanoseconds per authenticate()
+   AtomicHistogram lockWait;                  // nanoseconds until a mailbox/directory lock was held
+   AtomicHistogram laneWait[(int)Lane::COUNT]; // nanoseconds a command waited for a slot of its full lane
+   std::atomic<uint64_t> errors[METRIC_COMMANDS]{};
+   std::atomic<uint64_t> authFailures{0};
+   std::atomic<uint64_t> bytesIn{0};
+   std::atomic<uint64_t> bytesOut{0};
+   std::atomic<uint64_t> sendCalls{0};   // sendmsg() calls flushing replies and notifications
+   std::atomic<uint64_t> sendStalls{0};  // flushes that found the socket buffer full
+   std::atomic<uint64_t> deliveries{0};  // messages written by SEND
+   std::atomic<uint64_t> deliveryBatches{0}; // mailbox lock holds writing them
+   std::atomic<uint64_t> rejected[(int)Rejection::COUNT]{};
+   std::atomic<uint64_t> perf[METRIC_COMMANDS][PERF_COUNTERS]{}; // with --perf-counters
+   std::atomic<uint64_t> perfSamples[METRIC_COMMANDS]{};
+   std::atomic<uint64_t> allocations[METRIC_COMMANDS]{}; // operator new calls from parse to reply
+   std::atomic<uint64_t> allocationSamples[METRIC_COMMANDS]{};
+};
+
+// Sum over all shards
+struct MetricsSnapshot
+{
+   Histogram commands[METRIC_COMMANDS];
+   uint64_t commandSums[METRIC_COMMANDS] = {};
+   uint64_t errors[METRIC_COMMANDS] = {};
+   Histogram auth;
+   uint64_t authSum = 0;
+   uint64_t authFailures = 0;
+   Histogram lockWait;
+   uint64_t lockWaitSum = 0;
+   Histogram laneWait[(int)Lane::COUNT];
+   uint64_t laneWaitSums[(int)Lane::COUNT] = {};
+   uint64_t bytesIn = 0;
+   uint64_t bytesOut = 0;
+   uint64_t sendCalls = 0;
+   uint64_t sendStalls = 0;
+   uint64_t deliveries = 0;
+   uint64_t deliveryBatches = 0;
+   uint64_t rejected[(int)Rejection::COUNT] = {};
+   uint64_t perf[METRIC_COMMANDS][PERF_COUNTERS] = {};
+   uint64_t perfSamples[METRIC_COMMANDS] = {};
+   uint64_t allocations[METRIC_COMMANDS] = {};
+   uint64_t allocationSamples[METRIC_COMMANDS] = {};
+};
+
+// Point in time values the server reads when metrics are requested
+struct Gauges
+{
+   size_t queueDepth = 0;
+   int activeThreads = 0;
+   int availableThreads = 0;
+   size_t idleSessions = 0;
+   int laneActive[(int)Lane::COUNT] = {};     // commands running
+   size_t laneWaiting[(int)Lane::COUNT] = {}; // sessions waiting for a slot
+};
+
+class Metrics
+{
+public:
+   void recordCommand(Opcode opcode, uint64_t nanoseconds, bool failed);
+   void recordAuth(uint64_t nanoseconds, bool failed);
+   void recordLockWait(uint64_t nanoseconds);
+   void recordLaneWait(Lane lane, uint64_t nanoseconds);
+   void addBytesIn(uint64_t bytes);
+   void addBytesOut(uint64_t bytes);
+   void addSendCalls(uint64_t calls, bool stalled);
+   void addDeliveryBatch(uint64_t messages);
+   void recordRejection(Rejection reason);
+   void recordPerf(Opcode opcode, const uint64_t deltas[PERF_COUNTERS]);
+   void recordAllocations(Opcode opcode, uint64_t count);
+
+   MetricsSnapshot snapshot();
+   std::vector<std::string> summary(const Gauges &gauges);  // "name key=value ..." lines for STATS
+   std::string prometheus(const Gauges &gauges);            // text exposition format 0.0.4
+
+   // a thread's shard goes back to the pool when the thread ends, the next thread continues its counts
+   void release(MetricsShard *shard);
+
+private:
+   MetricsShard &local();
+
+   std::mutex mutex; // for shards and freeShards, never taken while recording
+   std::vector<std::unique_ptr<MetricsShard>> shards;
+   std::vector<MetricsShard *> freeShards;
+};
+
+extern Metrics metrics;
+
+// Locks mutex and records how long that took, 0 when it was free. Traced requests get a span called name.
+ProfiledLock lockMeasured(ProfiledMutex &mutex, const char *name);
+
+// "count=... p50_us=... p90_us=... p99_us=... max_us=..." of a histogram in nanoseconds
+std::string latencySummary(const Histogram &histogram);
+
+#endif
@@ -0,0 +1,134 @@
+#include "twmailer-mutex.h"
+#include "twmailer-metrics.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef ENABLE_LOCK_PROFILING
+
+// Counters of every mutex with one name, updated by whoever holds one of them, so several at once
+struct LockSite
+{
+   std::atomic<uint64_t> contended{0};
+   std::atomic<uint64_t> wait[HISTOGRAM_BUCKETS]{}; // nanoseconds, the total is the number of acquisitions
+   std::atomic<uint64_t> hold[HISTOGRAM_BUCKETS]{}; // nanoseconds
+
+   static void record(std::atomic<uint64_t> *counts, std::chrono::nanoseconds time)
+   {
+      counts[Histogram::indexOf(time.count())].fetch_add(1, std::memory_order_relaxed);
+   }
+};
+
+// Mutexes look up their site when constructed, global ones before main, so the registry must exist
+// before them. Its mutex is only held for the lookup, never together with a ProfiledMutex.
+struct LockRegistry
+{
+   std::mutex mutex;
+   std::map<std::string, std::unique_ptr<LockSite>> sites; // never erased
+};
+
+static LockRegistry &registry()
+{
+   static LockRegistry instance;
+   return instance;
+}
+
+ProfiledMutex::ProfiledMutex(const char *name)
+{
+   LockRegistry &profile = registry();
+   std::lock_guard<std::mutex> lock(profile.mutex);
+   std::unique_ptr<LockSite> &known = profile.sites[name];
+   if (!known)
+   {
+      known.reset(new LockSite);
+   }
+   site = known.get();
+}
+
+//====================================================================================================================
+
+void ProfiledMutex::lock()
+{
+   if (mutex.try_lock())
+   {
+      acquiredAt = std::chrono::steady_clock::now();
+      LockSite::record(site->wait, std::chrono::nanoseconds(0));
+      return;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   mutex.lock();
+   acquiredAt = std::chrono::steady_clock::now();
+   site->contended.fetch_add(1, std::memory_order_relaxed);
+   LockSite::record(site->wait, acquiredAt - start);
+}
+
+bool ProfiledMutex::try_lock()
+{
+   if (!mutex.try_lock())
+   {
+      return false;
+   }
+   acquiredAt = std::chrono::steady_clock::now();
+   LockSite::record(site->wait, std::chrono::nanoseconds(0));
+   return true;
+}
+
+void ProfiledMutex::unlock()
+{
+   LockSite::record(site->hold, std::chrono::steady_clock::now() - acquiredAt);
+   mutex.unlock();
+}
+
+//====================================================================================================================
+
+static void addCounts(const std::atomic<uint64_t> *counts, Histogram &histogram)
+{
+   for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+   {
+      uint64_t count = counts[i].load(std::memory_order_relaxed);
+      if (count > 0)
+      {
+         histogram.record(Histogram::highestValueAt(i), count);
+      }
+   }
+}
+
+// The counters are read without any lock, a line may miss acquisitions still in progress
+std::vector<std::string> lockProfile()
+{
+   std::vector<std::pair<std::string, const LockSite *>> sites;
+   {
+      LockRegistry &profile = registry();
+      std::lock_guard<std::mutex> lock(profile.mutex);
+      for (const auto &site : profile.sites)
+      {
+         sites.emplace_back(site.first, site.second.get());
+      }
+   }
+
+   std::vector<std::string> lines;
+   for (const auto &site : sites)
+   {
+      Histogram wait;
+      Histogram hold;
+      addCounts(site.second->wait, wait);
+      addCounts(site.second->hold, hold);
+      lines.push_back("lock_wait:" + site.first + " " + latencySummary(wait) +
+                      " contended=" + std::to_string(site.second->contended.load(std::memory_order_relaxed)));
+      lines.push_back("lock_hold:" + site.first + " " + latencySummary(hold));
+   }
+   return lines;
+}
+
+#else
+
+std::vector<std::string> lockProfile()
+{
+   return {};
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef TWMAILER_MUTEX_H
+#define TWMAILER_MUTEX_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Lock contention profiling. Built with -DENABLE_LOCK_PROFILING (make LOCK_PROFILING=1 rebuild) every
+// ProfiledMutex counts its acquisitions and contended acquisitions and records wait and hold times
+// into the shared counters of its name, so thousands of mailbox mutexes cost one set of histograms;
+// lockProfile() reads them for STATS and the shutdown log. Without the flag a ProfiledMutex is a
+// std::mutex and the name is thrown away.
+
+#ifdef ENABLE_LOCK_PROFILING
+
+struct LockSite;
+
+class ProfiledMutex
+{
+public:
+   explicit ProfiledMutex(const char *name);
+   ProfiledMutex(const ProfiledMutex &) = delete;
+   ProfiledMutex &operator=(const ProfiledMutex &) = delete;
+
+   void lock();
+   bool try_lock();
+   void unlock();
+
+private:
+   std::mutex mutex;
+   LockSite *site;       // shared by all mutexes with the same name, lives until exit
+   std::chrono::steady_clock::time_point acquiredAt; // only touched while mutex is held
+};
+
+typedef std::condition_variable_any ProfiledCondition;
+typedef std::unique_lock<ProfiledMutex> ProfiledLock;
+
+#else
+
+class ProfiledMutex : public std::mutex
+{
+public:
+   explicit ProfiledMutex(const char *) {}
+};
+
+typedef std::condition_variable ProfiledCondition;
+typedef std::unique_lock<std::mutex> ProfiledLock;
+
+#endif
+
+// "lock_wait:<name> ..." and "lock_hold:<name> ..." lines, empty unless built with ENABLE_LOCK_PROFILING
+std::vector<std::string> lockProfile();
+
+#endif
@@ -0,0 +1,115 @@
+#include "twmailer-output.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#define OUTPUT_MAX_PARTS 64 // iovecs per sendmsg(), far below IOV_MAX
+
+///////////////////////////////////////////////////////////////////////////////
+
+std::string &OutputBuffer::tail()
+{
+   if (!tailOpen)
+   {
+      if (used == chunks.size())
+      {
+         chunks.emplace_back();
+      }
+      else
+      {
+         chunks[used].clear(); // keeps the capacity of earlier replies
+      }
+      used++;
+      tailOpen = true;
+   }
+   return chunks[used - 1];
+}
+
+void OutputBuffer::take(std::string &&data)
+{
+   if (data.size() <= OUTPUT_COPY_LIMIT)
+   {
+      tail().append(data);
+      return;
+   }
+   if (used == chunks.size())
+   {
+      chunks.push_back(std::move(data));
+   }
+   else
+   {
+      chunks[used] = std::move(data);
+   }
+   used++;
+   tailOpen = false;
+}
+
+//====================================================================================================================
+
+FlushResult OutputBuffer::flush(int socket, size_t &sent, size_t &calls)
+{
+   while (first < used)
+   {
+      iovec parts[OUTPUT_MAX_PARTS];
+      int count = 0;
+      size_t next = first;
+      for (; next < used && count < OUTPUT_MAX_PARTS; next++)
+      {
+         size_t skip = next == first ? offset : 0;
+         if (chunks[next].size() > skip)
+         {
+            parts[count].iov_base = chunks[next].data() + skip;
+            parts[count].iov_len = chunks[next].size() - skip;
+            count++;
+         }
+      }
+      if (count == 0)
+      {
+         break; // only empty chunks left
+      }
+
+      // More chunks than one call takes: MSG_MORE holds back the last partial segment of this call
+      // like TCP_CORK would, without the two extra setsockopt() calls
+      msghdr message = {};
+      message.msg_iov = parts;
+      message.msg_iovlen = count;
+      ssize_t written = sendmsg(socket, &message, MSG_DONTWAIT | MSG_NOSIGNAL | (next < used ? MSG_MORE : 0));
+      calls++;
+      if (written == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return errno == EAGAIN || errno == EWOULDBLOCK ? FlushResult::BLOCKED : FlushResult::FAILED;
+      }
+      sent += written;
+
+      // a short write ends anywhere, even inside a chunk
+      size_t left = written;
+      while (first < used && left >= chunks[first].size() - offset)
+      {
+         left -= chunks[first].size() - offset;
+         first++;
+         offset = 0;
+      }
+      offset += left;
+   }
+
+   // Drained: start over at the first chunk. Moved in message bodies are released, one small chunk stays
+   // allocated so the next replies of the session need no memory.
+   first = 0;
+   used = 0;
+   offset = 0;
+   tailOpen = false;
+   if (chunks.size() > 1)
+   {
+      chunks.resize(1);
+   }
+   if (!chunks.empty() && chunks[0].capacity() > OUTPUT_KEEP_CAPACITY)
+   {
+      std::string().swap(chunks[0]);
+   }
+   return FlushResult::DONE;
+}
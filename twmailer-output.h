@@ -0,0 +1,47 @@
+#ifndef TWMAILER_OUTPUT_H
+#define TWMAILER_OUTPUT_H
+
+#include <stddef.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Bytes waiting to be sent on one connection. Small parts (status lines, frame headers) are
+// copied into the chunk being filled, large ones (message bodies) are moved in as chunks of
+// their own, and flush() hands as many chunks as fit to one sendmsg(). Whatever the socket
+// does not take stays queued in order, so a short write never truncates or reorders replies.
+
+#define OUTPUT_COPY_LIMIT 4096          // larger parts become chunks of their own instead of being copied
+#define OUTPUT_KEEP_CAPACITY (64 * 1024) // a drained buffer keeps one chunk up to this size for the next replies
+
+enum class FlushResult
+{
+   DONE,    // nothing left to send
+   BLOCKED, // the socket buffer is full, wait for POLLOUT/EPOLLOUT and flush again
+   FAILED   // connection broken, errno is set
+};
+
+class OutputBuffer
+{
+public:
+   std::string &tail();             // the chunk being filled, formatters append to it directly
+   void append(std::string_view data) { tail().append(data); }
+   void take(std::string &&data);   // appends, large strings become chunks without being copied
+
+   bool empty() const { return first == used; }
+
+   // Sends without blocking (MSG_DONTWAIT), works on blocking and non-blocking sockets alike.
+   // sent and calls are increased by the bytes written and the sendmsg() calls made.
+   FlushResult flush(int socket, size_t &sent, size_t &calls);
+
+private:
+   std::vector<std::string> chunks; // [first, used) are queued, the rest keep their capacity
+   size_t first = 0;
+   size_t used = 0;
+   size_t offset = 0;               // bytes of chunks[first] already sent
+   bool tailOpen = false;           // chunks[used - 1] may still be appended to
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "twmailer-perf.h"
+#include "twmailer-log.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////
+
+const char *const perfCounterNames[PERF_COUNTERS] = {"cycles", "instructions", "cache_misses", "context_switches",
+                                                     "task_clock_ns"};
+
+static const struct
+{
+   uint32_t type;
+   uint64_t config;
+} perfEvents[PERF_COUNTERS] = {
+   {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+   {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+   {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+   {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+   {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+
+static std::atomic<bool> enabled{false};
+static std::atomic<unsigned> availableMask{0}; // counters that could be opened by any thread
+
+namespace
+{
+// One group per thread, so all counters are read with a single read()
+struct ThreadCounters
+{
+   bool opened = false;
+   int leader = -1;
+   int fds[PERF_COUNTERS];
+   int slot[PERF_COUNTERS];  // position in the group read, -1 if this counter is not available
+   int members = 0;
+
+   ThreadCounters()
+   {
+      for (int i = 0; i < PERF_COUNTERS; i++)
+      {
+         fds[i] = -1;
+         slot[i] = -1;
+      }
+   }
+   ~ThreadCounters()
+   {
+      for (int fd : fds)
+      {
+         if (fd != -1)
+         {
+            close(fd);
+         }
+      }
+   }
+
+   void open();
+};
+
+thread_local ThreadCounters counters;
+}
+
+//====================================================================================================================
+
+static int openCounter(int counter, int groupFd, bool userOnly)
+{
+   perf_event_attr attr;
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = perfEvents[counter].type;
+   attr.config = perfEvents[counter].config;
+   attr.read_format = PERF_FORMAT_GROUP;
+   attr.exclude_kernel = userOnly;
+   attr.exclude_hv = userOnly;
+   // this thread on any CPU
+   return (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+void ThreadCounters::open()
+{
+   opened = true;
+   for (int i = 0; i < PERF_COUNTERS; i++)
+   {
+      int fd = openCounter(i, leader, false);
+      if (fd == -1 && (errno == EACCES || errno == EPERM))
+      {
+         fd = openCounter(i, leader, true);
+      }
+      if (fd == -1)
+      {
+         continue;
+      }
+      fds[i] = fd;
+      slot[i] = members++;
+      if (leader == -1)
+      {
+         leader = fd;
+      }
+      availableMask |= 1u << i;
+   }
+}
+
+//====================================================================================================================
+
+bool enablePerfCounters()
+{
+   enabled = true;
+   // probe on this thread so a missing kernel feature is reported at startup
+   uint64_t values[PERF_COUNTERS];
+   if (!readPerfCounters(values) || availableMask == 0)
+   {
+      logError("no performance counters, perf_event_open: {}", LogErrno{errno});
+      enabled = false;
+      return false;
+   }
+   for (int i = 0; i < PERF_COUNTERS; i++)
+   {
+      if (!perfCounterAvailable(i))
+      {
+         logWarn("performance counter {} is not available", perfCounterNames[i]);
+      }
+   }
+   return true;
+}
+
+bool perfCountersEnabled()
+{
+   return enabled.load(std::memory_order_relaxed);
+}
+
+bool perfCounterAvailable(int counter)
+{
+   return (availableMask.load(std::memory_order_relaxed) & (1u << counter)) != 0;
+}
+
+bool readPerfCounters(uint64_t values[PERF_COUNTERS])
+{
+   if (!perfCountersEnabled())
+   {
+      return false;
+   }
+   if (!counters.opened)
+   {
+      counters.open();
+   }
+   if (counters.leader == -1)
+   {
+      return false;
+   }
+
+   // PERF_FORMAT_GROUP: number of members, then one value per member in the order they were opened
+   uint64_t buffer[1 + PERF_COUNTERS];
+   if (read(counters.leader, buffer, sizeof(buffer)) < (ssize_t)sizeof(uint64_t))
+   {
+      return false;
+   }
+   for (int i = 0; i < PERF_COUNTERS; i++)
+   {
+      values[i] = counters.slot[i] == -1 ? 0 : buffer[1 + counters.slot[i]];
+   }
+   return true;
+}
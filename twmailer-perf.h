@@ -0,0 +1,32 @@
+#ifndef TWMAILER_PERF_H
+#define TWMAILER_PERF_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Hardware and software performance counters of the calling thread (perf_event_open), so per command
+// costs can be told apart: many instructions per command means CPU bound, many cache misses per
+// instruction memory bound, task clock far below wall time or many context switches means it waited
+// in syscalls or for locks. Only counted with --perf-counters, user space only if the kernel does not
+// allow more (kernel.perf_event_paranoid).
+
+enum PerfCounter
+{
+   PERF_CYCLES,
+   PERF_INSTRUCTIONS,
+   PERF_CACHE_MISSES,
+   PERF_CONTEXT_SWITCHES,
+   PERF_TASK_CLOCK,        // nanoseconds on a CPU
+   PERF_COUNTERS
+};
+
+extern const char *const perfCounterNames[PERF_COUNTERS];
+
+bool enablePerfCounters();     // false if not even one counter can be opened
+bool perfCountersEnabled();
+bool perfCounterAvailable(int counter);
+
+// Current totals of this thread's counters, opened on first use. False while disabled.
+bool readPerfCounters(uint64_t values[PERF_COUNTERS]);
+
+#endif
@@ -0,0 +1,232 @@
+#include "twmailer-protocol.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+static const struct
+{
+   const char *name;
+   Opcode opcode;
+} opcodeNames[] = {
+    {"LOGIN", Opcode::LOGIN},
+    {"SEND", Opcode::SEND},
+    {"LIST", Opcode::LIST},
+    {"READ", Opcode::READ},
+    {"DEL", Opcode::DEL},
+    {"QUIT", Opcode::QUIT},
+    {"MREAD", Opcode::MREAD},
+    {"MDEL", Opcode::MDEL},
+    {"IDLE", Opcode::IDLE},
+    {"DONE", Opcode::DONE},
+    {"STATS", Opcode::STATS},
+    {"CONFIG", Opcode::CONFIG},
+    {"RESUME", Opcode::RESUME},
+};
+
+Opcode opcodeFromName(std::string_view name)
+{
+   for (const auto &entry : opcodeNames)
+   {
+      if (name == entry.name)
+      {
+         return entry.opcode;
+      }
+   }
+   return Opcode::NONE;
+}
+
+const char *opcodeName(Opcode opcode)
+{
+   for (const auto &entry : opcodeNames)
+   {
+      if (opcode == entry.opcode)
+      {
+         return entry.name;
+      }
+   }
+   return "UNKNOWN";
+}
+
+const char *statusName(Status status)
+{
+   switch (status)
+   {
+   case Status::OK:
+      return "OK";
+   case Status::ERR_UNKNOWN_COMMAND:
+      return "ERR_UNKNOWN_COMMAND";
+   case Status::ERR_NOT_LOGGED_IN:
+      return "ERR_NOT_LOGGED_IN";
+   case Status::ERR_BAD_REQUEST:
+      return "ERR_BAD_REQUEST";
+   case Status::ERR_AUTH_FAILED:
+      return "ERR_AUTH_FAILED";
+   case Status::ERR_BLACKLISTED:
+      return "ERR_BLACKLISTED";
+   case Status::ERR_NOT_FOUND:
+      return "ERR_NOT_FOUND";
+   case Status::ERR_INTERNAL:
+      return "ERR_INTERNAL";
+   case Status::ERR_FORBIDDEN:
+      return "ERR_FORBIDDEN";
+   }
+   return "ERR";
+}
+
+//====================================================================================================================
+
+static bool parseNumber(const std::string &text, int &number)
+{
+   char *end = nullptr;
+   long value = strtol(text.c_str(), &end, 10);
+   if (text.empty() || *end != '\0' || value <= 0 || value > INT32_MAX)
+   {
+      return false;
+   }
+   number = (int)value;
+   return true;
+}
+
+bool parseMessageRange(const std::string &text, std::vector<int> &numbers)
+{
+   size_t start = 0;
+   while (start <= text.size())
+   {
+      size_t end = text.find(',', start);
+      if (end == std::string::npos)
+      {
+         end = text.size();
+      }
+      std::string part = text.substr(start, end - start);
+      start = end + 1;
+
+      int first, last;
+      size_t dash = part.find('-');
+      if (dash == std::string::npos)
+      {
+         if (!parseNumber(part, first))
+         {
+            return false;
+         }
+         last = first;
+      }
+      else if (!parseNumber(part.substr(0, dash), first) || !parseNumber(part.substr(dash + 1), last) || last < first)
+      {
+         return false;
+      }
+
+      if (numbers.size() + (size_t)(last - first) + 1 > MAX_RANGE_COUNT)
+      {
+         return false;
+      }
+      for (int number = first; number <= last; number++)
+      {
+         numbers.push_back(number);
+      }
+   }
+   return !numbers.empty();
+}
+
+//====================================================================================================================
+
+static void appendU32(std::string &out, uint32_t value)
+{
+   uint32_t network = htonl(value);
+   out.append((const char *)&network, sizeof(network));
+}
+
+static uint32_t readU32(std::string_view in, size_t offset)
+{
+   uint32_t network;
+   memcpy(&network, in.data() + offset, sizeof(network));
+   return ntohl(network);
+}
+
+std::string encodeFrame(const Frame &frame)
+{
+   std::string out;
+   encodeFrame(frame, out);
+   return out;
+}
+
+void encodeFrame(const Frame &frame, std::string &out)
+{
+   size_t length = V2_HEADER_LENGTH - 4;
+   for (const std::string &field : frame.fields)
+   {
+      length += 4 + field.size();
+   }
+
+   out.reserve(out.size() + 4 + length);
+   appendU32(out, (uint32_t)length);
+   out.push_back((char)frame.code);
+   appendU32(out, frame.requestId);
+   for (const std::string &field : frame.fields)
+   {
+      appendU32(out, (uint32_t)field.size());
+      out.append(field);
+   }
+}
+
+//====================================================================================================================
+
+int decodeFrame(std::string &buffer, Frame &frame)
+{
+   FrameView view;
+   size_t length;
+   int rc = decodeFrame(buffer, view, length);
+   if (rc == 1)
+   {
+      frame.code = view.code;
+      frame.requestId = view.requestId;
+      frame.fields.assign(view.fields.begin(), view.fields.end());
+      buffer.erase(0, length);
+   }
+   return rc;
+}
+
+int decodeFrame(std::string_view buffer, FrameView &frame, size_t &length)
+{
+   if (buffer.size() < 4)
+   {
+      return 0;
+   }
+
+   uint32_t frameLength = readU32(buffer, 0);
+   if (frameLength < V2_HEADER_LENGTH - 4 || frameLength > V2_MAX_FRAME_LENGTH)
+   {
+      return -1;
+   }
+   if (buffer.size() < 4 + (size_t)frameLength)
+   {
+      return 0;
+   }
+
+   size_t end = 4 + frameLength;
+   frame.code = (uint8_t)buffer[4];
+   frame.requestId = readU32(buffer, 5);
+   frame.fields.clear();
+
+   size_t offset = V2_HEADER_LENGTH;
+   while (offset < end)
+   {
+      if (end - offset < 4)
+      {
+         return -1;
+      }
+      uint32_t fieldLength = readU32(buffer, offset);
+      offset += 4;
+      if (end - offset < fieldLength)
+      {
+         return -1;
+      }
+      frame.fields.push_back(buffer.substr(offset, fieldLength));
+      offset += fieldLength;
+   }
+
+   length = end;
+   return 1;
+}
@@ -0,0 +1,102 @@
+#ifndef TWMAILER_PROTOCOL_H
+#define TWMAILER_PROTOCOL_H
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Binary protocol v2
+//
+// A client starts in the text protocol and switches by sending the line
+// "V2". The server answers "OK\n" and from then on both sides only exchange
+// frames:
+//
+//    u32  length of the rest of the frame (network byte order)
+//    u8   opcode (request) or status (response)
+//    u32  request id, echoed back unchanged in the response
+//    ...  fields, each one u32 length followed by that many bytes
+//
+// Fields are length prefixed, so message bodies may contain any bytes.
+//
+// MREAD answers with one frame per message (number, sender, subject, message)
+// followed by a last frame carrying only the number of messages sent.
+// After IDLE is confirmed, every new message is announced with a frame that
+// carries the request id of IDLE and the message number, until DONE.
+// STATS (local clients only) answers with one "name key=value ..." field per metric.
+// CONFIG (local clients only) takes one field, empty or "name=value", sets that tunable
+// and answers with one "name=value" field per tunable.
+// LOGIN with a third, non-empty field asks for a session ticket, which the OK reply carries as
+// its only field (no field while ticket-lifetime is 0). RESUME takes the ticket as its one field
+// and logs in as its user without asking the authenticator.
+
+#define V2_HELLO "V2"
+#define V2_HEADER_LENGTH 9
+#define V2_MAX_FRAME_LENGTH (16 * 1024 * 1024)
+#define MAX_RANGE_COUNT 10000 // message numbers a range like "1-5,8" may expand to
+
+enum class Opcode : uint8_t
+{
+   NONE = 0,
+   LOGIN = 1,
+   SEND = 2,
+   LIST = 3,
+   READ = 4,
+   DEL = 5,
+   QUIT = 6,
+   MREAD = 7,
+   MDEL = 8,
+   IDLE = 9,
+   DONE = 10,
+   STATS = 11,
+   CONFIG = 12,
+   RESUME = 13
+};
+
+enum class Status : uint8_t
+{
+   OK = 0,
+   ERR_UNKNOWN_COMMAND = 1,
+   ERR_NOT_LOGGED_IN = 2,
+   ERR_BAD_REQUEST = 3,
+   ERR_AUTH_FAILED = 4,
+   ERR_BLACKLISTED = 5,
+   ERR_NOT_FOUND = 6,
+   ERR_INTERNAL = 7,
+   ERR_FORBIDDEN = 8
+};
+
+struct Frame
+{
+   uint8_t code = 0;        // Opcode for requests, Status for responses
+   uint32_t requestId = 0;
+   std::vector<std::string> fields;
+};
+
+// A frame whose fields point into the receive buffer, valid until that buffer changes
+struct FrameView
+{
+   uint8_t code = 0;
+   uint32_t requestId = 0;
+   std::vector<std::string_view> fields;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+Opcode opcodeFromName(std::string_view name);
+const char *opcodeName(Opcode opcode);
+const char *statusName(Status status);
+
+// "3", "1-5" or "1-5,8,10-12" -> message numbers in the given order
+bool parseMessageRange(const std::string &text, std::vector<int> &numbers);
+
+std::string encodeFrame(const Frame &frame);
+void encodeFrame(const Frame &frame, std::string &out); // appends to out
+// 1: one frame decoded and removed from buffer, 0: need more data, -1: malformed
+int decodeFrame(std::string &buffer, Frame &frame);
+// same without copying or removing anything, length is set to the bytes the frame takes up
+int decodeFrame(std::string_view buffer, FrameView &frame, size_t &length);
+
+#endif
@@ -0,0 +1,477 @@
+#include "twmailer-replay.h"
+
+// Replays a capture of the server (./bin/server --capture=<file>) against a running server:
+// every captured session gets its own protocol v2 connection and sends the captured commands
+// at the captured times, scaled by --speed. --speed 0 sends each session's next command as soon
+// as the previous one is answered.
+//
+// ./bin/replay [--host ip] [--port n] [--speed x] <capture file>
+//
+// LOGIN passwords are not in the capture, so start the server with --auth=none and on a copy of
+// the mail directory taken when the capture started, otherwise READ/DEL statuses will differ.
+// RESUME is replayed as LOGIN of the ticket's user, its latency counts for LOGIN.
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+   Options options;
+   if (!parseOptions(argc, argv, options))
+   {
+      fprintf(stderr, "usage: %s [--host ip] [--port n] [--speed x] <capture file>\n", argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   std::vector<ReplaySession> sessions;
+   std::vector<ScheduledRequest> schedule;
+   if (!loadCapture(options.capture, sessions, schedule))
+   {
+      return EXIT_FAILURE;
+   }
+
+   // every captured session may be open at the same time
+   struct rlimit limit;
+   if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+   {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+   }
+   signal(SIGPIPE, SIG_IGN);
+
+   int epollFd = epoll_create1(0);
+   if (epollFd == -1)
+   {
+      perror("epoll error");
+      return EXIT_FAILURE;
+   }
+
+   CommandStats stats[COMMANDS];
+   uint64_t lost = 0;
+   bool closedLoop = options.speed == 0;
+   auto start = std::chrono::steady_clock::now();
+
+   if (closedLoop)
+   {
+      for (ReplaySession &session : sessions)
+      {
+         if (!openConnection(session, options, epollFd))
+         {
+            return EXIT_FAILURE;
+         }
+         sendNext(session, start);
+      }
+   }
+
+   size_t nextScheduled = closedLoop ? schedule.size() : 0;
+   auto lastScheduled = start;
+   epoll_event events[MAX_EVENTS];
+
+   while (true)
+   {
+      auto now = std::chrono::steady_clock::now();
+
+      // everything that is due goes out, even if the server is behind
+      while (nextScheduled < schedule.size())
+      {
+         const ScheduledRequest &request = schedule[nextScheduled];
+         auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                std::chrono::duration<double, std::micro>(request.offsetMicros / options.speed));
+         if (due > now)
+         {
+            break;
+         }
+         nextScheduled++;
+         lastScheduled = due;
+
+         ReplaySession &session = sessions[request.session];
+         if (session.closed)
+         {
+            continue;
+         }
+         if (request.end)
+         {
+            session.ended = true;
+            continue;
+         }
+         if (session.fd == -1 && !openConnection(session, options, epollFd))
+         {
+            return EXIT_FAILURE;
+         }
+         sendNext(session, due);
+         if (session.connected && !flush(session, epollFd))
+         {
+            closeSession(session, stats, lost);
+         }
+      }
+
+      bool scheduleDone = nextScheduled == schedule.size();
+      bool pending = false;
+      for (ReplaySession &session : sessions)
+      {
+         if (!session.closed && session.fd != -1 && finished(session, scheduleDone))
+         {
+            closeSession(session, stats, lost);
+         }
+         pending = pending || (!session.closed && session.fd != -1);
+      }
+      if ((scheduleDone && !pending) || (scheduleDone && now >= lastScheduled + std::chrono::seconds(DRAIN_SECONDS)))
+      {
+         break;
+      }
+
+      int timeout = 100;
+      if (!scheduleDone)
+      {
+         auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                std::chrono::duration<double, std::micro>(schedule[nextScheduled].offsetMicros / options.speed));
+         timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count();
+      }
+      int count = epoll_wait(epollFd, events, MAX_EVENTS, timeout < 0 ? 0 : timeout);
+      for (int i = 0; i < count; i++)
+      {
+         ReplaySession &session = sessions[events[i].data.u32];
+         if (session.closed)
+         {
+            continue;
+         }
+
+         bool ok = true;
+         if (events[i].events & EPOLLOUT)
+         {
+            if (!session.connected)
+            {
+               int error = 0;
+               socklen_t length = sizeof(error);
+               getsockopt(session.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+               session.connected = error == 0;
+               ok = session.connected;
+            }
+            ok = ok && flush(session, epollFd);
+         }
+         if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+         {
+            ok = receive(session, stats, epollFd, closedLoop);
+         }
+         if (!ok)
+         {
+            closeSession(session, stats, lost);
+         }
+      }
+   }
+
+   for (ReplaySession &session : sessions)
+   {
+      if (!session.closed && session.fd != -1)
+      {
+         closeSession(session, stats, lost);
+      }
+   }
+
+   report(stats, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), lost);
+   close(epollFd);
+   return EXIT_SUCCESS;
+}
+
+//====================================================================================================================
+
+bool parseOptions(int argc, char *argv[], Options &options)
+{
+   for (int i = 1; i < argc; i++)
+   {
+      string option = argv[i];
+      if (option.rfind("--", 0) != 0)
+      {
+         options.capture = option;
+         continue;
+      }
+      if (i + 1 >= argc)
+      {
+         return false;
+      }
+      string value = argv[++i];
+
+      if (option == "--host")
+      {
+         options.host = value;
+      }
+      else if (option == "--port")
+      {
+         options.port = atoi(value.c_str());
+      }
+      else if (option == "--speed")
+      {
+         options.speed = atof(value.c_str());
+      }
+      else
+      {
+         return false;
+      }
+   }
+   return !options.capture.empty() && options.speed >= 0;
+}
+
+//====================================================================================================================
+
+bool loadCapture(const string &path, std::vector<ReplaySession> &sessions, std::vector<ScheduledRequest> &schedule)
+{
+   CaptureReader reader;
+   if (!reader.open(path))
+   {
+      return false;
+   }
+
+   std::map<uint32_t, uint32_t> indexOf; // captured session -> position in sessions
+   CaptureRecord record;
+   int rc;
+   while ((rc = reader.next(record)) == 1)
+   {
+      auto it = indexOf.find(record.session);
+      if (it == indexOf.end())
+      {
+         if (record.opcode == Opcode::QUIT)
+         {
+            continue; // connected and left without a command
+         }
+         it = indexOf.emplace(record.session, sessions.size()).first;
+         sessions.emplace_back();
+         sessions.back().index = it->second;
+      }
+
+      // the ticket's signature is not in the capture: log in as its user instead, which --auth=none accepts
+      if (record.opcode == Opcode::RESUME && record.args.size() == 1)
+      {
+         size_t expiry = record.args[0].rfind(':', record.args[0].rfind(':') - 1);
+         record.opcode = Opcode::LOGIN;
+         record.args = {record.args[0].substr(0, expiry), CAPTURE_REDACTED};
+      }
+
+      if (record.opcode == Opcode::QUIT)
+      {
+         schedule.push_back({record.offsetMicros, it->second, true});
+      }
+      else if (record.opcode >= Opcode::LOGIN && record.opcode <= Opcode::MDEL)
+      {
+         schedule.push_back({record.offsetMicros, it->second, false});
+         sessions[it->second].requests.push_back(std::move(record));
+      }
+   }
+   if (rc == -1)
+   {
+      fprintf(stderr, "%s: malformed record after %zu requests, replaying those\n", path.c_str(), schedule.size());
+   }
+
+   // records are written when commands finish, a session's own records stay in order
+   std::stable_sort(schedule.begin(), schedule.end(),
+                    [](const ScheduledRequest &a, const ScheduledRequest &b) { return a.offsetMicros < b.offsetMicros; });
+   printf("%zu sessions, %zu requests\n", sessions.size(), schedule.size());
+   return true;
+}
+
+//====================================================================================================================
+
+bool openConnection(ReplaySession &session, const Options &options, int epollFd)
+{
+   struct sockaddr_in address;
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_port = htons(options.port);
+   if (inet_aton(options.host.c_str(), &address.sin_addr) == 0)
+   {
+      fprintf(stderr, "invalid host %s\n", options.host.c_str());
+      return false;
+   }
+
+   session.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (session.fd == -1)
+   {
+      perror("Socket error");
+      return false;
+   }
+   int noDelay = 1;
+   setsockopt(session.fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+   if (connect(session.fd, (struct sockaddr *)&address, sizeof(address)) == -1 && errno != EINPROGRESS)
+   {
+      perror("Connect error - no server available");
+      return false;
+   }
+
+   // switch to v2 right away, the server answers the pipelined hello after its welcome text
+   session.outbuf = string(V2_HELLO) + "\n";
+   session.writing = true;
+
+   epoll_event event;
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN | EPOLLOUT;
+   event.data.u32 = session.index;
+   if (epoll_ctl(epollFd, EPOLL_CTL_ADD, session.fd, &event) == -1)
+   {
+      perror("epoll_ctl");
+      return false;
+   }
+   return true;
+}
+
+//====================================================================================================================
+
+void sendNext(ReplaySession &session, std::chrono::steady_clock::time_point scheduled)
+{
+   if (session.next >= session.requests.size())
+   {
+      return;
+   }
+   const CaptureRecord &record = session.requests[session.next++];
+
+   Frame request;
+   request.code = (uint8_t)record.opcode;
+   request.requestId = ++session.nextId;
+   request.fields = record.args;
+   session.outbuf += encodeFrame(request);
+   session.inflight.push_back({request.requestId, record.opcode, scheduled, record.serviceMicros, record.status});
+}
+
+//====================================================================================================================
+
+bool flush(ReplaySession &session, int epollFd)
+{
+   while (!session.outbuf.empty())
+   {
+      ssize_t sent = send(session.fd, session.outbuf.data(), session.outbuf.size(), MSG_NOSIGNAL);
+      if (sent == -1)
+      {
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+         {
+            return false;
+         }
+         break;
+      }
+      session.outbuf.erase(0, sent);
+   }
+
+   // only ask for EPOLLOUT while something is left over
+   bool writing = !session.outbuf.empty();
+   if (writing != session.writing)
+   {
+      epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+      event.data.u32 = session.index;
+      if (epoll_ctl(epollFd, EPOLL_CTL_MOD, session.fd, &event) == -1)
+      {
+         return false;
+      }
+      session.writing = writing;
+   }
+   return true;
+}
+
+//====================================================================================================================
+
+bool receive(ReplaySession &session, CommandStats stats[], int epollFd, bool closedLoop)
+{
+   char buffer[BUF];
+   ssize_t size = recv(session.fd, buffer, BUF, 0);
+   if (size == 0 || (size == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+   {
+      return false;
+   }
+   if (size > 0)
+   {
+      session.inbuf.append(buffer, size);
+   }
+
+   // welcome text ("...\r\n...\r\n") and the "OK\n" of the hello come before the first frame
+   if (session.handshake)
+   {
+      size_t end = session.inbuf.find("\r\nOK\n");
+      if (end == string::npos)
+      {
+         return true;
+      }
+      session.inbuf.erase(0, end + 5);
+      session.handshake = false;
+   }
+
+   auto now = std::chrono::steady_clock::now();
+   Frame response;
+   int rc;
+   while ((rc = decodeFrame(session.inbuf, response)) == 1)
+   {
+      if (session.inflight.empty() || session.inflight.front().requestId != response.requestId)
+      {
+         fprintf(stderr, "unexpected reply %u\n", response.requestId);
+         return false;
+      }
+      // MREAD answers with one frame per message before the final count
+      if (session.inflight.front().opcode == Opcode::MREAD && response.code == (uint8_t)Status::OK &&
+          response.fields.size() == 4)
+      {
+         continue;
+      }
+      Outstanding request = session.inflight.front();
+      session.inflight.pop_front();
+
+      CommandStats &command = stats[(int)request.opcode];
+      command.captured.record(request.capturedMicros * 1000);
+      command.replayed.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - request.scheduled).count());
+      if (response.code != (uint8_t)request.capturedStatus)
+      {
+         command.mismatches++;
+      }
+
+      if (closedLoop && session.inflight.empty())
+      {
+         sendNext(session, now);
+      }
+   }
+   return rc != -1 && flush(session, epollFd);
+}
+
+//====================================================================================================================
+
+// All requests answered and the captured client is gone, or nothing more will come for it
+bool finished(const ReplaySession &session, bool scheduleDone)
+{
+   return session.next == session.requests.size() && session.inflight.empty() && session.outbuf.empty() &&
+          (session.ended || scheduleDone);
+}
+
+void closeSession(ReplaySession &session, CommandStats stats[], uint64_t &lost)
+{
+   // requests that will never be answered count as mismatches
+   for (const Outstanding &request : session.inflight)
+   {
+      stats[(int)request.opcode].mismatches++;
+   }
+   lost += session.inflight.size() + (session.requests.size() - session.next);
+   session.inflight.clear();
+   close(session.fd);
+   session.fd = -1;
+   session.closed = true;
+}
+
+//====================================================================================================================
+
+void report(const CommandStats stats[], double seconds, uint64_t lost)
+{
+   printf("%-6s %8s %8s | %11s %11s | %11s %11s | %11s %11s\n", "cmd", "count", "mismatch",
+          "capt p50 us", "capt p99 us", "repl p50 us", "repl p99 us", "delta p50", "delta p99");
+   uint64_t completed = 0;
+   for (int i = (int)Opcode::LOGIN; i < COMMANDS; i++)
+   {
+      const CommandStats &command = stats[i];
+      if (command.replayed.count() == 0 && command.mismatches == 0)
+      {
+         continue;
+      }
+      completed += command.replayed.count();
+      double captured50 = command.captured.percentile(50) / 1e3, captured99 = command.captured.percentile(99) / 1e3;
+      double replayed50 = command.replayed.percentile(50) / 1e3, replayed99 = command.replayed.percentile(99) / 1e3;
+      printf("%-6s %8lu %8lu | %11.1f %11.1f | %11.1f %11.1f | %+11.1f %+11.1f\n",
+             opcodeName((Opcode)i), (unsigned long)command.replayed.count(), (unsigned long)command.mismatches,
+             captured50, captured99, replayed50, replayed99, replayed50 - captured50, replayed99 - captured99);
+   }
+   printf("replayed %lu requests in %.1f s (%.1f req/s), %lu without reply\n",
+          (unsigned long)completed, seconds, completed / seconds, (unsigned long)lost);
+   printf("captured times are server side service times, replayed times include the network round trip\n");
+}
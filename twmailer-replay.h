@@ -0,0 +1,98 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <algorithm>
+
+#include "twmailer-protocol.h"
+#include "twmailer-histogram.h"
+#include "twmailer-capture.h"
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define PORT 6543
+#define BUF 16384
+#define MAX_EVENTS 256
+#define DRAIN_SECONDS 5 // how long replies are awaited after the last request
+#define COMMANDS ((int)Opcode::MDEL + 1)
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct Options
+{
+   string host = "127.0.0.1";
+   int port = PORT;
+   double speed = 1;           // 2 replays twice as fast as captured, 0 as fast as the server answers
+   string capture;
+};
+
+struct Outstanding
+{
+   uint32_t requestId;
+   Opcode opcode;
+   std::chrono::steady_clock::time_point scheduled;
+   uint64_t capturedMicros;    // service time the capturing server measured
+   Status capturedStatus;
+};
+
+// One captured session, replayed over its own protocol v2 connection
+struct ReplaySession
+{
+   uint32_t index = 0;         // position in the session table, stored in the epoll event
+   std::vector<CaptureRecord> requests;
+   size_t next = 0;            // first request not sent yet
+   bool ended = false;         // the captured client disconnected, close once everything is answered
+   int fd = -1;
+   bool connected = false;
+   bool handshake = true;      // still expecting the text welcome and the "OK" for V2
+   bool closed = false;
+   string inbuf;
+   string outbuf;
+   bool writing = false;       // registered for EPOLLOUT because outbuf did not fit into the socket
+   uint32_t nextId = 0;
+   std::deque<Outstanding> inflight;
+};
+
+struct CommandStats
+{
+   Histogram captured;         // service time on the capturing server, nanoseconds
+   Histogram replayed;         // round trip during the replay, nanoseconds
+   uint64_t mismatches = 0;    // status differs from the captured one
+};
+
+// one entry per captured request, ordered by capture time
+struct ScheduledRequest
+{
+   uint64_t offsetMicros;
+   uint32_t session;
+   bool end;                   // the disconnect instead of the session's next request
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool parseOptions(int argc, char *argv[], Options &options);
+bool loadCapture(const string &path, std::vector<ReplaySession> &sessions, std::vector<ScheduledRequest> &schedule);
+bool openConnection(ReplaySession &session, const Options &options, int epollFd);
+void sendNext(ReplaySession &session, std::chrono::steady_clock::time_point scheduled);
+bool flush(ReplaySession &session, int epollFd);
+bool receive(ReplaySession &session, CommandStats stats[], int epollFd, bool closedLoop);
+bool finished(const ReplaySession &session, bool scheduleDone);
+void closeSession(ReplaySession &session, CommandStats stats[], uint64_t &lost);
+void report(const CommandStats stats[], double seconds, uint64_t lost);
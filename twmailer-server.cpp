@@ -5,33 +5,91 @@
 namespace fs = std::filesystem;
 
 int abortRequested = 0;
-int create_socket = -1;
-int new_socket = -1;
-std::map<std::string, std::unique_ptr<std::mutex>> individualEmailLocks;
-
-const int THREAD_POOL_SIZE = 4;
-std::atomic<int> availableThreads(4);
-std::atomic<int> activeThreads(0);
-const int MAX_THREAD_POOL_SIZE = 32; // Maximum number of threads allowed
-
-// Global Thread Pool Variables
-std::vector<std::thread> threadPool;
-std::queue<int> taskQueue; //shared resource, we lock when accessing it
-                           //this taskQueue will store all clientSockets
-std::mutex blacklistMutex;
-std::mutex queueMutex; //for locking aforementioned taskQueue
-std::mutex threadQueue; //for locking threadPool when creating, deleting threads
-std::condition_variable condition; //synchronization variable, until condition modified and notfied
+ProfiledMutex mailboxLocksMutex("mailboxLocksMutex"); //for individualEmailLocks
+std::map<std::string, std::unique_ptr<ProfiledMutex>, std::less<>> individualEmailLocks;
+std::map<std::string, std::unique_ptr<DeliveryQueue>, std::less<>> deliveryQueues; // receiver -> SENDs to write, guarded by mailboxLocksMutex
+
+std::atomic<int> minThreads(4); // --threads=<n>, workers per shard
+std::atomic<int> maxThreads(32); // --max-threads=<n>, Maximum number of threads allowed per shard
+std::atomic<int> recvBufferSize(1024); // --recv-buffer=<bytes>, read from a client socket at once
+std::atomic<int> sendTimeoutMs(30000); // --send-timeout=<ms>, a client that takes no replies for this long is dropped
+// --lane-auth, --lane-write, --lane-read: commands of the lane running at once per shard, 0 = no limit.
+// Slow LDAP binds and large SENDs then leave the other workers to the cheap commands.
+std::atomic<int> laneLimits[(int)Lane::COUNT] = {16, 16, 0};
+std::string mailRoot = "Emails"; // --mail-dir=<dir>
+
+// Thread pools, one per shard, each with its own taskQueue
+std::vector<std::unique_ptr<Shard>> shards;
+int shardCount = 1; // --shards=<n>
+bool pinShards = false; // --pin-shards, one CPU per shard
+bool numaPlacement = false; // --numa, one NUMA node per shard
+std::vector<int> cpuList; // --cpus=<list>, CPUs to place shards on instead of the whole affinity mask
+std::string unixPath; // --unix=<path>, stream socket for clients on this machine, same protocol as the port
+int unixListenSocket = -1;
+ProfiledMutex blacklistMutex("blacklistMutex");
 std::atomic<bool> serverRunning(true); // can be accessed by multiple threads without race condition
+ProfiledMutex loginAttemptsMutex("loginAttemptsMutex"); //for login_attempts, the auth lane runs logins in parallel
 std::map<std::string, int> login_attempts;
-
-std::mutex directoryMutex; //this is for locking the whole Email directory access
-
-void threadWorker()
+std::unique_ptr<Authenticator> authenticator; // set once in main before the first worker starts
+TicketSigner tickets; // key set in main, --ticket-key=<file> or random
+std::atomic<int> ticketLifetime(3600); // --ticket-lifetime=<seconds>, 0 = LOGIN hands out no tickets
+CaptureWriter capture; // --capture=<file>, records every executed command for bin/replay
+int metricsPort = 0; // --metrics-port=<port>, Prometheus endpoint on 127.0.0.1
+
+// Admission control: past these limits new connections get "BUSY retry-after=<seconds>" and are closed
+std::atomic<int> listenBacklog(128); // --backlog=<n>
+std::atomic<int> maxQueuedSessions(1024); // --max-queue=<n>, sessions waiting for a worker, 0 = unbounded
+std::atomic<int> maxConnectionsPerIp(0); // --max-per-ip=<n>, 0 = no limit
+std::atomic<int> queueTargetMs(0); // --queue-target=<ms>, longest a new session may wait for a worker, 0 = no limit
+ProfiledMutex connectionsMutex("connectionsMutex"); //for connectionsPerPeer
+std::map<std::string, int, std::less<>> connectionsPerPeer; // Session::peer -> open connections
+
+// Restart without refused connections: --handoff=<path> gives the listening sockets to a new process
+// started with --takeover=<path>, then this one stops accepting and drains its sessions
+std::string handoffPath;
+std::atomic<int> drainSeconds(30); // --drain-seconds=<n>, then remaining sessions are cut off
+std::atomic<bool> draining(false); // listeners handed off, sessions are closed after their next reply
+int stopAcceptingFd = -1; // eventfd, readable once the acceptors have to return
+ProfiledMutex sessionsMutex("sessionsMutex"); //for openSessions
+std::set<int> openSessions; // sockets of all accepted sessions not yet closed
+
+ProfiledMutex directoryMutex("directoryMutex"); //this is for locking the whole Email directory access
+
+// IDLE sessions do not occupy a worker: their sockets wait in idleEpoll until the client sends something
+ProfiledMutex idleMutex("idleMutex"); //for locking idleSessions and parkedSessions
+std::map<std::string, std::vector<std::shared_ptr<Session>>, std::less<>> idleSessions; // username -> sessions waiting for mail
+std::map<int, std::shared_ptr<Session>> parkedSessions; // socket -> session without worker
+int idleEpoll = -1;
+
+// Settings that --<name>=<value>, the config file and the CONFIG command can change while the server runs
+static const struct
 {
+   const char *name;
+   int minimum;
+   int maximum;
+   std::atomic<int> *value;
+} tunables[] = {
+    {"threads", 1, 1024, &minThreads},
+    {"max-threads", 1, 1024, &maxThreads},
+    {"backlog", 1, 65535, &listenBacklog},
+    {"max-queue", 0, 1000000, &maxQueuedSessions},
+    {"max-per-ip", 0, 1000000, &maxConnectionsPerIp},
+    {"queue-target", 0, 3600000, &queueTargetMs},
+    {"drain-seconds", 0, 86400, &drainSeconds},
+    {"recv-buffer", 128, 16 * 1024 * 1024, &recvBufferSize},
+    {"send-timeout", 1, 3600000, &sendTimeoutMs},
+    {"ticket-lifetime", 0, 30 * 86400, &ticketLifetime},
+    {"lane-auth", 0, 1024, &laneLimits[(int)Lane::AUTH]},
+    {"lane-write", 0, 1024, &laneLimits[(int)Lane::WRITE]},
+    {"lane-read", 0, 1024, &laneLimits[(int)Lane::READ]},
+};
+
+void threadWorker(Shard *shard)
+{
+    pinShardThread(shard);
     while (serverRunning)
     {
-      std::unique_lock<std::mutex> lock(queueMutex);
+      ProfiledLock lock(shard->queueMutex);
       //this lock is only for accessing the shared taskQueue
 
       //tasks are in the taskQueue. All threads are waiting here, and one gets woken up by condition.notify_one
@@ -40,46 +98,230 @@ void threadWorker()
       //while waiting, unlocks mutex
       //When woken, Checks if there is a task or Server stopped running
       //also reaquires mutex
-      condition.wait(lock, [] {
-    return !taskQueue.empty() || !serverRunning || availableThreads > THREAD_POOL_SIZE;
+      shard->condition.wait(lock, [shard] {
+    return !shard->taskQueue.empty() || !serverRunning || shard->availableThreads > minThreads;
 });
     //3 possibilitels: either something in the taskQueue, or server stopped running (cleanup thread) or 
     //there are a lot of threads, maybe one can be removed
 
       //if taskQueue empty, either because no more tasks or server no longer running
-      if (taskQueue.empty())
+      if (shard->taskQueue.empty())
       {
-         std::cout << "reduced one idle thread" << std::endl;
-            --availableThreads; // Reduce the available thread count
+         logDebug("reduced one idle thread");
+            --shard->availableThreads; // Reduce the available thread count
             return; // Exit thread
       }
 
-      // Get the next client socket
-      int clientSocket = taskQueue.front();
-      taskQueue.pop();
+      // Get the next client session
+      std::shared_ptr<Session> session = shard->taskQueue.front();
+      shard->taskQueue.pop_front();
          lock.unlock(); // Unlock the shared taskQueue mutex while processing the client
-         --availableThreads;
-         ++activeThreads;
-
 
-        // Handle client communication
-        clientCommunication(&clientSocket);
-
-         if(clientSocket != -1)
+      // a new client that already waited past the target is told to come back instead of being served late
+      auto waited = std::chrono::steady_clock::now() - session->queuedAt;
+      if (queueTargetMs > 0 && !session->welcomed && waited > std::chrono::milliseconds(queueTargetMs.load()))
+      {
+         int retryAfter = std::max<int>(1, std::chrono::duration_cast<std::chrono::seconds>(waited).count() + 1);
+         forgetSession(session->socket);
+         rejectConnection(session->socket, retryAfter, Rejection::QUEUE_WAIT);
+         releaseConnection(session->peer);
+         if (session->captureId != 0)
          {
-            // Close client socket
-            shutdown(clientSocket, SHUT_RDWR);
-            close(clientSocket);
+            capture.endSession(session->captureId);
          }
+         continue;
+      }
+         --shard->availableThreads;
+         ++shard->activeThreads;
+
+
+        // Handle client communication, returns when the client is gone or parked in IDLE
+        clientCommunication(session);
         
     }
 }
 
-int main(void)
+// the benchmarks link this file without its main (see "make bench")
+#ifndef TWMAILER_NO_MAIN
+int main(int argc, char *argv[])
 {
-   socklen_t addrlen;
-   struct sockaddr_in address, cliaddress;
-   int reuseValue = 1;
+   int port = PORT;
+
+   ////////////////////////////////////////////////////////////////////////////
+   // ARGUMENTS: ./bin/server [port] [--config=<file>] [--port=<port>] [--mail-dir=<dir>]
+   //            [--auth=ldap|ldap:<uri>|local:<file>|none]
+   //            [--capture=<file>] [--metrics-port=<port>] [--log-level=debug|info|warn|error]
+   //            [--trace=<file>] [--trace-sample=<n>] [--trace-slow=<ms>] [--perf-counters]
+   //            [--shards=<n>] [--pin-shards] [--handoff=<path>] [--takeover=<path>] [--unix=<path>]
+   //            [--ticket-key=<file>]
+   //            [--<tunable>=<n>] (threads, max-threads, backlog, max-queue, ... see tunables)
+   //            ./bin/server --hash-password <username>   (password on stdin)
+   // Options from the config file come first, so the command line overrides them.
+   std::vector<std::string> options;
+   for (int i = 1; i < argc; i++)
+   {
+      if (strncmp(argv[i], "--config=", 9) == 0 && !readConfigFile(argv[i] + 9, options))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   for (int i = 1; i < argc; i++)
+   {
+      if (strncmp(argv[i], "--config=", 9) != 0)
+      {
+         options.push_back(argv[i]);
+      }
+   }
+
+   std::string authSpec = "ldap";
+   std::string capturePath;
+   std::string tracePath;
+   std::string takeoverPath;
+   std::string ticketKeyPath;
+   bool perfCounters = false;
+   uint64_t traceSample = 1;
+   double traceSlowMs = 0;
+   for (size_t i = 0; i < options.size(); i++)
+   {
+      const char *option = options[i].c_str();
+      const char *equals = strchr(option, '=');
+      int tunable = strncmp(option, "--", 2) == 0 && equals != nullptr
+                       ? setTunable(std::string(option + 2, equals), equals + 1)
+                       : -1;
+      if (tunable == 0)
+      {
+         fprintf(stderr, "invalid value: %s\n", option);
+         return EXIT_FAILURE;
+      }
+      else if (tunable == 1)
+      {
+         continue;
+      }
+      else if (strcmp(option, "--hash-password") == 0 && i + 1 < options.size())
+      {
+         std::string password;
+         std::getline(std::cin, password);
+         std::string entry;
+         if (!LocalAuthenticator::makeEntry(options[i + 1], password, entry))
+         {
+            return EXIT_FAILURE;
+         }
+         printf("%s\n", entry.c_str());
+         return EXIT_SUCCESS;
+      }
+      else if (strncmp(option, "--port=", 7) == 0)
+      {
+         port = atoi(option + 7);
+      }
+      else if (strncmp(option, "--mail-dir=", 11) == 0)
+      {
+         mailRoot = option + 11;
+      }
+      else if (strncmp(option, "--auth=", 7) == 0)
+      {
+         authSpec = option + 7;
+      }
+      else if (strncmp(option, "--metrics-port=", 15) == 0)
+      {
+         metricsPort = atoi(option + 15);
+      }
+      else if (strncmp(option, "--capture=", 10) == 0)
+      {
+         capturePath = option + 10;
+      }
+      else if (strncmp(option, "--handoff=", 10) == 0)
+      {
+         handoffPath = option + 10;
+      }
+      else if (strncmp(option, "--takeover=", 11) == 0)
+      {
+         takeoverPath = option + 11;
+      }
+      else if (strncmp(option, "--unix=", 7) == 0)
+      {
+         unixPath = option + 7;
+      }
+      else if (strncmp(option, "--ticket-key=", 13) == 0)
+      {
+         ticketKeyPath = option + 13;
+      }
+      else if (strncmp(option, "--shards=", 9) == 0)
+      {
+         shardCount = atoi(option + 9);
+      }
+      else if (strcmp(option, "--pin-shards") == 0)
+      {
+         pinShards = true;
+      }
+      else if (strcmp(option, "--numa") == 0)
+      {
+         numaPlacement = true;
+      }
+      else if (strncmp(option, "--cpus=", 7) == 0)
+      {
+         if (!parseCpuList(option + 7, cpuList))
+         {
+            fprintf(stderr, "invalid CPU list: %s\n", option + 7);
+            return EXIT_FAILURE;
+         }
+      }
+      else if (strcmp(option, "--perf-counters") == 0)
+      {
+         perfCounters = true;
+      }
+      else if (strncmp(option, "--trace=", 8) == 0)
+      {
+         tracePath = option + 8;
+      }
+      else if (strncmp(option, "--trace-sample=", 15) == 0)
+      {
+         traceSample = strtoull(option + 15, nullptr, 10);
+      }
+      else if (strncmp(option, "--trace-slow=", 13) == 0)
+      {
+         traceSlowMs = atof(option + 13);
+      }
+      else if (strncmp(option, "--", 2) == 0)
+      {
+         fprintf(stderr, "unknown option: %s\n", option);
+         return EXIT_FAILURE;
+      }
+      else
+      {
+         port = atoi(option);
+      }
+   }
+   if (!capturePath.empty() && !capture.open(capturePath))
+   {
+      return EXIT_FAILURE;
+   }
+   if (!tracePath.empty() && !tracer.open(tracePath, traceSample, (uint64_t)(traceSlowMs * 1000)))
+   {
+      return EXIT_FAILURE;
+   }
+
+   startLogger();
+   if (perfCounters && enablePerfCounters())
+   {
+      logInfo("counting cycles, instructions, cache misses and context switches per command");
+   }
+   authenticator = createAuthenticator(authSpec);
+   if (authenticator == nullptr)
+   {
+      logError("invalid authenticator: {}", authSpec);
+      return EXIT_FAILURE;
+   }
+   if (strcmp(authenticator->name(), "none") == 0)
+   {
+      // stand-in for load tests on a machine without the directory server
+      logWarn("--auth=none accepts any username and password");
+   }
+   bool ticketKey = ticketKeyPath.empty() ? tickets.generateKey() // tickets end with this process
+                                          : tickets.loadKey(ticketKeyPath);
+   if (!ticketKey)
+   {
+      return EXIT_FAILURE; // with no key anyone could sign tickets
+   }
 
    ////////////////////////////////////////////////////////////////////////////
    // SIGNAL HANDLER
@@ -87,20 +329,205 @@ int main(void)
    // https://man7.org/linux/man-pages/man2/signal.2.html
    if (signal(SIGINT, signalHandler) == SIG_ERR)
    {
-      perror("signal can not be registered");
+      logErrno("signal can not be registered");
+      return EXIT_FAILURE;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // ONE LISTENING SOCKET PER SHARD, all bound to the same port (SO_REUSEPORT)
+   std::vector<int> cpus = cpuList.empty() ? allowedCpus() : cpuList;
+   std::vector<NumaNode> nodes = numaNodes(cpus);
+   // a restarted server continues with the sockets of the old one, their backlogs included
+   std::vector<int> listeners;
+   if (!takeoverPath.empty())
+   {
+      if (!receiveListeners(takeoverPath, listeners))
+      {
+         return EXIT_FAILURE;
+      }
+      logInfo("took over {} listening socket(s) from {}", listeners.size(), takeoverPath);
+
+      // the old server sends its Unix socket after the TCP ones
+      struct sockaddr_storage address;
+      socklen_t length = sizeof(address);
+      if (!listeners.empty() && getsockname(listeners.back(), (struct sockaddr *)&address, &length) == 0 &&
+          address.ss_family == AF_UNIX)
+      {
+         if (unixPath.empty())
+         {
+            close(listeners.back()); // not wanted any more, the path stays until the old server exits
+         }
+         else
+         {
+            unixListenSocket = listeners.back();
+         }
+         listeners.pop_back();
+      }
+   }
+   if (!unixPath.empty() && unixListenSocket == -1 && (unixListenSocket = openUnixListener(unixPath)) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   for (int i = 0; i < std::max({1, shardCount, (int)listeners.size()}); i++)
+   {
+      auto shard = std::make_unique<Shard>();
+      shard->index = i;
+      placeShard(*shard, cpus, nodes);
+      shard->listenSocket = i < (int)listeners.size() ? listeners[i] : openListener(port);
+      if (shard->listenSocket == -1)
+      {
+         return EXIT_FAILURE;
+      }
+      shards.push_back(std::move(shard));
+   }
+   if ((stopAcceptingFd = eventfd(0, EFD_CLOEXEC)) == -1)
+   {
+      logErrno("eventfd");
+      return EXIT_FAILURE;
+   }
+
+   // create directory for emails
+   struct stat st;
+   if(stat(mailRoot.c_str(), &st) != 0)
+   {
+      mkdir(mailRoot.c_str(), 0700);
+   }
+
+   std::ifstream blacklist(BLACKLIST);
+   if(!blacklist)
+   {
+      std::ofstream outputFile(BLACKLIST);
+   }
+   blacklist.close();
+
+   if ((idleEpoll = epoll_create1(0)) == -1)
+   {
+      logErrno("epoll error");
       return EXIT_FAILURE;
    }
 
+   ////////////////////////////////////////////////////////////////////////////
+    // Initialize Thread Pools and start accepting
+    for (auto &shard : shards)
+    {
+        for (int i = 0; i < minThreads; ++i)
+        {
+            shard->threadPool.emplace_back(threadWorker, shard.get());
+        }
+        shard->availableThreads = minThreads.load();
+        shard->acceptor = std::thread(acceptLoop, shard.get());
+    }
+    logInfo("{} shard(s) accepting on port {}", shards.size(), port);
+    if (unixListenSocket != -1)
+    {
+       logInfo("accepting local clients on {}", unixPath);
+    }
+    if (pinShards || numaPlacement || !cpuList.empty())
+    {
+       for (const std::string &line : placementReport())
+       {
+          logInfo("{}", line);
+       }
+    }
+    std::thread idleThreadManager(removeIdleThreads);
+   idleThreadManager.detach();
+
+   std::thread idleWatcherThread(idleWatcher);
+   std::thread metricsThread;
+   if (metricsPort > 0)
+   {
+      metricsThread = std::thread(metricsServer, metricsPort);
+   }
+   std::thread handoffThread;
+   if (!handoffPath.empty())
+   {
+      int handoffListener = openHandoffListener(handoffPath);
+      if (handoffListener != -1)
+      {
+         handoffThread = std::thread(handoffServer, handoffListener);
+      }
+   }
+
+   // the acceptors return on SIGINT or once the listening sockets were handed off
+   for (auto &shard : shards)
+   {
+      shard->acceptor.join();
+   }
+   if (handoffThread.joinable())
+   {
+      handoffThread.join();
+   }
+   if (draining)
+   {
+      drainSessions();
+   }
+
+   // Cleanup
+   logInfo("Server is shutting down...");
+   serverRunning = false;  // Signal threads to shut down
+
+   if (unixListenSocket != -1)
+   {
+      close(unixListenSocket);
+      if (!draining)
+      {
+         unlink(unixPath.c_str()); // after a handoff the new process accepts on it
+      }
+   }
+
+   // Join all threads
+   for (auto &shard : shards)
+   {
+      close(shard->listenSocket);  // after a handoff only our copy, the new process keeps accepting
+      closeQueuedSessions(*shard);
+      shard->condition.notify_all();  // Wake up all threads
+      for (std::thread &t : shard->threadPool)
+      {
+         if (t.joinable())
+         {
+            t.join();
+         }
+      }
+      closeQueuedSessions(*shard); // queued by the last commands that left a lane
+   }
+   idleWatcherThread.join();
+   if (metricsThread.joinable())
+   {
+      metricsThread.join();
+   }
+   capture.close();
+   tracer.close();
+
+   for (const std::string &line : lockProfile())
+   {
+      logInfo("{}", line);
+   }
+   logInfo("Server shut down.");
+   stopLogger();
+   return EXIT_SUCCESS;
+}
+#endif
+
+//====================================================================================================================
+
+// Socket bound to port on all addresses, SO_REUSEPORT lets every shard bind its own. -1 on errors.
+int openListener(int port)
+{
+   struct sockaddr_in address;
+   int reuseValue = 1;
+   int listenSocket;
+
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A SOCKET
    // https://man7.org/linux/man-pages/man2/socket.2.html
    // https://man7.org/linux/man-pages/man7/ip.7.html
    // https://man7.org/linux/man-pages/man7/tcp.7.html
    // IPv4, TCP (connection oriented), IP (same as client)
-   if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   // Non-blocking: acceptors wait in poll(), after a handoff two processes may race for a connection
+   if ((listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1)
    {
-      perror("Socket error"); // errno set by socket()
-      return EXIT_FAILURE;
+      logErrno("Socket error"); // errno set by socket()
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
@@ -108,24 +535,26 @@ int main(void)
    // https://man7.org/linux/man-pages/man2/setsockopt.2.html
    // https://man7.org/linux/man-pages/man7/socket.7.html
    // socket, level, optname, optvalue, optlen
-   if (setsockopt(create_socket,
+   if (setsockopt(listenSocket,
                   SOL_SOCKET,
                   SO_REUSEADDR,
                   &reuseValue,
                   sizeof(reuseValue)) == -1)
    {
-      perror("set socket options - reuseAddr");
-      return EXIT_FAILURE;
+      logErrno("set socket options - reuseAddr");
+      close(listenSocket);
+      return -1;
    }
 
-   if (setsockopt(create_socket,
+   if (setsockopt(listenSocket,
                   SOL_SOCKET,
                   SO_REUSEPORT,
                   &reuseValue,
                   sizeof(reuseValue)) == -1)
    {
-      perror("set socket options - reusePort");
-      return EXIT_FAILURE;
+      logErrno("set socket options - reusePort");
+      close(listenSocket);
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
@@ -134,601 +563,2407 @@ int main(void)
    memset(&address, 0, sizeof(address));
    address.sin_family = AF_INET;
    address.sin_addr.s_addr = INADDR_ANY;
-   address.sin_port = htons(PORT);
+   address.sin_port = htons(port);
 
    ////////////////////////////////////////////////////////////////////////////
    // ASSIGN AN ADDRESS WITH PORT TO SOCKET
-   if (bind(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1)
+   if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) == -1)
    {
-      perror("bind error");
-      return EXIT_FAILURE;
+      logErrno("bind error");
+      close(listenSocket);
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
    // ALLOW CONNECTION ESTABLISHING
    // Socket, Backlog (= count of waiting connections allowed)
-   if (listen(create_socket, 5) == -1)
+   if (listen(listenSocket, listenBacklog) == -1)
    {
-      perror("listen error");
-      return EXIT_FAILURE;
+      logErrno("listen error");
+      close(listenSocket);
+      return -1;
+   }
+
+   return listenSocket;
+}
+
+// Stream socket at path for clients on this machine. A socket file left behind by a server that is gone
+// is replaced, one that still accepts connections is an error. -1 on errors.
+int openUnixListener(const std::string &path)
+{
+   struct sockaddr_un address;
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (path.size() >= sizeof(address.sun_path))
+   {
+      logError("Unix socket path too long: {}", path);
+      return -1;
+   }
+   strcpy(address.sun_path, path.c_str());
+
+   int listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+   if (listenSocket == -1)
+   {
+      logErrno("Unix socket error");
+      return -1;
    }
 
-   // create directory for emails
-   const char *directoryName = "Emails";
    struct stat st;
-   if(stat(directoryName, &st) != 0)
+   if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
    {
-      mkdir(directoryName, 0700);
+      int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      bool inUse = probe != -1 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+      if (probe != -1)
+      {
+         close(probe);
+      }
+      if (inUse)
+      {
+         logError("{} is in use by another server", path);
+         close(listenSocket);
+         return -1;
+      }
+      unlink(path.c_str());
    }
 
-   std::ifstream blacklist(BLACKLIST);
-   if(!blacklist)
+   // any local user may connect, like over the loopback interface; peer credentials tell them apart
+   if (bind(listenSocket, (struct sockaddr *)&address, sizeof(address)) == -1 || chmod(path.c_str(), 0666) == -1 ||
+       listen(listenSocket, listenBacklog) == -1)
    {
-      std::ofstream outputFile(BLACKLIST);
+      logError("Unix socket {}: {}", path, LogErrno{errno});
+      close(listenSocket);
+      return -1;
    }
-   blacklist.close();
+   return listenSocket;
+}
 
-   ////////////////////////////////////////////////////////////////////////////
-    // Initialize Thread Pool
-    for (int i = 0; i < THREAD_POOL_SIZE; ++i)
-    {
-        threadPool.emplace_back(threadWorker);
-        availableThreads = THREAD_POOL_SIZE;
-    }
-    std::thread idleThreadManager(removeIdleThreads);
-   idleThreadManager.detach();
+// Accepts the connections the kernel hands to this shard's socket until the server shuts down.
+// The Unix socket has no SO_REUSEPORT: the first shard accepts on it and spreads its clients over all shards.
+void acceptLoop(Shard *shard)
+{
+   int unixSocket = shard->index == 0 ? unixListenSocket : -1;
+   size_t nextShard = 0;
+
+   pinShardThread(shard);
 
    while (serverRunning)
    {
       /////////////////////////////////////////////////////////////////////////
       // ignore errors here... because only information message
-      printf("Waiting for connections...\n");
+      logDebug("Waiting for connections...");
 
       /////////////////////////////////////////////////////////////////////////
       // ACCEPTS CONNECTION SETUP
-      // Blocking, might have an accept error on Ctrl+C (if SIGINT received)
-      addrlen = sizeof(struct sockaddr_in);
-      
-      // Use select or fcntl (non-blocking) to handle interrupt gracefully
-      new_socket = accept(create_socket, (struct sockaddr *)&cliaddress, &addrlen);
-      if (new_socket == -1)
-      {
-         if (serverRunning)
-         {
-               perror("accept error");
-         }
-         continue; // Skip and continue accepting connections
+      // Waits for a connection or stopAcceptingFd (SIGINT or handoff), poll() skips a negative unixSocket
+      struct pollfd waiting[3] = {{shard->listenSocket, POLLIN, 0}, {stopAcceptingFd, POLLIN, 0}, {unixSocket, POLLIN, 0}};
+      if (poll(waiting, 3, -1) == -1 && errno != EINTR)
+      {
+         logErrno("poll error");
+         break;
       }
-
-      /////////////////////////////////////////////////////////////////////////
-      // START CLIENT
-      printf("Client connected from %s:%d...\n",
-            inet_ntoa(cliaddress.sin_addr),
-            ntohs(cliaddress.sin_port));
-
-      // Add task to the queue
+      if (!serverRunning || waiting[1].revents != 0)
       {
-         printf("lock taskqueue\n");
-         std::lock_guard<std::mutex> lock(queueMutex);
-         printf("Client added to task list\n");
-         taskQueue.push(new_socket);
-         printf("unlock taskqueue\n");
-      } // lock_guard out of scope, unlocks
-
-      // Create more threads if necessary
-      if ((int)taskQueue.size() > availableThreads && activeThreads < MAX_THREAD_POOL_SIZE)
+         break;
+      }
+      if (waiting[0].revents != 0)
       {
-         std::lock_guard<std::mutex> lock(threadQueue);
-         int threadsToCreate = std::min(MAX_THREAD_POOL_SIZE - activeThreads, (int)taskQueue.size());
-
-         for (int i = 0; i < threadsToCreate; ++i)
-         {
-               threadPool.emplace_back(threadWorker);
-               ++availableThreads;  // Increment the available thread count
-               printf("1 new thread created\n");
-         }
+         acceptTcpClient(shard);
+      }
+      if (waiting[2].revents != 0)
+      {
+         acceptUnixClient(unixSocket, shards[nextShard++ % shards.size()].get());
+      }
+   }
+}
 
-         printf("Thread pool expanded: now %d active threads and %d available threads \n", activeThreads.load(), availableThreads.load());
+void acceptTcpClient(Shard *shard)
+{
+   struct sockaddr_in cliaddress;
+   socklen_t addrlen = sizeof(struct sockaddr_in);
+   int new_socket = accept4(shard->listenSocket, (struct sockaddr *)&cliaddress, &addrlen, SOCK_CLOEXEC);
+   if (new_socket == -1)
+   {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+      {
+            logErrno("accept error");
       }
+      return; // Skip and continue accepting connections
+   }
 
-      // Notify a worker thread to process the task
-      std::cout << "One thread worker will be notified" << std::endl;
-      condition.notify_one(); // Notify one worker thread
+   // Replies are coalesced per batch of commands and flushed at once, Nagle's algorithm would only hold
+   // back the reply to a pipelined batch until the previous one is acknowledged
+   int noDelay = 1;
+   if (setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) == -1)
+   {
+      logErrno("setsockopt TCP_NODELAY");
    }
 
-   // Cleanup
-   printf("Server is shutting down...\n");
-   close(create_socket);
-   serverRunning = false;  // Signal threads to shut down
-   condition.notify_all();  // Wake up all threads
+   /////////////////////////////////////////////////////////////////////////
+   // START CLIENT
+   logInfo("Client connected from {}:{} (shard {})...",
+            inet_ntoa(cliaddress.sin_addr),
+            ntohs(cliaddress.sin_port),
+            shard->index);
+   admitClient(shard, new_socket, inet_ntoa(cliaddress.sin_addr),
+               cliaddress.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+}
 
-   // Join all threads
-   for (std::thread &t : threadPool)
+// Clients on this machine: no TCP/IP stack, and the kernel tells who they are (SO_PEERCRED), so the user id
+// takes the place of the IP address
+void acceptUnixClient(int listener, Shard *shard)
+{
+   int new_socket = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+   if (new_socket == -1)
    {
-      if (t.joinable())
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
       {
-         t.join();
+         logErrno("accept error");
       }
+      return;
    }
 
-   printf("Server shut down.\n");
-   return EXIT_SUCCESS;
-}
-
-//====================================================================================================================
+   struct ucred credentials;
+   socklen_t length = sizeof(credentials);
+   if (getsockopt(new_socket, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1)
+   {
+      logErrno("getsockopt SO_PEERCRED");
+      close(new_socket);
+      return;
+   }
 
-void mutexDelayForTesting(string username)
-{
-   std::cout << "Thread ID: " << std::this_thread::get_id() << " is holding the mutex for " << username << std::endl;
-   std::this_thread::sleep_for(std::chrono::seconds(3)); // Delay for 3 seconds
+   logInfo("Client connected on {} (uid {}, pid {}, shard {})...", unixPath, credentials.uid, credentials.pid,
+           shard->index);
+   admitClient(shard, new_socket, "uid:" + to_string(credentials.uid),
+               credentials.uid == 0 || credentials.uid == geteuid());
 }
 
-void mutexUnlockedMessage(string username)
+// Queues a new connection for the workers of shard, or answers BUSY when admission control says so
+void admitClient(Shard *shard, int socket, std::string peer, bool local)
 {
-   std::cout << "Thread ID: " << std::this_thread::get_id() << " is releasing the mutex for " << username << std::endl;
+   if (!reserveConnection(peer))
+   {
+      rejectConnection(socket, 1, Rejection::PER_IP);
+      return;
+   }
+
+   // Add task to the queue
+   Rejection reason;
+   int retryAfter;
+   {
+      std::lock_guard<ProfiledMutex> lock(shard->queueMutex);
+      retryAfter = admissionDelay(*shard, reason);
+      if (retryAfter == 0)
+      {
+         logDebug("Client added to task list");
+         auto session = std::make_shared<Session>();
+         session->socket = socket;
+         session->shard = shard;
+         session->peer = peer;
+         session->local = local;
+         session->captureId = capture.isOpen() ? capture.newSession() : 0;
+         session->queuedAt = std::chrono::steady_clock::now();
+         shard->taskQueue.push_back(session);
+      }
+   } // lock_guard out of scope, unlocks
+   if (retryAfter != 0)
+   {
+      releaseConnection(peer);
+      rejectConnection(socket, retryAfter, reason);
+      return;
+   }
+   {
+      std::lock_guard<ProfiledMutex> lock(sessionsMutex);
+      openSessions.insert(socket);
+   }
+
+   // Create more threads if necessary
+   if ((int)shard->taskQueue.size() > shard->availableThreads && shard->activeThreads < maxThreads)
+   {
+      std::lock_guard<ProfiledMutex> lock(shard->threadQueue);
+      int threadsToCreate = std::min(maxThreads - shard->activeThreads, (int)shard->taskQueue.size());
+
+      for (int i = 0; i < threadsToCreate; ++i)
+      {
+            shard->threadPool.emplace_back(threadWorker, shard);
+            ++shard->availableThreads;  // Increment the available thread count
+            logDebug("1 new thread created");
+      }
+
+      logInfo("Thread pool of shard {} expanded: now {} active threads and {} available threads", shard->index,
+              shard->activeThreads.load(), shard->availableThreads.load());
+   }
+
+   // Notify a worker thread to process the task
+   logDebug("One thread worker will be notified");
+   shard->condition.notify_one(); // Notify one worker thread
 }
 
-void clientCommunication(void *data)
+// Queues a session woken up from IDLE for a worker of the shard that accepted it. first puts it
+// ahead of the waiting sessions, for one that already waited in a lane and holds a slot of it.
+void enqueueSession(std::shared_ptr<Session> session, bool first)
 {
-   char buffer[BUF];
-   int size;
-   int *current_socket = (int *)data;
-   bool logged_in = false;
-   const char* baseDirectory = "Emails";
+   Shard *shard = session->shard;
+   {
+      std::lock_guard<ProfiledMutex> lock(shard->queueMutex);
+      if (first)
+      {
+         session->queuedAt = session->deferredAt; // the queue wait span covers the lane wait
+         shard->taskQueue.push_front(session);
+      }
+      else
+      {
+         session->queuedAt = std::chrono::steady_clock::now();
+         shard->taskQueue.push_back(session);
+      }
+   }
+   shard->condition.notify_one();
+}
 
-   string username;
-   string password;
+//====================================================================================================================
 
-   ////////////////////////////////////////////////////////////////////////////
-   // SEND welcome message
-   strcpy(buffer, "Welcome to myserver!\r\nPlease enter your commands...\r\n");
-   respond(current_socket, buffer);
-   memset(buffer, 0, BUF);
+// Commands that may not run yet are not waited for in the worker: the session stops reading and
+// processing, its worker serves other sessions, and the session waits in the lane's queue of
+// its shard until a command of that lane finishes and hands it the slot.
 
-   do
+// false for session control, admin and unknown commands, they run at once
+bool laneOf(Opcode opcode, Lane &lane)
+{
+   switch (opcode)
    {
-      /////////////////////////////////////////////////////////////////////////
-      // RECEIVE
-      size = recv(*current_socket, buffer, BUF - 1, 0);
-      if (size == -1)
+   case Opcode::LOGIN:
+      lane = Lane::AUTH;
+      return true;
+   case Opcode::SEND:
+   case Opcode::DEL:
+   case Opcode::MDEL:
+      lane = Lane::WRITE;
+      return true;
+   case Opcode::LIST:
+   case Opcode::READ:
+   case Opcode::MREAD:
+   case Opcode::RESUME:
+      lane = Lane::READ;
+      return true;
+   default:
+      return false;
+   }
+}
+
+// Gives the free slots of lane to the sessions waiting longest and collects them in woken.
+// Caller holds shard.laneMutex.
+static void grantLane(Shard &shard, Lane lane, std::vector<std::shared_ptr<Session>> &woken)
+{
+   int limit = laneLimits[(int)lane];
+   std::deque<std::shared_ptr<Session>> &waiting = shard.laneWaiting[(int)lane];
+   while (!waiting.empty() && (limit == 0 || shard.laneActive[(int)lane] < limit))
+   {
+      shard.laneActive[(int)lane]++;
+      waiting.front()->laneGranted = true;
+      woken.push_back(std::move(waiting.front()));
+      waiting.pop_front();
+   }
+}
+
+// true if the command may run now, leaveLane() follows it. Otherwise the session is marked
+// deferred and the command has to stay unprocessed in inbuf.
+bool enterLane(Session &session, Opcode opcode)
+{
+   Lane lane;
+   if (!laneOf(opcode, lane))
+   {
+      return true;
+   }
+   auto now = std::chrono::steady_clock::now();
+   if (session.laneGranted)
+   {
+      session.laneGranted = false;
+      metrics.recordLaneWait(lane, std::chrono::duration_cast<std::chrono::nanoseconds>(now - session.deferredAt).count());
+      return true;
+   }
+
+   Shard &shard = *session.shard;
+   int limit = laneLimits[(int)lane];
+   std::lock_guard<ProfiledMutex> lock(shard.laneMutex);
+   // no overtaking of the sessions already waiting
+   if ((limit > 0 && shard.laneActive[(int)lane] >= limit) || !shard.laneWaiting[(int)lane].empty())
+   {
+      session.deferred = true;
+      session.deferredLane = lane;
+      session.deferredAt = now;
+      return false;
+   }
+   shard.laneActive[(int)lane]++;
+   return true;
+}
+
+void leaveLane(Session &session, Opcode opcode)
+{
+   Lane lane;
+   if (!laneOf(opcode, lane))
+   {
+      return;
+   }
+   Shard &shard = *session.shard;
+   std::vector<std::shared_ptr<Session>> woken;
+   {
+      std::lock_guard<ProfiledMutex> lock(shard.laneMutex);
+      shard.laneActive[(int)lane]--;
+      grantLane(shard, lane, woken);
+   }
+   for (std::shared_ptr<Session> &next : woken)
+   {
+      enqueueSession(std::move(next), true);
+   }
+}
+
+// Called by the worker once it is done with a deferred session. A slot may have become free in the
+// meantime, or the limit was raised with CONFIG, so the lane is granted again right away.
+void waitForLane(std::shared_ptr<Session> session)
+{
+   Shard &shard = *session->shard;
+   Lane lane = session->deferredLane;
+   std::vector<std::shared_ptr<Session>> woken;
+   {
+      std::lock_guard<ProfiledMutex> lock(shard.laneMutex);
+      shard.laneWaiting[(int)lane].push_back(std::move(session));
+      grantLane(shard, lane, woken);
+   }
+   for (std::shared_ptr<Session> &next : woken)
+   {
+      enqueueSession(std::move(next), true);
+   }
+}
+
+// Waits for a new process to connect to --handoff, gives it the listening sockets and stops accepting
+void handoffServer(int listener)
+{
+   while (serverRunning)
+   {
+      struct pollfd waiting[2] = {{listener, POLLIN, 0}, {stopAcceptingFd, POLLIN, 0}};
+      if (poll(waiting, 2, -1) <= 0 || waiting[1].revents != 0)
+      {
+         continue;
+      }
+      int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (connection == -1)
+      {
+         continue;
+      }
+
+      // the new process binds its own handoff socket to the same path once it has the listeners
+      unlink(handoffPath.c_str());
+      std::vector<int> sockets;
+      for (auto &shard : shards)
+      {
+         sockets.push_back(shard->listenSocket);
+      }
+      if (unixListenSocket != -1)
       {
-         if (abortRequested)
+         sockets.push_back(unixListenSocket);
+      }
+      draining = true;
+      bool sent = sendListeners(connection, sockets);
+      close(connection);
+      if (!sent)
+      {
+         draining = false;
+         close(listener);
+         listener = openHandoffListener(handoffPath);
+         if (listener == -1)
          {
-            perror("recv error after aborted");
+            return;
          }
-         else
+         continue;
+      }
+
+      logInfo("listening sockets handed off, draining sessions for up to {} seconds", drainSeconds.load());
+      uint64_t stop = 1;
+      if (write(stopAcceptingFd, &stop, sizeof(stop)) == -1)
+      {
+         logErrno("eventfd write");
+      }
+      break;
+   }
+   close(listener);
+}
+
+// Waits until every session has ended after its last reply, cuts off the rest after --drain-seconds
+void drainSessions()
+{
+   auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(drainSeconds.load());
+   while (std::chrono::steady_clock::now() < deadline && !abortRequested)
+   {
+      {
+         std::lock_guard<ProfiledMutex> lock(sessionsMutex);
+         if (openSessions.empty())
          {
-            perror("recv error");
+            logInfo("all sessions drained");
+            return;
          }
-         break;
       }
-      if (size == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+   }
+
+   // silent clients and IDLE sessions: the workers see the end of the stream and clean up
+   std::lock_guard<ProfiledMutex> lock(sessionsMutex);
+   logInfo("drain deadline reached, closing {} session(s)", openSessions.size());
+   for (int socket : openSessions)
+   {
+      shutdown(socket, SHUT_RDWR);
+   }
+}
+
+void forgetSession(int socket)
+{
+   std::lock_guard<ProfiledMutex> lock(sessionsMutex);
+   openSessions.erase(socket);
+}
+
+// Every session ends here, with or without a worker, so its connection slot and capture are released
+void closeSession(Session &session)
+{
+   endIdle(session);
+   releaseConnection(session.peer);
+   forgetSession(session.socket);
+   if (session.captureId != 0)
+   {
+      capture.endSession(session.captureId);
+   }
+   if (shutdown(session.socket, SHUT_RDWR) == -1 && errno != ENOTCONN) // already shut down by drainSessions()
+   {
+      logErrno("shutdown new_socket");
+   }
+   if (close(session.socket) == -1)
+   {
+      logErrno("close new_socket");
+   }
+   session.socket = -1;
+   logDebug("Server closed socket");
+}
+
+// At shutdown: sessions still waiting for a worker or a lane slot, none of them is touched by a worker
+void closeQueuedSessions(Shard &shard)
+{
+   std::vector<std::shared_ptr<Session>> queued;
+   {
+      std::lock_guard<ProfiledMutex> lock(shard.queueMutex);
+      queued.assign(shard.taskQueue.begin(), shard.taskQueue.end());
+      shard.taskQueue.clear();
+   }
+   {
+      std::lock_guard<ProfiledMutex> lock(shard.laneMutex);
+      for (auto &waiting : shard.laneWaiting)
       {
-         printf("Client closed remote socket\n"); // ignore error
-         break;
+         queued.insert(queued.end(), waiting.begin(), waiting.end());
+         waiting.clear();
       }
+   }
+   for (auto &session : queued)
+   {
+      closeSession(*session);
+   }
+}
 
-         // Null-terminate the buffer to make it a valid C-string
-      buffer[size] = '\0';
+// --numa: shard i runs on all CPUs of node i, --pin-shards: on the i-th CPU (of its node with --numa),
+// --cpus alone: anywhere in that list. Both the acceptor and the workers follow the shard.
+void placeShard(Shard &shard, const std::vector<int> &cpus, const std::vector<NumaNode> &nodes)
+{
+   if (numaPlacement && !nodes.empty())
+   {
+      const NumaNode &node = nodes[shard.index % nodes.size()];
+      shard.cpus = node.cpus;
+      if (pinShards)
+      {
+         shard.cpus = {node.cpus[shard.index / nodes.size() % node.cpus.size()]};
+      }
+   }
+   else if (pinShards && !cpus.empty())
+   {
+      shard.cpus = {cpus[shard.index % cpus.size()]};
+   }
+   else if (!cpuList.empty())
+   {
+      shard.cpus = cpuList;
+   }
 
-      // Convert buffer to a std::string
-      std::string input(buffer);
+   for (const NumaNode &node : nodes)
+   {
+      if (!shard.cpus.empty() && std::find(node.cpus.begin(), node.cpus.end(), shard.cpus[0]) != node.cpus.end())
+      {
+         shard.node = node.id;
+      }
+   }
+}
 
-      std::istringstream stream(input);
-      std::string firstLine;
-      std::getline(stream, firstLine); // Extracts the first line from the input
+void pinShardThread(Shard *shard)
+{
+   if (shard->cpus.empty())
+   {
+      return;
+   }
+   int rc = pinThread(shard->cpus);
+   if (rc != 0)
+   {
+      logError("could not pin thread to CPUs {}: {}", formatCpuList(shard->cpus), LogErrno{rc});
+   }
+}
 
-      // Handle the command
-      if(firstLine == "LOGIN") 
+// "placement:shard<i> node=<n> cpus=<list> ran_on=<list>", ran_on are the CPUs sessions were actually served on
+std::vector<std::string> placementReport()
+{
+   std::vector<std::string> lines;
+   for (auto &shard : shards)
+   {
+      std::vector<int> ranOn;
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
       {
-         logged_in = login(current_socket, username, std::string(baseDirectory), stream);
+         if (shard->ranOn[cpu / 64] & (1ULL << (cpu % 64)))
+         {
+            ranOn.push_back(cpu);
+         }
       }
+      lines.push_back("placement:shard" + std::to_string(shard->index) + " node=" +
+                      (shard->node >= 0 ? std::to_string(shard->node) : "any") + " cpus=" +
+                      (shard->cpus.empty() ? "any" : formatCpuList(shard->cpus)) + " ran_on=" + formatCpuList(ranOn));
+   }
+   return lines;
+}
+
+//====================================================================================================================
 
-      else if(firstLine == "QUIT")
+// -1 unknown name, 0 invalid value, 1 applied
+// new values take effect with the next connection, pool resize or recv; a new backlog right away
+int setTunable(const std::string &name, const std::string &value)
+{
+   if (name == "log-level")
+   {
+      return setLogLevel(value) ? 1 : 0;
+   }
+   for (const auto &tunable : tunables)
+   {
+      if (name != tunable.name)
       {
-            shutdown(*current_socket, SHUT_RDWR);
-            close(*current_socket);
-            *current_socket = -1;
-            printf("Server closed socket\n");
-            return; // Exit the function after handling QUIT
+         continue;
       }
-      
-      else if(!logged_in)
+      if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != std::string::npos)
       {
-         respond(current_socket, "ERR\n");
+         return 0;
       }
-
-      else if(firstLine == "SEND")
+      int number = std::stoi(value);
+      if (number < tunable.minimum || number > tunable.maximum)
       {
-         emailSend(current_socket, username, baseDirectory, stream);
+         return 0;
       }
-      else
+      if ((tunable.value == &minThreads && number > maxThreads) ||
+          (tunable.value == &maxThreads && number < minThreads))
       {
-          //create a mutex for this folder, if it does not exist
-         individualEmailLocks.try_emplace(username, std::make_unique<std::mutex>());
-         std::lock_guard<std::mutex> lock(*individualEmailLocks[username]);
-         #ifdef ENABLE_MUTEX_TESTING
-         mutexDelayForTesting(username);
-         #endif
-         
-         if(firstLine == "LIST")
-         {
-            list(current_socket, username, baseDirectory);
-         }
-         else if(firstLine == "READ")
+         return 0;
+      }
+      *tunable.value = number;
+
+      if (tunable.value == &listenBacklog)
+      {
+         for (auto &shard : shards)
          {
-            read(current_socket, username, baseDirectory, stream);
+            if (listen(shard->listenSocket, number) == -1)
+            {
+               logErrno("listen");
+            }
          }
-         else if(firstLine == "DEL")
+         if (unixListenSocket != -1 && listen(unixListenSocket, number) == -1)
          {
-            del(current_socket, username, baseDirectory, stream);
+            logErrno("listen");
          }
-         else
+      }
+      else if (tunable.value == &minThreads)
+      {
+         // workers above the new minimum leave once idle
+         for (auto &shard : shards)
          {
-            respond(current_socket, "ERR\n");
+            shard->condition.notify_all();
          }
-         #ifdef ENABLE_MUTEX_TESTING
-         mutexUnlockedMessage(username);
-         #endif
       }
-      
-
-      memset(buffer, 0, BUF);
+      logInfo("{} set to {}", name, number);
+      return 1;
    }
-   while (!abortRequested);
+   return -1;
+}
 
-   // closes/frees the descriptor if not already
-   if (*current_socket != -1)
+std::vector<std::string> tunableValues()
+{
+   std::vector<std::string> lines;
+   for (const auto &tunable : tunables)
    {
-      if (shutdown(*current_socket, SHUT_RDWR) == -1)
-      {
-         perror("shutdown new_socket");
-      }
-      if (close(*current_socket) == -1)
-      {
-         perror("close new_socket");
-      }
-      *current_socket = -1;
+      lines.push_back(std::string(tunable.name) + "=" + std::to_string(tunable.value->load()));
    }
-
-   availableThreads++;
-   activeThreads--;
+   lines.push_back(std::string("log-level=") + logLevelName());
+   return lines;
 }
 
 //====================================================================================================================
 
-void createDirIfNotCreated(string username, string baseDirectory)
+void mutexDelayForTesting(string username)
 {
-   string path = baseDirectory + "/" + username;
-   
-   std::lock_guard<std::mutex> lock(directoryMutex);  // Lock the mutex
-   #ifdef ENABLE_MUTEX_TESTING
-   mutexDelayForTesting("whole email directory");
-   #endif
+   logInfo("holding the mutex for {}", username);
+   std::this_thread::sleep_for(std::chrono::seconds(3)); // Delay for 3 seconds
+}
+
+void mutexUnlockedMessage(string username)
+{
+   logInfo("releasing the mutex for {}", username);
+}
+
+void clientCommunication(std::shared_ptr<Session> session)
+{
+   // one receive buffer per worker: allocated and first touched by the pinned worker, its pages come from
+   // the worker's NUMA node and stay there for every session it serves
+   static thread_local std::vector<char> buffer;
+   if (buffer.size() != (size_t)recvBufferSize)
+   {
+      buffer.assign(recvBufferSize, 0);
+   }
+   int size;
+   bool keepOpen = true;
+
+   int cpu = sched_getcpu();
+   if (cpu >= 0 && cpu < CPU_SETSIZE)
+   {
+      session->shard->ranOn[cpu / 64] |= 1ULL << (cpu % 64);
+   }
+
+   session->dequeuedAt = std::chrono::steady_clock::now();
+   session->queueWaitPending = true;
+
+   ////////////////////////////////////////////////////////////////////////////
+   // SEND welcome message
+   if (!session->welcomed)
+   {
+      keepOpen = sendToSession(*session, "Welcome to myserver!\r\nPlease enter your commands...\r\n");
+      session->welcomed = true;
+   }
 
-   DIR *dir = opendir(path.c_str());
-   if(dir == NULL)
+   do
    {
-      try
+      /////////////////////////////////////////////////////////////////////////
+      // RECEIVE
+      // back from a lane queue, the command that waited is still the first one in inbuf
+      if (!session->deferred)
       {
-         if (fs::create_directory(path))
+         size = recv(session->socket, buffer.data(), buffer.size(), 0);
+         if (size == -1)
          {
-            std::cout << "Directory created: " << path << std::endl;
-            
+            if (abortRequested)
+            {
+               logErrno("recv error after aborted");
+            }
+            else
+            {
+               logErrno("recv error");
+            }
+            keepOpen = false;
+            break;
          }
-         else
+         if (size == 0)
+         {
+            logInfo("Client closed remote socket"); // ignore error
+            keepOpen = false;
+            break;
+         }
+
+         // Commands may arrive split over several recv calls or several in one, so collect them first
+         metrics.addBytesIn(size);
+         session->inbuf.append(buffer.data(), size);
+         if (!session->v2 && session->inbuf.back() == '\n')
          {
-            std::cout << "Directory already exists or failed to create." << std::endl;
+            session->legacyFraming = false;
          }
       }
-      catch (const fs::filesystem_error &e)
+      session->deferred = false;
+
+      int pending = 0;
+      bool paused = ioctl(session->socket, FIONREAD, &pending) == 0 && pending == 0;
+      keepOpen = session->v2 ? processFrames(*session) : processTextCommands(*session, paused);
+
+      // the session waits for new mail without holding this worker
+      if (keepOpen && session->idle)
+      {
+         parkSession(session);
+         break;
+      }
+
+      // its next command waits for a lane, queued below once this worker is done with the session
+      if (keepOpen && session->deferred)
+      {
+         break;
+      }
+
+      // handed off: the client gets its replies, then reconnects to the new process
+      if (draining && session->inbuf.empty())
       {
-         std::cerr << "Error: " << e.what() << std::endl;
+         keepOpen = false;
+         break;
       }
    }
-   else
+   while (keepOpen && !abortRequested);
+
+   // closes/frees the descriptor if not already
+   if (!keepOpen || abortRequested)
    {
-      closedir(dir); // Don't forget to close the directory if it exists
+      closeSession(*session);
+   }
+
+   session->shard->availableThreads++;
+   session->shard->activeThreads--;
+   if (keepOpen && !abortRequested && session->deferred)
+   {
+      waitForLane(session);
    }
-   //create a mutex for this folder, if it does not exist
-   individualEmailLocks.try_emplace(username, std::make_unique<std::mutex>());
-   #ifdef ENABLE_MUTEX_TESTING
-   mutexUnlockedMessage("whole email directory");
-   #endif
 }
 
 //====================================================================================================================
 
-bool login(int *current_socket, std::string &username, std::string baseDirectory, std::istringstream &stream)
+// Length of the first complete text command in buffer, 0 while lines are still missing.
+// resume remembers how far an unfinished SEND was searched for its "." line, so a long message
+// arriving in many pieces is scanned once instead of once per piece; 0 for a new command.
+size_t textCommandLength(std::string_view buffer, size_t &resume)
 {
-   bool logged_in = false;
-   string password;
+   size_t end = buffer.find('\n');
+   if (end == string::npos)
+   {
+      return 0;
+   }
 
-    if (!std::getline(stream, username) || !std::getline(stream, password))
-    {
-        respond(current_socket, "ERR\n"); // Missing username or password
-        return logged_in;
-    }
+   Opcode opcode = opcodeFromName(buffer.substr(0, end));
+   int argumentLines = 0;
+   if (opcode == Opcode::LOGIN || opcode == Opcode::SEND)
+   {
+      argumentLines = 2;
+   }
+   else if (opcode == Opcode::READ || opcode == Opcode::DEL || opcode == Opcode::MREAD || opcode == Opcode::MDEL ||
+            opcode == Opcode::CONFIG || opcode == Opcode::RESUME)
+   {
+      argumentLines = 1;
+   }
 
-    std::string client_ip = getClientIPAddress(current_socket);
-    if (client_ip.empty())
-    {
-        respond(current_socket, "ERR\n");
-        return false;
-    }
+   for (int i = 0; i < argumentLines; i++)
+   {
+      end = buffer.find('\n', end + 1);
+      if (end == string::npos)
+      {
+         return 0;
+      }
+   }
 
-   if(login_attempts[client_ip] > 2)
+   // SEND continues up to the line containing only '.', the '\n' ending the subject may start it
+   if (opcode == Opcode::SEND)
    {
-        std::unique_lock<std::mutex> lock(blacklistMutex);
-        std::ofstream blacklist(BLACKLIST, std::ios::app);
-        blacklist << client_ip + "\n";
-        std::cout << "IP " << client_ip << " added to blacklist" << std::endl;
-        login_attempts.erase(client_ip);
-        blacklist.close();
+      size_t terminator = buffer.find("\n.\n", std::max(end, resume));
+      if (terminator == string::npos)
+      {
+         resume = std::max(end, buffer.size() - 2);
+         return 0;
+      }
+      end = terminator + 2;
+   }
+   return end + 1;
+}
+
+//====================================================================================================================
+
+// Runs every complete text command in the session buffer in order and sends all replies at once.
+// Returns false once the session has to end.
+bool processTextCommands(Session &session, bool paused)
+{
+   std::vector<std::unique_ptr<RequestTrace>> traces;
+   size_t consumed = 0; // commands before this offset have run, removed from inbuf once at the end
+   size_t length;
+   bool keepOpen = true;
+
+   while (!session.v2)
+   {
+      std::string_view pending = std::string_view(session.inbuf).substr(consumed);
+      length = textCommandLength(pending, session.scanResume);
+
+      // The interactive client of the first hand-in sends its last line without a newline.
+      // As long as no command ended in '\n' and the client paused, terminate that line for it.
+      if (length == 0 && paused && session.legacyFraming && !pending.empty() && pending.back() != '\n')
+      {
+         session.inbuf.push_back('\n');
+         pending = std::string_view(session.inbuf).substr(consumed);
+         length = textCommandLength(pending, session.scanResume);
+      }
+      if (length == 0)
+      {
+         break;
+      }
+
+      TracePoint parseStart;
+      if (tracer.isOpen())
+      {
+         parseStart = std::chrono::steady_clock::now();
+      }
+      uint64_t allocationsBefore = allocationCount();
+      std::string_view command = pending.substr(0, length);
+      consumed += length;
+      session.scanResume = 0;
+
+      // complete commands end in '\n', the arguments are the lines after the first one
+      size_t firstLineEnd = command.find('\n');
+      std::string_view firstLine = command.substr(0, firstLineEnd);
+      std::string_view arguments = command.substr(firstLineEnd + 1);
+
+      // Switch this session to the binary protocol, anything after the hello is already framed
+      if (firstLine == V2_HELLO)
+      {
+         std::lock_guard<ProfiledMutex> lock(session.writeMutex);
+         session.output.append("OK\n");
+         session.v2 = true;
+         break;
+      }
+
+      // Handle the command
+      Opcode opcode = opcodeFromName(firstLine);
+      if (opcode == Opcode::QUIT)
+      {
+         keepOpen = false;
+         break;
+      }
+
+      // DONE ends IDLE, any other command ends it as well before it runs
+      if (session.idle && opcode != Opcode::IDLE)
+      {
+         endIdle(session);
+         if (opcode == Opcode::DONE)
+         {
+            std::lock_guard<ProfiledMutex> lock(session.writeMutex);
+            session.output.append("OK\n");
+            continue;
+         }
+      }
+
+      // the command and everything after it stay in inbuf until the lane has room
+      if (!enterLane(session, opcode))
+      {
+         consumed -= length;
+         break;
+      }
+
+      Reply reply;
+      std::unique_ptr<RequestTrace> trace = tracer.isOpen() ? beginTrace(session, parseStart) : nullptr;
+      if (opcode == Opcode::NONE)
+      {
+         reply.status = Status::ERR_UNKNOWN_COMMAND;
+      }
+      else if (opcode == Opcode::IDLE)
+      {
+         reply = startIdle(session, 0);
+      }
+      else if (!parseTextArguments(opcode, arguments, session.args))
+      {
+         reply.status = Status::ERR_BAD_REQUEST;
+      }
+      else
+      {
+         traceSpan("parse", parseStart, std::chrono::steady_clock::now());
+         reply = execute(session, opcode, session.args);
+      }
+      leaveLane(session, opcode);
+      {
+         std::lock_guard<ProfiledMutex> lock(session.writeMutex);
+         formatTextReply(opcode, reply, session.output);
+      }
+      metrics.recordAllocations(opcode, allocationCount() - allocationsBefore);
+      commandArena.reset();
+      if (trace != nullptr)
+      {
+         activeTrace = nullptr;
+         trace->command = opcodeName(opcode);
+         trace->status = statusName(reply.status);
+         traces.push_back(std::move(trace));
+      }
+   }
+   session.inbuf.erase(0, consumed);
+
+   // a batch without replies still sends notifications that could not be sent while the client was not reading
+   TracePoint sendStart = std::chrono::steady_clock::now();
+   keepOpen = sendToSession(session) && keepOpen;
+   finishTraces(traces, sendStart);
+
+   if (keepOpen && session.inbuf.size() > MAX_PENDING_INPUT)
+   {
+      sendToSession(session, "ERR\n");
+      keepOpen = false;
+   }
+   if (keepOpen && session.v2)
+   {
+      return processFrames(session);
+   }
+   return keepOpen;
+}
+
+//====================================================================================================================
+
+// Cuts the next line off text, false if there is no complete line left
+static bool takeLine(std::string_view &text, std::string_view &line)
+{
+   size_t end = text.find('\n');
+   if (end == string::npos)
+   {
+      return false;
+   }
+   line = text.substr(0, end);
+   text.remove_prefix(end + 1);
+   return true;
+}
+
+// Splits the argument lines of a text command (everything after its first line) into args, which
+// point into text. The message of SEND is everything up to a line containing only '.', with a
+// leading '\n' as the server always stored it.
+bool parseTextArguments(Opcode opcode, std::string_view text, std::vector<std::string_view> &args)
+{
+   std::string_view line;
+   args.clear();
+   switch (opcode)
+   {
+   case Opcode::LOGIN:
+      for (int i = 0; i < 2; i++)
+      {
+         if (!takeLine(text, line))
+         {
+            return false;
+         }
+         args.push_back(line);
+      }
+      return true;
+
+   case Opcode::SEND:
+   {
+      size_t subjectEnd = text.find('\n');
+      subjectEnd = subjectEnd == string::npos ? subjectEnd : text.find('\n', subjectEnd + 1);
+      if (subjectEnd == string::npos)
+      {
+         return false;
+      }
+      for (int i = 0; i < 2; i++)
+      {
+         takeLine(text, line);
+         args.push_back(line);
+      }
+
+      // text now starts after the subject line, whose '\n' is the first character of the message
+      std::string_view message(text.data() - 1, text.size() + 1);
+      size_t terminator = message.find("\n.\n");
+      if (terminator == string::npos)
+      {
+         return false;
+      }
+      logDebug("End of message received.");
+      args.push_back(message.substr(0, terminator));
+      return true;
+   }
+
+   case Opcode::READ:
+   case Opcode::DEL:
+   case Opcode::MREAD:
+   case Opcode::MDEL:
+   case Opcode::CONFIG:
+   case Opcode::RESUME:
+      if (!takeLine(text, line))
+      {
+         return false;
+      }
+      args.push_back(line);
+      return true;
+
+   default:
+      return true;
+   }
+}
+
+//====================================================================================================================
+
+// Appends the text protocol form of reply to out
+// Message bodies are moved into out as chunks of their own, reply is left without them
+void formatTextReply(Opcode opcode, Reply &reply, OutputBuffer &out)
+{
+   if (reply.status != Status::OK)
+   {
+      out.append("ERR\n");
+   }
+   else if (opcode == Opcode::LIST)
+   {
+      out.tail().append("Number of emails: ").append(to_string(reply.fields.size())).append("\n");
+      for (size_t i = 0; i < reply.fields.size(); i++)
+      {
+         out.tail().append(to_string(i + 1)).append(": ").append(reply.fields[i]).append("\n");
+      }
+   }
+   else if (opcode == Opcode::READ && reply.fields.size() == 3)
+   {
+      out.tail().append("Sender: ").append(reply.fields[0]).append("\nSubject: ").append(reply.fields[1]);
+      out.tail().append("\nMessage: ");
+      out.take(std::move(reply.fields[2]));
+   }
+   else if (opcode == Opcode::STATS || opcode == Opcode::CONFIG)
+   {
+      for (const string &line : reply.fields)
+      {
+         out.tail().append(line).append("\n");
+      }
+      out.append(".\n");
+   }
+   // every message ends with a line containing only '.', like the message of SEND
+   else if (opcode == Opcode::MREAD)
+   {
+      out.tail().append("Number of emails: ").append(to_string(reply.fields.size() / 4)).append("\n");
+      for (size_t i = 0; i + 3 < reply.fields.size(); i += 4)
+      {
+         out.tail().append("Message-Number: ").append(reply.fields[i]).append("\nSender: ").append(reply.fields[i + 1]);
+         out.tail().append("\nSubject: ").append(reply.fields[i + 2]).append("\nMessage: ");
+         out.take(std::move(reply.fields[i + 3]));
+         out.append("\n.\n");
+      }
+   }
+   else
+   {
+      out.append("OK\n");
+   }
+}
+
+//====================================================================================================================
+
+// Handles every complete frame in the session buffer and sends all replies at once.
+// Returns false once the session has to end.
+bool processFrames(Session &session)
+{
+   FrameView &request = session.frame;
+   std::vector<std::unique_ptr<RequestTrace>> traces;
+   TracePoint parseStart;
+   size_t consumed = 0; // frames before this offset have run, removed from inbuf once at the end
+   size_t length;
+   int rc;
+
+   while (true)
+   {
+      if (tracer.isOpen())
+      {
+         parseStart = std::chrono::steady_clock::now();
+      }
+      uint64_t allocationsBefore = allocationCount();
+      if ((rc = decodeFrame(std::string_view(session.inbuf).substr(consumed), request, length)) != 1)
+      {
+         break;
+      }
+      consumed += length;
+
+      Opcode opcode = (Opcode)request.code;
+      if (session.idle && opcode != Opcode::IDLE)
+      {
+         endIdle(session);
+      }
+      // the frame and everything after it stay in inbuf until the lane has room
+      if (!enterLane(session, opcode))
+      {
+         consumed -= length;
+         break;
+      }
+
+      Reply reply;
+      std::unique_ptr<RequestTrace> trace = tracer.isOpen() ? beginTrace(session, parseStart) : nullptr;
+      traceSpan("parse", parseStart, std::chrono::steady_clock::now());
+
+      if (opcode == Opcode::IDLE)
+      {
+         reply = startIdle(session, request.requestId);
+      }
+      else if (opcode != Opcode::QUIT && opcode != Opcode::DONE)
+      {
+         reply = execute(session, opcode, request.fields);
+      }
+      leaveLane(session, opcode);
+
+      Frame response;
+      response.code = (uint8_t)reply.status;
+      response.requestId = request.requestId;
+      ProfiledLock lock(session.writeMutex);
+      if (opcode == Opcode::MREAD && reply.status == Status::OK)
+      {
+         // one frame per message, then the count
+         for (size_t i = 0; i + 3 < reply.fields.size(); i += 4)
+         {
+            response.fields.assign(std::make_move_iterator(reply.fields.begin() + i),
+                                   std::make_move_iterator(reply.fields.begin() + i + 4));
+            encodeFrame(response, session.output.tail());
+         }
+         response.fields = {to_string(reply.fields.size() / 4)};
+      }
+      else
+      {
+         response.fields = std::move(reply.fields);
+      }
+      encodeFrame(response, session.output.tail());
+      lock.unlock();
+      metrics.recordAllocations(opcode, allocationCount() - allocationsBefore);
+      commandArena.reset();
+      if (trace != nullptr)
+      {
+         activeTrace = nullptr;
+         trace->command = opcodeName(opcode);
+         trace->status = statusName(reply.status);
+         traces.push_back(std::move(trace));
+      }
+
+      if (opcode == Opcode::QUIT)
+      {
+         TracePoint sendStart = std::chrono::steady_clock::now();
+         sendToSession(session);
+         finishTraces(traces, sendStart);
+         return false;
+      }
+   }
+   session.inbuf.erase(0, consumed);
+
+   if (rc == -1)
+   {
+      Frame response;
+      response.code = (uint8_t)Status::ERR_BAD_REQUEST;
+      std::lock_guard<ProfiledMutex> lock(session.writeMutex);
+      encodeFrame(response, session.output.tail());
+   }
+   TracePoint sendStart = std::chrono::steady_clock::now();
+   bool sent = sendToSession(session);
+   finishTraces(traces, sendStart);
+   return sent && rc != -1;
+}
+
+//====================================================================================================================
+
+// Starts the trace of one request if it is sampled and makes it the active trace of this thread.
+// The time the session waited for a worker belongs to the first request after it was picked up.
+std::unique_ptr<RequestTrace> beginTrace(Session &session, TracePoint start)
+{
+   std::unique_ptr<RequestTrace> trace = tracer.begin(session.socket, start);
+   if (trace != nullptr && session.queueWaitPending)
+   {
+      trace->spans.push_back({"queue wait", session.queuedAt, session.dequeuedAt});
+   }
+   session.queueWaitPending = false;
+   activeTrace = trace.get();
+   return trace;
+}
+
+// Replies of a batch go out together, so every request of it gets the same send span
+void finishTraces(std::vector<std::unique_ptr<RequestTrace>> &traces, TracePoint sendStart)
+{
+   TracePoint sendEnd = std::chrono::steady_clock::now();
+   for (std::unique_ptr<RequestTrace> &trace : traces)
+   {
+      trace->spans.push_back({"send", sendStart, sendEnd});
+      tracer.finish(std::move(trace));
+   }
+   traces.clear();
+}
+
+//====================================================================================================================
+
+// Runs one command, records its latency and, with --capture, the command itself
+Reply execute(Session &session, Opcode opcode, const std::vector<std::string_view> &args)
+{
+   uint64_t perfBefore[PERF_COUNTERS];
+   bool counting = readPerfCounters(perfBefore);
+   auto start = std::chrono::steady_clock::now();
+   Reply reply = dispatch(session, opcode, args);
+   auto end = std::chrono::steady_clock::now();
+   metrics.recordCommand(opcode, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                         reply.status != Status::OK);
+
+   uint64_t perfAfter[PERF_COUNTERS];
+   if (counting && readPerfCounters(perfAfter))
+   {
+      for (int i = 0; i < PERF_COUNTERS; i++)
+      {
+         perfAfter[i] -= perfBefore[i];
+      }
+      metrics.recordPerf(opcode, perfAfter);
+   }
+   if (session.captureId == 0)
+   {
+      return reply;
+   }
+
+   CaptureRecord record;
+   record.session = session.captureId;
+   record.opcode = opcode;
+   record.offsetMicros = std::chrono::duration_cast<std::chrono::microseconds>(start - capture.started()).count();
+   record.serviceMicros = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+   record.status = reply.status;
+   record.args.assign(args.begin(), args.end());
+   capture.record(std::move(record));
+   return reply;
+}
+
+Reply dispatch(Session &session, Opcode opcode, const std::vector<std::string_view> &args)
+{
+   std::string_view baseDirectory = mailRoot;
+   Reply reply;
+
+   // v2 LOGIN may ask for a session ticket with a third field
+   if (opcode == Opcode::LOGIN)
+   {
+      if ((args.size() != 2 && args.size() != 3) || !isMailboxName(args[0]))
+      {
+         reply.status = Status::ERR_BAD_REQUEST;
+         return reply;
+      }
+      reply = login(session.peer, std::string(args[0]), std::string(args[1]), baseDirectory);
+      session.username = args[0];
+      session.logged_in = reply.status == Status::OK;
+      int lifetime = ticketLifetime;
+      if (session.logged_in && args.size() == 3 && !args[2].empty() && lifetime > 0)
+      {
+         reply.fields.push_back(tickets.issue(session.username, (int64_t)time(nullptr) + lifetime));
+      }
+      return reply;
+   }
+
+   if (opcode == Opcode::RESUME)
+   {
+      if (args.size() != 1)
+      {
+         reply.status = Status::ERR_BAD_REQUEST;
+         return reply;
+      }
+      reply = resume(session.peer, args[0], session.username, baseDirectory);
+      session.logged_in = reply.status == Status::OK;
+      return reply;
+   }
+
+   // admin command, no mailbox needed but only from this machine
+   if (opcode == Opcode::STATS)
+   {
+      if (!session.local)
+      {
+         reply.status = Status::ERR_FORBIDDEN;
+         return reply;
+      }
+      reply.fields = metrics.summary(currentGauges());
+      for (std::string &line : lockProfile())
+      {
+         reply.fields.push_back(std::move(line));
+      }
+      for (std::string &line : placementReport())
+      {
+         reply.fields.push_back(std::move(line));
+      }
+      return reply;
+   }
+
+   // admin command: "name=value" changes a tunable, every call lists the current values
+   if (opcode == Opcode::CONFIG)
+   {
+      if (!session.local)
+      {
+         reply.status = Status::ERR_FORBIDDEN;
+         return reply;
+      }
+      if (args.size() != 1)
+      {
+         reply.status = Status::ERR_BAD_REQUEST;
+         return reply;
+      }
+      size_t equals = args[0].find('=');
+      if (!args[0].empty() && (equals == std::string::npos ||
+                               setTunable(std::string(args[0].substr(0, equals)), std::string(args[0].substr(equals + 1))) != 1))
+      {
+         reply.status = Status::ERR_BAD_REQUEST;
+         return reply;
+      }
+      reply.fields = tunableValues();
+      return reply;
+   }
+
+   if (!session.logged_in)
+   {
+      reply.status = Status::ERR_NOT_LOGGED_IN;
+      return reply;
+   }
+
+   if (opcode == Opcode::SEND)
+   {
+      if (args.size() != 3)
+      {
+         reply.status = Status::ERR_BAD_REQUEST;
+         return reply;
+      }
+      return emailSend(session.username, baseDirectory, args[0], args[1], args[2]);
+   }
+
+   if (opcode != Opcode::LIST && opcode != Opcode::READ && opcode != Opcode::DEL &&
+       opcode != Opcode::MREAD && opcode != Opcode::MDEL)
+   {
+      reply.status = Status::ERR_UNKNOWN_COMMAND;
+      return reply;
+   }
+
+   int msnr = 0;
+   std::vector<int> numbers;
+   std::vector<string> ids;
+   if ((opcode == Opcode::READ || opcode == Opcode::DEL) && (args.size() != 1 || !parseMessageNumber(args[0], msnr)))
+   {
+      reply.status = Status::ERR_BAD_REQUEST;
+      return reply;
+   }
+   if ((opcode == Opcode::MREAD || opcode == Opcode::MDEL) && (args.size() != 1 || !parseMessageSelection(args[0], numbers, ids)))
+   {
+      reply.status = Status::ERR_BAD_REQUEST;
+      return reply;
+   }
+
+   ProfiledLock lock = lockMeasured(mailboxMutex(session.username), "mailbox lock");
+   #ifdef ENABLE_MUTEX_TESTING
+   mutexDelayForTesting(session.username);
+   #endif
+
+   if (opcode == Opcode::LIST)
+   {
+      reply = list(session.username, baseDirectory);
+   }
+   else if (opcode == Opcode::READ)
+   {
+      reply = read(session.username, baseDirectory, msnr);
+   }
+   else if (opcode == Opcode::DEL)
+   {
+      reply = del(session.username, baseDirectory, msnr);
+   }
+   else if (opcode == Opcode::MREAD)
+   {
+      reply = mread(session.username, baseDirectory, numbers, ids);
+   }
+   else
+   {
+      reply = mdel(session.username, baseDirectory, numbers, ids);
+   }
+
+   #ifdef ENABLE_MUTEX_TESTING
+   mutexUnlockedMessage(session.username);
+   #endif
+   return reply;
+}
+
+//====================================================================================================================
+
+// A user name is a directory below the mail root, whatever the authenticator accepts
+bool isMailboxName(std::string_view name)
+{
+   return !name.empty() && name.find('/') == std::string_view::npos && name != "." && name != "..";
+}
+
+bool parseMessageNumber(std::string_view text, int &msnr)
+{
+   std::string_view number = trim(text);
+   char digits[16];
+   if (number.empty() || number.size() >= sizeof(digits))
+   {
+      return false;
+   }
+   memcpy(digits, number.data(), number.size());
+   digits[number.size()] = '\0';
+
+   char *end = nullptr;
+   long value = strtol(digits, &end, 10);
+   if (*end != '\0' || value <= 0 || value > INT32_MAX)
+   {
+      return false;
+   }
+   msnr = (int)value;
+   return true;
+}
+
+//====================================================================================================================
+
+// Comma separated message numbers, ranges ("1-5") and message ids (the file names, as in "Emails/<user>/<id>")
+bool parseMessageSelection(std::string_view text, std::vector<int> &numbers, std::vector<string> &ids)
+{
+   text = trim(text);
+   size_t start = 0;
+   while (start < text.size())
+   {
+      size_t end = std::min(text.find(',', start), text.size());
+      string token(trim(text.substr(start, end - start)));
+      start = end + 1;
+      if (parseMessageRange(token, numbers))
+      {
+         continue;
+      }
+      if (token.empty() || token.find('/') != string::npos || token == "." || token == "..")
+      {
+         return false;
+      }
+      ids.push_back(token);
+   }
+   return numbers.size() + ids.size() > 0 && numbers.size() + ids.size() <= MAX_RANGE_COUNT;
+}
+
+//====================================================================================================================
+
+// The lock of one mailbox, created on first use. Locks are never removed, so the reference stays valid.
+ProfiledMutex &mailboxMutex(std::string_view username)
+{
+   std::lock_guard<ProfiledMutex> lock(mailboxLocksMutex);
+   auto it = individualEmailLocks.find(username);
+   if (it == individualEmailLocks.end())
+   {
+      it = individualEmailLocks.emplace(username, std::make_unique<ProfiledMutex>("mailbox")).first;
+   }
+   return *it->second;
+}
+
+DeliveryQueue &deliveryQueue(std::string_view receiver)
+{
+   std::lock_guard<ProfiledMutex> lock(mailboxLocksMutex);
+   auto it = deliveryQueues.find(receiver);
+   if (it == deliveryQueues.end())
+   {
+      it = deliveryQueues.emplace(receiver, std::make_unique<DeliveryQueue>()).first;
+   }
+   return *it->second;
+}
+
+void createDirIfNotCreated(std::string_view username, std::string_view baseDirectory)
+{
+   const char *path = commandArena.join({baseDirectory, "/", username});
+   
+   ProfiledLock lock = lockMeasured(directoryMutex, "directory lock");  // Lock the mutex
+   #ifdef ENABLE_MUTEX_TESTING
+   mutexDelayForTesting("whole email directory");
+   #endif
+
+   // mkdir fails with EEXIST for every mailbox but the first message's, no need to look first
+   if (mkdir(path, 0777) == 0)
+   {
+      logInfo("Directory created: {}", path);
+   }
+   else if (errno != EEXIST)
+   {
+      logError("Error: could not create {}: {}", path, LogErrno{errno});
+   }
+   //create a mutex for this folder, if it does not exist
+   mailboxMutex(username);
+   #ifdef ENABLE_MUTEX_TESTING
+   mutexUnlockedMessage("whole email directory");
+   #endif
+}
+
+//====================================================================================================================
+
+// Failed attempts and the blacklist count per peer: the IP address, or the user id on the Unix socket
+Reply login(const std::string &peer, const std::string &username, const std::string &password, std::string_view baseDirectory)
+{
+   Reply reply;
+
+   bool tooManyAttempts;
+   {
+      std::lock_guard<ProfiledMutex> lock(loginAttemptsMutex);
+      auto attempts = login_attempts.find(peer);
+      tooManyAttempts = attempts != login_attempts.end() && attempts->second > 2;
+      if (tooManyAttempts)
+      {
+         login_attempts.erase(attempts);
+      }
+   }
+   if(tooManyAttempts)
+   {
+        ProfiledLock lock(blacklistMutex);
+        std::ofstream blacklist(BLACKLIST, std::ios::app);
+        blacklist << peer + "\n";
+        logWarn("{} added to blacklist", peer);
+        blacklist.close();
         lock.unlock();
     }
 
-   if (username != "" && password != "")
+   if (username == "" || password == "")
+   {
+      reply.status = Status::ERR_BAD_REQUEST;
+      return reply;
+   }
+
+   if(checkBlacklist(peer))
+   {
+      logInfo("can not login: {} is blacklisted", peer);
+      reply.status = Status::ERR_BLACKLISTED;
+      return reply;
+   }
+
+   auto authStart = std::chrono::steady_clock::now();
+   bool authenticated = authenticator->authenticate(username, password);
+   auto authEnd = std::chrono::steady_clock::now();
+   metrics.recordAuth(std::chrono::duration_cast<std::chrono::nanoseconds>(authEnd - authStart).count(), !authenticated);
+   traceSpan(authenticator->name(), authStart, authEnd);
+   // not held across authenticate(), a slow directory server must not serialize the logins
+   ProfiledLock attemptsLock(loginAttemptsMutex);
+   if(!authenticated)
+   {
+      int attempts = ++login_attempts[peer];
+      attemptsLock.unlock();
+      logInfo("Wrong user credentials, attempts: {}", attempts);
+      reply.status = Status::ERR_AUTH_FAILED;
+      return reply;
+   }
+
+   login_attempts.erase(peer);
+   attemptsLock.unlock();
+
+   logDebug("User {} is now logged in", username);
+
+   createDirIfNotCreated(username, baseDirectory);
+
+   return reply;
+}
+
+// LOGIN by session ticket: one HMAC over a few bytes instead of the authenticator. The blacklist
+// still applies, a failed ticket does not count as a failed password. username is only changed
+// when the ticket is accepted.
+Reply resume(const std::string &peer, std::string_view ticket, std::string &username, std::string_view baseDirectory)
+{
+   Reply reply;
+
+   if(checkBlacklist(peer))
+   {
+      logInfo("can not resume: {} is blacklisted", peer);
+      reply.status = Status::ERR_BLACKLISTED;
+      return reply;
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   std::string ticketUser;
+   bool valid = tickets.verify(ticket, time(nullptr), ticketUser);
+   traceSpan("ticket", start, std::chrono::steady_clock::now());
+   if (!valid || !isMailboxName(ticketUser))
+   {
+      logInfo("invalid or expired session ticket from {}", peer);
+      reply.status = Status::ERR_AUTH_FAILED;
+      return reply;
+   }
+
+   username = ticketUser;
+   logDebug("User {} is now logged in by ticket", username);
+
+   createDirIfNotCreated(username, baseDirectory);
+
+   return reply;
+}
+
+//====================================================================================================================
+
+Reply emailSend(std::string_view username, std::string_view baseDirectory, std::string_view receiver, std::string_view subject, std::string_view message)
+{
+   Reply reply;
+
+   // the receiver names a directory and the subject a line of the mail file
+   if (!isMailboxName(receiver) || subject.empty() || subject.find('\n') != string::npos || message.empty())
+   {
+      reply.status = Status::ERR_BAD_REQUEST;
+      return reply;
+   }
+
+   Delivery delivery;
+   delivery.sender = username;
+   delivery.subject = subject;
+   delivery.message = message;
+
+   DeliveryQueue &queue = deliveryQueue(receiver);
+   ProfiledLock lock(queue.mutex);
+   (queue.last != nullptr ? queue.last->next : queue.first) = &delivery;
+   queue.last = &delivery;
+
+   // wait while another sender writes a batch, ours may be in it
+   queue.committed.wait(lock, [&queue, &delivery] { return delivery.committed || !queue.writing; });
+   if (!delivery.committed)
+   {
+      // write everything queued up to now, the SENDs arriving meanwhile are the next batch
+      Delivery *batch = queue.first;
+      queue.first = nullptr;
+      queue.last = nullptr;
+      queue.writing = true;
+      lock.unlock();
+
+      commitDeliveries(receiver, baseDirectory, batch);
+
+      lock.lock();
+      for (Delivery *next = batch; next != nullptr; next = next->next)
+      {
+         next->committed = true; // the other senders' Delivery may be gone once this is set
+      }
+      queue.writing = false;
+      queue.committed.notify_all();
+   }
+   lock.unlock();
+
+   // only this sender's file failed, the others in the batch were stored
+   if (!delivery.written)
+   {
+      reply.status = Status::ERR_INTERNAL;
+   }
+   else if (delivery.number > 0)
+   {
+      notifyNewMessage(receiver, delivery.number);
+   }
+
+   #ifdef ENABLE_MUTEX_TESTING
+   mutexUnlockedMessage(string(receiver));
+   #endif
+   return reply;
+}
+
+// Writes one file per delivery of batch under one hold of the receiver's mailbox lock, and lists
+// the mailbox once to number them if someone is IDLE on it. The paths come from this thread's arena,
+// each delivery records whether its own file was written.
+void commitDeliveries(std::string_view receiver, std::string_view baseDirectory, Delivery *batch)
+{
+   //if directory for receiver does not exist, create directory
+   createDirIfNotCreated(receiver, baseDirectory);
+   const char *receiverDir = commandArena.join({baseDirectory, "/", receiver});
+
+   ProfiledLock lock = lockMeasured(mailboxMutex(receiver), "mailbox lock");
+   #ifdef ENABLE_MUTEX_TESTING
+   mutexDelayForTesting(string(receiver));
+   #endif
+   uint64_t count = 0;
+   for (Delivery *delivery = batch; delivery != nullptr; delivery = delivery->next)
+   {
+      // Generate a random GUID for the filename
+      uuid_t uuid;
+      char uuid_str[37];
+      uuid_generate(uuid);
+      uuid_unparse(uuid, uuid_str);
+
+      delivery->path = commandArena.join({receiverDir, "/", uuid_str});
+      delivery->written = writeToFile(delivery->path, delivery->sender, delivery->subject, delivery->message);
+      count += delivery->written;
+   }
+
+   // number the new messages the way LIST does, only needed if someone is waiting for them
+   if (hasIdleSessions(receiver))
+   {
+      std::vector<string> files = listMailbox(receiverDir);
+      for (Delivery *delivery = batch; delivery != nullptr; delivery = delivery->next)
+      {
+         if (!delivery->written)
+         {
+            continue;
+         }
+         delivery->number = std::find(files.begin(), files.end(), delivery->path) - files.begin() + 1;
+      }
+   }
+   lock.unlock();
+   metrics.addDeliveryBatch(count);
+}
+
+//====================================================================================================================
+
+// Appends the second line of a mail file ("Subject: <subject>") without the part up to its first space
+static bool readSubject(const char *filepath, string &subject)
+{
+   int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+   if (fd == -1)
+   {
+      return false;
+   }
+
+   char buffer[512];
+   int line = 0;
+   bool spaceSeen = false;
+   ssize_t size;
+   while (line < 2 && (size = ::read(fd, buffer, sizeof(buffer))) > 0)
+   {
+      for (ssize_t i = 0; i < size && line < 2; i++)
+      {
+         if (buffer[i] == '\n')
+         {
+            line++;
+         }
+         else if (line == 1 && buffer[i] == ' ' && !spaceSeen)
+         {
+            subject.clear(); // a line without any space is taken whole
+            spaceSeen = true;
+         }
+         else if (line == 1)
+         {
+            subject += buffer[i];
+         }
+      }
+   }
+   close(fd);
+   return true;
+}
+
+Reply list(std::string_view username, std::string_view baseDirectory)
+{
+   TraceScope span("list directory");
+   Reply reply;
+   const char *path = commandArena.join({baseDirectory, "/", username});
+   logDebug("list {}", path);
+
+   DIR *dir = opendir(path);
+   if(dir == nullptr)
+   {
+      reply.status = Status::ERR_NOT_FOUND;
+      return reply;
+   };
+   
+
+   struct dirent *entry;
+   struct stat st;
+
+   // "<path>/<entry>", only the entry name changes from one file to the next
+   size_t pathLength = strlen(path);
+   char *currentFile = commandArena.allocateText(pathLength + 1 + NAME_MAX);
+   memcpy(currentFile, path, pathLength);
+   currentFile[pathLength] = '/';
+   while((entry = readdir(dir)) != NULL)
+   {
+      strcpy(currentFile + pathLength + 1, entry->d_name);
+      if (stat(currentFile, &st) == -1)
+      {
+         logErrno("stat failed");
+         continue; // Skip this entry and proceed to the next
+      }
+      if(S_ISREG(st.st_mode))
+      {
+         reply.fields.emplace_back();
+
+         //file must exist
+         if(!readSubject(currentFile, reply.fields.back()))
+         {
+            logErrno("unable to open file");
+            closedir(dir);
+            reply.status = Status::ERR_INTERNAL;
+            reply.fields.clear();
+            return reply;
+         }
+      }
+   }
+
+   closedir(dir);
+   return reply;
+}
+
+//====================================================================================================================
+
+Reply read(std::string_view username, std::string_view baseDirectory, int msnr)
+{
+   Reply reply;
+   const char *filepath = findFile(commandArena.join({baseDirectory, "/", username}), msnr);
+
+   reply.fields.resize(3);
+   reply.status = readMailFile(filepath, reply.fields[0], reply.fields[1], reply.fields[2]);
+   if (reply.status != Status::OK)
+   {
+      reply.fields.clear();
+   }
+   return reply;
+}
+
+//====================================================================================================================
+
+// The file is read straight into message, sender and subject are cut off its front
+Status readMailFile(const char *filepath, string &sender, string &subject, string &message)
+{
+   TraceScope span("read file");
+   int fd = filepath == nullptr ? -1 : open(filepath, O_RDONLY | O_CLOEXEC);
+
+   //file must exist
+   struct stat st;
+   if(fd == -1 || fstat(fd, &st) == -1)
+   {
+      logDebug("unable to open file {}", filepath);
+      if (fd != -1)
+      {
+         close(fd);
+      }
+      return Status::ERR_NOT_FOUND;
+   }
+
+   message.resize(st.st_size);
+   size_t length = 0;
+   ssize_t size;
+   while (length < message.size() && (size = ::read(fd, &message[length], message.size() - length)) > 0)
+   {
+      length += size;
+   }
+   close(fd);
+   message.resize(length);
+
+   // Sender: <sender>\nSubject: <subject>\nMessage: <message>\n
+   size_t senderEnd = message.find('\n');
+   size_t subjectEnd = senderEnd == string::npos ? string::npos : message.find('\n', senderEnd + 1);
+   if (subjectEnd == string::npos)
+   {
+      return Status::ERR_INTERNAL;
+   }
+
+   sender.assign(message, 0, senderEnd);
+   subject.assign(message, senderEnd + 1, subjectEnd - senderEnd - 1);
+   message.erase(0, subjectEnd + 1);
+   sender.erase(0, std::min(sender.size(), sizeof("Sender: ") - 1));
+   subject.erase(0, std::min(subject.size(), sizeof("Subject: ") - 1));
+   message.erase(0, std::min(message.size(), sizeof("Message: ") - 1));
+   if (!message.empty() && message.back() == '\n')
+   {
+      message.pop_back();
+   }
+   return Status::OK;
+}
+
+//====================================================================================================================
+
+Reply del(std::string_view username, std::string_view baseDirectory, int msnr)
+{
+   Reply reply;
+   const char *filepath = findFile(commandArena.join({baseDirectory, "/", username}), msnr);
+
+   if(filepath == nullptr)
+   {
+      reply.status = Status::ERR_NOT_FOUND;
+      return reply;
+   }
+
+   TraceScope span("remove file");
+   int status = remove(filepath);
+   if(status != 0)
+   {
+      logErrno("could not delete file");
+      reply.status = Status::ERR_INTERNAL;
+      return reply;
+   }
+
+   return reply;
+}
+
+//====================================================================================================================
+
+// Resolves a selection against one listing of the mailbox. Fails if any message does not exist,
+// so MDEL either deletes everything that was asked for or nothing.
+Status resolveSelection(const char *path, const std::vector<int> &numbers, const std::vector<string> &ids,
+                        std::vector<std::pair<string, string>> &selected)
+{
+   std::vector<string> files = listMailbox(path);
+
+   for (int number : numbers)
+   {
+      if (number > (int)files.size())
+      {
+         return Status::ERR_NOT_FOUND;
+      }
+      selected.emplace_back(to_string(number), files[number - 1]);
+   }
+   for (const string &id : ids)
+   {
+      auto it = std::find(files.begin(), files.end(), commandArena.join({path, "/", id}));
+      if (it == files.end())
+      {
+         return Status::ERR_NOT_FOUND;
+      }
+      selected.emplace_back(to_string(it - files.begin() + 1), *it);
+   }
+   return Status::OK;
+}
+
+//====================================================================================================================
+
+Reply mread(std::string_view username, std::string_view baseDirectory, const std::vector<int> &numbers, const std::vector<string> &ids)
+{
+   Reply reply;
+   std::vector<std::pair<string, string>> selected;
+
+   reply.status = resolveSelection(commandArena.join({baseDirectory, "/", username}), numbers, ids, selected);
+   if (reply.status != Status::OK)
+   {
+      return reply;
+   }
+
+   // number, sender, subject, message for every selected file
+   reply.fields.reserve(selected.size() * 4);
+   for (const auto &entry : selected)
+   {
+      size_t first = reply.fields.size();
+      reply.fields.push_back(entry.first);
+      reply.fields.resize(first + 4);
+      reply.status = readMailFile(entry.second.c_str(), reply.fields[first + 1], reply.fields[first + 2], reply.fields[first + 3]);
+      if (reply.status != Status::OK)
+      {
+         reply.fields.clear();
+         return reply;
+      }
+   }
+   return reply;
+}
+
+//====================================================================================================================
+
+Reply mdel(std::string_view username, std::string_view baseDirectory, const std::vector<int> &numbers, const std::vector<string> &ids)
+{
+   Reply reply;
+   std::vector<std::pair<string, string>> selected;
+
+   reply.status = resolveSelection(commandArena.join({baseDirectory, "/", username}), numbers, ids, selected);
+   if (reply.status != Status::OK)
+   {
+      return reply;
+   }
+
+   TraceScope span("remove files");
+   for (const auto &entry : selected)
+   {
+      // the same message may have been selected twice, by number and by id
+      if (remove(entry.second.c_str()) != 0 && errno != ENOENT)
+      {
+         logErrno("could not delete file");
+         reply.status = Status::ERR_INTERNAL;
+      }
+   }
+   return reply;
+}
+
+//====================================================================================================================
+
+// Queues data and sends everything queued for the session. A client that does not read gets up to
+// --send-timeout to make room; false once the connection is lost or the client gave up.
+bool sendToSession(Session &session, std::string_view data)
+{
+   while (true)
+   {
+      FlushResult result;
+      size_t sent = 0;
+      size_t calls = 0;
+      int error;
+      {
+         std::lock_guard<ProfiledMutex> lock(session.writeMutex);
+         if (!data.empty())
+         {
+            session.output.append(data);
+            data = {};
+         }
+         result = session.output.flush(session.socket, sent, calls);
+         error = errno;
+      }
+      metrics.addBytesOut(sent);
+      metrics.addSendCalls(calls, result == FlushResult::BLOCKED);
+      if (result == FlushResult::DONE)
+      {
+         return true;
+      }
+      if (result == FlushResult::FAILED)
+      {
+         logError("send response failed: {}", LogErrno{error});
+         return false;
+      }
+
+      // the lock is not held while waiting, notifications for this session queue up behind the replies
+      pollfd writable = {session.socket, POLLOUT, 0};
+      int ready = poll(&writable, 1, sendTimeoutMs);
+      if (ready == 0)
+      {
+         logInfo("client took no replies for {} ms, closing", sendTimeoutMs.load());
+         return false;
+      }
+      if (ready == -1 && errno != EINTR)
+      {
+         logErrno("poll");
+         return false;
+      }
+   }
+}
+
+//====================================================================================================================
+
+Reply startIdle(Session &session, uint32_t requestId)
+{
+   Reply reply;
+   if (!session.logged_in)
+   {
+      reply.status = Status::ERR_NOT_LOGGED_IN;
+      return reply;
+   }
+
+   std::lock_guard<ProfiledMutex> lock(idleMutex);
+   if (!session.idle)
+   {
+      idleSessions[session.username].push_back(session.shared_from_this());
+   }
+   session.idleRequestId = requestId;
+   session.idle = true;
+   return reply;
+}
+
+void endIdle(Session &session)
+{
+   std::lock_guard<ProfiledMutex> lock(idleMutex);
+   if (!session.idle)
+   {
+      return;
+   }
+   session.idle = false;
+
+   auto it = idleSessions.find(session.username);
+   if (it == idleSessions.end())
+   {
+      return;
+   }
+   auto &sessions = it->second;
+   sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
+                                 [&session](const std::shared_ptr<Session> &idle) { return idle.get() == &session; }),
+                  sessions.end());
+   if (sessions.empty())
+   {
+      idleSessions.erase(it);
+   }
+}
+
+bool hasIdleSessions(std::string_view username)
+{
+   std::lock_guard<ProfiledMutex> lock(idleMutex);
+   return idleSessions.find(username) != idleSessions.end();
+}
+
+//====================================================================================================================
+
+// Pushes "new message N" to every session idling on the mailbox. Never blocks the sender:
+// a client that does not read its notifications just loses them.
+void notifyNewMessage(std::string_view username, int number)
+{
+   std::vector<std::shared_ptr<Session>> sessions;
    {
-      if(checkBlacklist(client_ip))
+      std::lock_guard<ProfiledMutex> lock(idleMutex);
+      auto it = idleSessions.find(username);
+      if (it == idleSessions.end())
       {
-         respond(current_socket, "ERR\n");
-         cout << "can not login: IP is blacklisted" << endl;
-         return logged_in;
+         return;
       }
+      sessions = it->second;
+   }
 
-      if(!checkLdap(username, password))
+   for (const std::shared_ptr<Session> &session : sessions)
+   {
+      FlushResult result;
+      size_t sent = 0;
+      size_t calls = 0;
       {
-         if(login_attempts.find(client_ip) != login_attempts.end())
+         std::lock_guard<ProfiledMutex> lock(session->writeMutex);
+         if (!session->idle)
          {
-            login_attempts[client_ip]++;
+            continue; // answered DONE in the meantime
+         }
+
+         if (session->v2)
+         {
+            Frame frame;
+            frame.code = (uint8_t)Status::OK;
+            frame.requestId = session->idleRequestId;
+            frame.fields = {to_string(number)};
+            encodeFrame(frame, session->output.tail());
          }
          else
          {
-            login_attempts[client_ip] = 1;
+            session->output.tail().append("new message ").append(to_string(number)).append("\n");
+         }
+         result = session->output.flush(session->socket, sent, calls);
+         if (result == FlushResult::FAILED)
+         {
+            logErrno("idle notification failed");
          }
-         respond(current_socket, "ERR\n");
-         cout << "Wrong user credentials, attempts: " << login_attempts[client_ip] << endl;
-         return logged_in;
       }
-
-      login_attempts.erase(client_ip);
-
-      cout << "Username set to: " << username << endl;
-      cout << "Password set" << endl;
-
-      logged_in = true;
-      cout << "User is now logged in" << endl;
-
-      createDirIfNotCreated(username, baseDirectory);
-
-      respond(current_socket, "OK\n");
-   }
-   else
-   {
-      respond(current_socket, "ERR\n");
+      metrics.addBytesOut(sent);
+      metrics.addSendCalls(calls, result == FlushResult::BLOCKED);
+      if (result == FlushResult::BLOCKED)
+      {
+         watchParkedOutput(*session); // the rest goes out once the client reads again
+      }
    }
-
-   return logged_in;
 }
 
 //====================================================================================================================
 
-void emailSend(int *current_socket, std::string username, std::string baseDirectory, std::istringstream &stream)
+void parkSession(std::shared_ptr<Session> session)
 {
-   string receiver;
-   string subject = "";
-   string line;
-   string message = "";
-   struct stat st;
-   memset(&st, 0, sizeof(st));
-   
-
-   if (!std::getline(stream, receiver))
-   {
-        respond(current_socket, "ERR\n"); 
-        return;
-    }
-   //if directory for receiver does not exist, create directory
-   createDirIfNotCreated(receiver, baseDirectory);
-   string receiverDir = baseDirectory + "/" + receiver;
-   printf("Directory exists\n");
-   fflush(stdout);
-   // Extract subject
-   if (!std::getline(stream, subject))
-   {
-        respond(current_socket, "ERR\n"); 
-        return;
-    }
-   
-   printf("subject parsed\n");
-   fflush(stdout);
+   std::lock_guard<ProfiledMutex> lock(idleMutex);
 
-   // Get the message until a line containing only '.' is received
-   message = "";
-   while(true)
+   epoll_event event;
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+   event.data.fd = session->socket;
    {
-       if (!std::getline(stream, line))
-    {
-        respond(current_socket, "ERR\n"); 
-        break;
-    }
-   
-      if (line == ".")
+      // checked under idleMutex: a notification blocked from now on finds the session parked and arms EPOLLOUT
+      std::lock_guard<ProfiledMutex> writeLock(session->writeMutex);
+      if (!session->output.empty())
       {
-         printf("End of message received.\n");
-         break;
+         event.events |= EPOLLOUT;
       }
-      message = message + "\n" + line;     
    }
-
-   if (subject.empty() || message.empty())
+   parkedSessions[session->socket] = session;
+   if (epoll_ctl(idleEpoll, EPOLL_CTL_ADD, session->socket, &event) == -1)
    {
-      respond(current_socket, "ERR\n");
-      return;
-   }
+      logErrno("epoll_ctl add");
+      parkedSessions.erase(session->socket);
 
-   printf("Message and subject parsed\n");
-   fflush(stdout);
+      // cannot wait for it, so hand it straight back to the workers
+      enqueueSession(session);
+   }
+}
 
-   // Enclose the FILE* declaration in a block to limit its scope
+// A notification did not fit into the socket buffer of a parked session: wait for EPOLLOUT as well
+void watchParkedOutput(Session &session)
+{
+   std::lock_guard<ProfiledMutex> lock(idleMutex);
+   auto it = parkedSessions.find(session.socket);
+   if (it == parkedSessions.end() || it->second.get() != &session)
    {
-      // Generate a random GUID for the filename
-      uuid_t uuid;
-      char uuid_str[37];
-      uuid_generate(uuid);
-      uuid_unparse(uuid, uuid_str);
-      std::string uuidString(uuid_str);
-
-      // Generate file path
-      string file_path = receiverDir + "/" + uuidString;
-      //lock folder
-       //create a mutex for this folder, if it does not exist
-      individualEmailLocks.try_emplace(username, std::make_unique<std::mutex>());
-      std::lock_guard<std::mutex> lock(*individualEmailLocks[receiver]);
-      #ifdef ENABLE_MUTEX_TESTING
-      mutexDelayForTesting(receiver);
-      #endif
-      //write and close file
-      writeToFile(file_path, username, subject, message);
+      return; // a worker has it and sends the rest with its next replies
    }
 
-
-   
-   #ifdef ENABLE_MUTEX_TESTING
-   mutexUnlockedMessage(receiver);
-   #endif
-   // Send success response
-   respond(current_socket, "OK\n");
+   epoll_event event;
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT | EPOLLONESHOT;
+   event.data.fd = session.socket;
+   if (epoll_ctl(idleEpoll, EPOLL_CTL_MOD, session.socket, &event) == -1)
+   {
+      logErrno("epoll_ctl mod");
+   }
 }
 
-//====================================================================================================================
-
-void list(int *current_socket, string username, string baseDirectory)
+// Sends queued notifications of a parked session that became writable and waits for it again.
+// Caller holds idleMutex. False if the connection broke, then a worker has to clean up.
+static bool flushParkedSession(Session &session)
 {
-   string path = baseDirectory + "/" + username;
-   std::cout << path << std::endl;
-   if (path.empty())
-    {
-        respond(current_socket, "ERR\n");
-        std::cerr << "Error: Path is empty!" << std::endl;
-        return;
-    }
-
-   DIR *dir = opendir(path.c_str());
-   if(dir == nullptr)
+   FlushResult result;
+   size_t sent = 0;
+   size_t calls = 0;
+   epoll_event event;
+   memset(&event, 0, sizeof(event));
+   event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+   event.data.fd = session.socket;
    {
-      respond(current_socket, "ERR\n");
-      return;
-   };
-   
+      std::lock_guard<ProfiledMutex> lock(session.writeMutex);
+      result = session.output.flush(session.socket, sent, calls);
+      if (!session.output.empty())
+      {
+         event.events |= EPOLLOUT;
+      }
+   }
+   metrics.addBytesOut(sent);
+   metrics.addSendCalls(calls, result == FlushResult::BLOCKED);
+   return result != FlushResult::FAILED && epoll_ctl(idleEpoll, EPOLL_CTL_MOD, session.socket, &event) == 0;
+}
 
-   struct dirent *entry;
-   struct stat st;
-   int file_number = 0;
-   int message_index = 1;
-   string response;
+// Hands parked sessions back to the workers as soon as their client sends something (usually DONE)
+void idleWatcher()
+{
+   epoll_event events[64];
 
-   while((entry = readdir(dir)) != NULL)
+   while (serverRunning)
    {
-      string currentFile = path + "/" + entry->d_name;
-      if (stat(currentFile.c_str(), &st) == -1)
-      {
-         perror("stat failed");
-         continue; // Skip this entry and proceed to the next
-      }
-      if(S_ISREG(st.st_mode))
+      int count = epoll_wait(idleEpoll, events, 64, 1000);
+      if (count == -1)
       {
-         ifstream file(currentFile);
-         string line;
-
-         //file must exist
-         if(!file.is_open())
+         if (errno != EINTR)
          {
-            perror("unable to open file");
-            respond(current_socket, "ERR\n");
-            return;
+            logErrno("epoll_wait");
          }
+         continue;
+      }
 
-         for(int i = 0; i < 2; i++)
+      for (int i = 0; i < count; i++)
+      {
+         std::shared_ptr<Session> session;
          {
-            getline(file, line);
+            std::lock_guard<ProfiledMutex> lock(idleMutex);
+            auto it = parkedSessions.find(events[i].data.fd);
+            if (it == parkedSessions.end())
+            {
+               continue;
+            }
+            session = it->second;
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) == 0 && flushParkedSession(*session))
+            {
+               continue; // only writable, the client is still waiting for mail
+            }
+            parkedSessions.erase(it);
+            epoll_ctl(idleEpoll, EPOLL_CTL_DEL, session->socket, nullptr);
          }
 
-         size_t delpos = line.find(" ");
-         string subject = line.substr(delpos + 1);
-
-         file.close();
-         response = response + to_string(message_index) + ": " + subject + "\n";
-         message_index++;
-         file_number++;
+         enqueueSession(session);
       }
    }
 
-   closedir(dir);
-   respond(current_socket, "Number of emails: " + to_string(file_number) + "\n" + response);
+   // shutdown: parked clients have no worker that would close them, closeSession() takes idleMutex itself
+   std::vector<std::shared_ptr<Session>> parked;
+   {
+      std::lock_guard<ProfiledMutex> lock(idleMutex);
+      for (auto &entry : parkedSessions)
+      {
+         parked.push_back(std::move(entry.second));
+      }
+      parkedSessions.clear();
+   }
+   for (auto &session : parked)
+   {
+      closeSession(*session);
+   }
+   close(idleEpoll);
 }
 
 //====================================================================================================================
 
-void read(int* current_socket, string username, string baseDirectory, std::istringstream &stream)
+// Seconds a new client should wait before it tries again, 0 if it may be queued. Caller holds shard.queueMutex.
+// The queue drains in about as long as its oldest session has waited, so that is the hint.
+int admissionDelay(Shard &shard, Rejection &reason)
 {
-  
-    string msnrString;
-   if (!std::getline(stream, msnrString))
-    {
-        respond(current_socket, "ERR\n"); 
-        return;
-    }
-   int msnr = stoi(msnrString);
-
-   string filepath = findFile(current_socket, baseDirectory + "/" + username, msnr);
-
-   string line;
-   ifstream file(filepath);
+   int retryAfter = 1;
+   if (!shard.taskQueue.empty())
+   {
+      auto waited = std::chrono::steady_clock::now() - shard.taskQueue.front()->queuedAt;
+      retryAfter = std::max<int>(1, std::chrono::duration_cast<std::chrono::seconds>(waited).count() + 1);
+      if (queueTargetMs > 0 && waited > std::chrono::milliseconds(queueTargetMs.load()))
+      {
+         reason = Rejection::QUEUE_WAIT;
+         return retryAfter;
+      }
+   }
+   if (maxQueuedSessions > 0 && (int)shard.taskQueue.size() >= maxQueuedSessions)
+   {
+      reason = Rejection::QUEUE_FULL;
+      return retryAfter;
+   }
+   return 0;
+}
 
-   //file must exist
-   if(!file.is_open())
+// Counts a connection from peer, false if that would exceed --max-per-ip
+bool reserveConnection(const std::string &peer)
+{
+   std::lock_guard<ProfiledMutex> lock(connectionsMutex);
+   int &connections = connectionsPerPeer[peer];
+   if (maxConnectionsPerIp > 0 && connections >= maxConnectionsPerIp)
    {
-      perror("unable to open file");
-      respond(current_socket, "ERR\n");
-      return;
+      return false;
    }
-   
-   getline(file, line);
-   string response = line;
-   while(getline(file, line))
+   connections++;
+   return true;
+}
+
+void releaseConnection(const std::string &peer)
+{
+   std::lock_guard<ProfiledMutex> lock(connectionsMutex);
+   auto it = connectionsPerPeer.find(peer);
+   if (it != connectionsPerPeer.end() && --it->second <= 0)
    {
-      response = response + "\n" + line;
+      connectionsPerPeer.erase(it);
    }
-   file.close();
+}
 
-   respond(current_socket, response);
+// Sends the BUSY line instead of the welcome and closes, the accept loop must not block on a slow client
+void rejectConnection(int socket, int retryAfter, Rejection reason)
+{
+   string busy = "BUSY retry-after=" + to_string(retryAfter) + "\n";
+   if (send(socket, busy.c_str(), busy.size(), MSG_DONTWAIT | MSG_NOSIGNAL) > 0)
+   {
+      metrics.addBytesOut(busy.size());
+   }
+   metrics.recordRejection(reason);
+   logDebug("rejected client, retry after {}s", retryAfter);
+   shutdown(socket, SHUT_RDWR);
+   close(socket);
 }
 
 //====================================================================================================================
 
-void del(int* current_socket, string username, string baseDirectory, std::istringstream &stream)
+Gauges currentGauges()
 {
+   Gauges gauges;
+   for (auto &shard : shards)
+   {
+      {
+         std::lock_guard<ProfiledMutex> lock(shard->queueMutex);
+         gauges.queueDepth += shard->taskQueue.size();
+      }
+      gauges.activeThreads += shard->activeThreads;
+      gauges.availableThreads += shard->availableThreads;
+   }
+   {
+      std::lock_guard<ProfiledMutex> lock(idleMutex);
+      gauges.idleSessions = parkedSessions.size();
+   }
+   for (auto &shard : shards)
+   {
+      std::lock_guard<ProfiledMutex> lock(shard->laneMutex);
+      for (int i = 0; i < (int)Lane::COUNT; i++)
+      {
+         gauges.laneActive[i] += shard->laneActive[i];
+         gauges.laneWaiting[i] += shard->laneWaiting[i].size();
+      }
+   }
+   return gauges;
+}
 
-     string msnrString;
-   if (!std::getline(stream, msnrString))
-    {
-        respond(current_socket, "ERR\n"); 
-        return;
-    }
-   int msnr = stoi(msnrString);
-   string filepath = findFile(current_socket, baseDirectory + "/" + username, msnr);
+// Minimal HTTP/1.0 server on 127.0.0.1:port answering GET /metrics in the Prometheus text format
+void metricsServer(int port)
+{
+   int listener = socket(AF_INET, SOCK_STREAM, 0);
+   int reuseValue = 1;
+   setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue));
 
-   int status = remove(filepath.c_str());
-   if(status != 0)
+   struct sockaddr_in address;
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   address.sin_port = htons(port);
+   if (listener == -1 || bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 8) == -1)
    {
-      perror("could not delete file");
-      respond(current_socket, "ERR\n");
+      logErrno("metrics endpoint");
+      if (listener != -1)
+      {
+         close(listener);
+      }
       return;
    }
+   logInfo("metrics on http://127.0.0.1:{}/metrics", port);
+
+   while (serverRunning)
+   {
+      // wake up once a second to notice the shutdown
+      struct pollfd waiting = {listener, POLLIN, 0};
+      if (poll(&waiting, 1, 1000) <= 0)
+      {
+         continue;
+      }
+      int client = accept(listener, NULL, NULL);
+      if (client == -1)
+      {
+         continue;
+      }
+
+      // a scraper sends its whole request at once, the headers are not needed
+      char request[BUF];
+      struct timeval timeout = {1, 0};
+      setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      ssize_t size = recv(client, request, sizeof(request) - 1, 0);
+      request[size > 0 ? size : 0] = '\0';
 
-   respond(current_socket, "OK\n");
+      string response;
+      if (strncmp(request, "GET /metrics", 12) == 0)
+      {
+         string body = metrics.prometheus(currentGauges());
+         response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                    to_string(body.size()) + "\r\n\r\n" + body;
+      }
+      else
+      {
+         response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+      }
+      send(client, response.c_str(), response.size(), MSG_NOSIGNAL);
+      close(client);
+   }
+   close(listener);
 }
 
 //====================================================================================================================
@@ -739,35 +2974,17 @@ void signalHandler(int sig)
     {
         printf("Abort Requested...\n");
         serverRunning = false;  // Set serverRunning to false to notify threads
-        condition.notify_all();  // Wake up all waiting threads
 
-        // Gracefully shut down all active client sockets
-        {
-            std::lock_guard<std::mutex> lock(queueMutex); // Ensure safe shutdown of connections
-            while (!taskQueue.empty())
-            {
-                int clientSocket = taskQueue.front();
-                taskQueue.pop();
-                if (clientSocket != -1)
-                {
-                    shutdown(clientSocket, SHUT_RDWR);  // Shutdown client socket communication
-                    close(clientSocket);  // Close the client socket
-                    printf("Client socket closed\n");
-                }
-            }
-        }
+        // Indicate that server shutdown is requested
+        abortRequested = 1;
 
-        // Gracefully shut down the listening socket
-        if (create_socket != -1)
+        // No locks in here: the acceptors return on the eventfd, then main wakes the workers,
+        // closes the listening sockets and the sessions still queued for a worker or a lane
+        uint64_t stop = 1;
+        if (write(stopAcceptingFd, &stop, sizeof(stop)) == -1)
         {
-            shutdown(create_socket, SHUT_RDWR);  // Stop accepting new connections
-            close(create_socket);  // Close the listening socket
-            create_socket = -1;
-            printf("Listening socket shutdown and closed...\n");
+            printf("could not stop the acceptors\n");
         }
-
-        // Indicate that server shutdown is requested
-        abortRequested = 1;
     }
     else
     {
@@ -780,40 +2997,31 @@ void signalHandler(int sig)
 
 //====================================================================================================================
 
-void respond(int *current_socket, string response)
-{
-   if (send(*current_socket, response.c_str(), response.size(), 0) == -1)
-   {
-      perror("send response failed");
-   }
-   else
-   {
-      printf("response successfully sent\n"); // ignore error
-   }
-}
-
-//====================================================================================================================
-
-string findFile(int *current_socket, string path, int position)
+// Path of the message at position (counting from 1) in the mailbox at path, nullptr if there is none.
+// The path lives in commandArena.
+const char *findFile(std::string_view path, int position)
 {
-    string filename = "";
+    TraceScope span("find file");
+    const char *filename = nullptr;
 
     // filecount starts at 1
-    if (position == 0)
+    if (position <= 0)
     {
-        perror("bad message number");
-        respond(current_socket, "ERR\n");
+        logDebug("bad message number {}", position);
         return filename;
     }
 
-    // directory must exist
-    DIR *dir = opendir(path.c_str());
+    // directory must exist, currentFile is "<path>/<entry>" with only the entry name changing
+    char *currentFile = commandArena.allocateText(path.size() + 1 + NAME_MAX);
+    memcpy(currentFile, path.data(), path.size());
+    currentFile[path.size()] = '\0';
+    DIR *dir = opendir(currentFile);
     if (dir == NULL)
     {
-        perror("directory does not exist");
-        respond(current_socket, "ERR\n");
+        logErrno("directory does not exist");
         return filename;
     }
+    currentFile[path.size()] = '/';
 
     struct dirent *entry;
     struct stat st;
@@ -822,15 +3030,15 @@ string findFile(int *current_socket, string path, int position)
     while ((entry = readdir(dir)) != NULL)
     {
         // Skip "." and ".." entries
-        if (string(entry->d_name) == "." || string(entry->d_name) == "..")
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
         {
             continue;
         }
 
-        string currentFile = path + "/" + entry->d_name;
-        if (stat(currentFile.c_str(), &st) == -1)
+        strcpy(currentFile + path.size() + 1, entry->d_name);
+        if (stat(currentFile, &st) == -1)
          {
-            perror("stat failed");
+            logErrno("stat failed");
             continue; // Skip this entry and proceed to the next
          }
 
@@ -846,9 +3054,9 @@ string findFile(int *current_socket, string path, int position)
     }
 
     // file not found
-    if (filename.empty())
+    if (filename == nullptr)
     {
-        perror("file not found");
+        logDebug("file not found: message {} in {}", position, path);
         //the calling function will send ERR to client
     }
 
@@ -858,14 +3066,54 @@ string findFile(int *current_socket, string path, int position)
 
 //====================================================================================================================
 
-bool checkBlacklist(std::string client_ip)
+// All messages of a mailbox in the order LIST and findFile() number them
+std::vector<string> listMailbox(std::string_view path)
+{
+    TraceScope span("list directory");
+    std::vector<string> files;
+
+    char *currentFile = commandArena.allocateText(path.size() + 1 + NAME_MAX);
+    memcpy(currentFile, path.data(), path.size());
+    currentFile[path.size()] = '\0';
+    DIR *dir = opendir(currentFile);
+    if (dir == NULL)
+    {
+        logErrno("directory does not exist");
+        return files;
+    }
+    currentFile[path.size()] = '/';
+
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        strcpy(currentFile + path.size() + 1, entry->d_name);
+        if (stat(currentFile, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            files.push_back(currentFile);
+        }
+    }
+
+    closedir(dir);
+    return files;
+}
+
+//====================================================================================================================
+
+bool checkBlacklist(const std::string &peer)
 {
+   TraceScope span("blacklist");
    std::string line;
-   std::unique_lock<std::mutex> lock(blacklistMutex);
+   ProfiledLock lock(blacklistMutex);
    std::ifstream blacklist(BLACKLIST);
    while(std::getline(blacklist, line))
    {
-      if(line == client_ip)
+      if(line == peer)
       {
          blacklist.close();
          lock.unlock();
@@ -877,171 +3125,63 @@ bool checkBlacklist(std::string client_ip)
    return false;
 }
 
-//====================================================================================================================
-
-bool checkLdap(std::string username, std::string password)
-{
-   //std::cout << username << std::endl << password << std::endl;
-   std::string filter_username = "(uid=" + username + "*)";
-   const char *ldapUri = "ldap://ldap.technikum-wien.at:389";
-   const int ldapVersion = LDAP_VERSION3;
-
-   const char *ldapSearchBaseDomainComponent = "dc=technikum-wien,dc=at";
-   const char *ldapSearchFilter = filter_username.c_str();
-   ber_int_t ldapSearchScope = LDAP_SCOPE_SUBTREE;
-   const char *ldapSearchResultAttributes[] = {"uid", "cn", NULL};
-
-   int rc = 0;
-   username = "uid=" + username + ",ou=people,dc=technikum-wien,dc=at";
-
-   LDAP *ldapHandle;
-   rc = ldap_initialize(&ldapHandle, ldapUri);
-   if (rc != LDAP_SUCCESS)
-   {
-      fprintf(stderr, "ldap_init failed\n");
-      return false;
-   }
-   printf("connected to LDAP server %s\n", ldapUri);
-
-   rc = ldap_set_option(
-       ldapHandle,
-       LDAP_OPT_PROTOCOL_VERSION, // OPTION
-       &ldapVersion);             // IN-Value
-   if (rc != LDAP_OPT_SUCCESS)
-   {
-      fprintf(stderr, "ldap_set_option(PROTOCOL_VERSION): %s\n", ldap_err2string(rc));
-      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-      return false;
-   }
-
-   rc = ldap_start_tls_s(
-       ldapHandle,
-       NULL,
-       NULL);
-   if (rc != LDAP_SUCCESS)
-   {
-      fprintf(stderr, "ldap_start_tls_s(): %s\n", ldap_err2string(rc));
-      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-      return false;
-   }
-
-   BerValue bindCredentials;
-   bindCredentials.bv_val = (char *)password.c_str();
-   bindCredentials.bv_len = strlen(password.c_str());
-   BerValue *servercredp;
-   rc = ldap_sasl_bind_s(
-       ldapHandle,
-       username.c_str(),
-       LDAP_SASL_SIMPLE,
-       &bindCredentials,
-       NULL,
-       NULL,
-       &servercredp);
-   if (rc != LDAP_SUCCESS)
-   {
-      fprintf(stderr, "LDAP bind error: %s\n", ldap_err2string(rc));
-      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-      return false;
-   }
-
-   LDAPMessage *searchResult;
-   rc = ldap_search_ext_s(
-       ldapHandle,
-       ldapSearchBaseDomainComponent,
-       ldapSearchScope,
-       ldapSearchFilter,
-       (char **)ldapSearchResultAttributes,
-       0,
-       NULL,
-       NULL,
-       NULL,
-       500,
-       &searchResult);
-   if (rc != LDAP_SUCCESS)
-   {
-      fprintf(stderr, "LDAP search error: %s\n", ldap_err2string(rc));
-      ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-      return false;
-   }
-
-   printf("Total results: %d\n", ldap_count_entries(ldapHandle, searchResult));
-
-   LDAPMessage *searchResultEntry;
-   for (searchResultEntry = ldap_first_entry(ldapHandle, searchResult);
-        searchResultEntry != NULL;
-        searchResultEntry = ldap_next_entry(ldapHandle, searchResultEntry))
-   {
-      printf("DN: %s\n", ldap_get_dn(ldapHandle, searchResultEntry));
-
-      BerElement *ber;
-      char *searchResultEntryAttribute;
-      for (searchResultEntryAttribute = ldap_first_attribute(ldapHandle, searchResultEntry, &ber);
-           searchResultEntryAttribute != NULL;
-           searchResultEntryAttribute = ldap_next_attribute(ldapHandle, searchResultEntry, ber))
-      {
-         BerValue **vals;
-         if ((vals = ldap_get_values_len(ldapHandle, searchResultEntry, searchResultEntryAttribute)) != NULL)
-         {
-            for (int i = 0; i < ldap_count_values_len(vals); i++)
-            {
-               printf("\t%s: %s\n", searchResultEntryAttribute, vals[i]->bv_val);
-            }
-            ldap_value_free_len(vals);
-         }
-
-         ldap_memfree(searchResultEntryAttribute);
-      }
-      if (ber != NULL)
-      {
-         ber_free(ber, 0);
-      }
-
-      printf("\n");
-   }
-
-   ldap_msgfree(searchResult);
-
-   ldap_unbind_ext_s(ldapHandle, NULL, NULL);
-   return true;
-}
-
 
-void writeToFile(const std::string& filename, const std::string& username, const std::string& subject, const std::string& message)
+// One writev() instead of a stream, so storing a message allocates nothing
+// false if the mail could not be stored completely, a partial file is removed so LIST never shows it
+bool writeToFile(const char *filename, std::string_view username, std::string_view subject, std::string_view message)
 {
-    std::ofstream file(filename);
-    if (!file)
+    TraceScope span("write file");
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1)
     {
-        std::cerr << "Error opening file: " << filename << std::endl;
-        return;
+        logError("Error opening file {}: {}", filename, LogErrno{errno});
+        return false;
     }
 
-    file << "Sender: " << username << "\n";
-    file << "Subject: " << subject << "\n";
-    file << "Message: " << message << "\n";
-
-    // The file is automatically closed when the ofstream object goes out of scope
-}
-
-std::string getClientIPAddress(int* current_socket)
-{
-    if (current_socket == nullptr || *current_socket < 0)
+    struct iovec parts[] = {
+        {(void *)"Sender: ", 8}, {(void *)username.data(), username.size()},
+        {(void *)"\nSubject: ", 10}, {(void *)subject.data(), subject.size()},
+        {(void *)"\nMessage: ", 10}, {(void *)message.data(), message.size()},
+        {(void *)"\n", 1}};
+    struct iovec *next = parts;
+    int count = sizeof(parts) / sizeof(parts[0]);
+    bool complete = true;
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, next, count);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written == -1)
+        {
+            logError("Error writing file {}: {}", filename, LogErrno{errno});
+            complete = false;
+            break;
+        }
+        // a short write continues where it stopped
+        while (count > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    if (close(fd) == -1)
     {
-        std::cerr << "Invalid socket" << std::endl;
-        return "";
+        logError("Error closing file {}: {}", filename, LogErrno{errno});
+        complete = false;
     }
-
-    sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-
-    if (getpeername(*current_socket, (sockaddr *)&client_addr, &addr_len) == -1)
+    if (!complete)
     {
-        perror("getpeername failed");
-        return "";
+        unlink(filename);
     }
-
-    char ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(client_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-    return std::string(ip_str);
+    return complete;
 }
 
 void removeIdleThreads()
@@ -1049,17 +3189,18 @@ void removeIdleThreads()
     while (serverRunning)
     {
         std::this_thread::sleep_for(std::chrono::seconds(10));
+         for (auto &shard : shards)
          {
-           std::lock_guard<std::mutex> lock(queueMutex);
-           if (taskQueue.empty() && activeThreads + availableThreads > THREAD_POOL_SIZE && availableThreads > 0)
+           std::lock_guard<ProfiledMutex> lock(shard->queueMutex);
+           if (shard->taskQueue.empty() && shard->activeThreads + shard->availableThreads > minThreads && shard->availableThreads > 0)
             {
-                  int threadsToRemove = availableThreads;
-                  if (activeThreads + availableThreads - threadsToRemove < THREAD_POOL_SIZE)
-                     threadsToRemove = activeThreads + availableThreads - THREAD_POOL_SIZE;
+                  int threadsToRemove = shard->availableThreads;
+                  if (shard->activeThreads + shard->availableThreads - threadsToRemove < minThreads)
+                     threadsToRemove = shard->activeThreads + shard->availableThreads - minThreads;
 
                   for (int i = 0; i < threadsToRemove; ++i)
                   {
-                     condition.notify_one(); // Notify threads to exit
+                     shard->condition.notify_one(); // Notify threads to exit
                   }
             }
          }
@@ -1067,7 +3208,7 @@ void removeIdleThreads()
     }
 }
 
-std::string trim(const std::string& str)
+std::string_view trim(std::string_view str)
 {
     size_t start = str.find_first_not_of(" \r\n\t");  // Find first non-whitespace character
     size_t end = str.find_last_not_of(" \r\n\t");    // Find last non-whitespace character
@@ -9,12 +9,22 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <uuid/uuid.h>
 #include <cstring>  // For memset
+#include <cerrno>
 #include <dirent.h>
-#include <ldap.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 
 #include <queue>
+#include <deque>
 #include <thread>
 #include <condition_variable>
 #include <atomic>
@@ -26,6 +36,23 @@
 #include <filesystem>
 #include <memory>
 #include <map>
+#include <set>
+#include <mutex>
+#include <algorithm>
+
+#include "twmailer-protocol.h"
+#include "twmailer-auth.h"
+#include "twmailer-capture.h"
+#include "twmailer-metrics.h"
+#include "twmailer-mutex.h"
+#include "twmailer-perf.h"
+#include "twmailer-config.h"
+#include "twmailer-affinity.h"
+#include "twmailer-arena.h"
+#include "twmailer-output.h"
+#include "twmailer-log.h"
+#include "twmailer-trace.h"
+#include "twmailer-handoff.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -37,24 +64,169 @@
 #define SUBJECT_BUFFER_LENGTH 89
 #define RECV_DIR 16
 #define BLACKLIST "blacklist.txt"
+#define MAX_PENDING_INPUT (1024 * 1024) // unparsed text input allowed per session
 
 using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void clientCommunication(void *data);
+// Result of one command, independent of the protocol it arrived with.
+// LIST: one field per subject. READ: sender, subject, message.
+struct Reply
+{
+   Status status = Status::OK;
+   std::vector<std::string> fields;
+};
+
+struct Shard;
+
+// Per-connection state, owned by the worker serving the client or by idleWatcher() during IDLE
+struct Session : std::enable_shared_from_this<Session>
+{
+   int socket = -1;
+   Shard *shard = nullptr;   // accepted by this shard, only its workers serve the session
+   string peer;              // "<ip>" or "uid:<n>" on the Unix socket: blacklist, login attempts and --max-per-ip
+   bool local = false;       // loopback, or a Unix socket peer running as root or as the server's user: admin commands
+   bool welcomed = false;
+   bool logged_in = false;
+   bool v2 = false;          // switched to binary framing with "V2"
+   string username;
+   string inbuf;             // received bytes not yet parsed into a command or frame
+   size_t scanResume = 0;    // textCommandLength() of an unfinished SEND continues here
+   std::vector<std::string_view> args; // arguments of the running text command, point into inbuf
+   FrameView frame;          // the running v2 request, its fields point into inbuf
+   OutputBuffer output;      // replies and notifications not yet sent, guarded by writeMutex
+   bool legacyFraming = true; // client has not yet terminated a command with '\n'
+   std::atomic<bool> idle{false}; // waiting for "new message" notifications
+   uint32_t idleRequestId = 0; // v2 notifications carry the request id of IDLE
+   ProfiledMutex writeMutex{"writeMutex"}; // replies and notifications must not interleave in output
+   uint32_t captureId = 0;   // session number in the capture file, 0 while not capturing
+   std::chrono::steady_clock::time_point queuedAt;   // last push to the task queue
+   std::chrono::steady_clock::time_point dequeuedAt; // a worker picked it up
+   bool queueWaitPending = false; // the next traced request gets the queue wait span
+   bool deferred = false;    // the first command in inbuf waits for a slot of deferredLane
+   Lane deferredLane = Lane::READ;
+   bool laneGranted = false; // leaveLane() handed a slot of deferredLane over, set under the shard's laneMutex
+   std::chrono::steady_clock::time_point deferredAt;
+};
+
+// One acceptor with its own SO_REUSEPORT listening socket, task queue and workers (--shards=<n>),
+// the kernel spreads new connections over the listening sockets
+struct Shard
+{
+   int index = 0;
+   int listenSocket = -1;
+   int node = -1;            // NUMA node of cpus, -1 when not pinned
+   std::vector<int> cpus;    // --pin-shards, --numa, --cpus: acceptor and workers only run here, empty = anywhere
+   std::atomic<uint64_t> ranOn[CPU_SETSIZE / 64] = {}; // CPUs the workers served sessions on, for the report
+   std::thread acceptor;
+   std::deque<std::shared_ptr<Session>> taskQueue; // new sessions, ones woken up from IDLE and from a lane
+   ProfiledMutex queueMutex{"queueMutex"}; //for locking taskQueue
+   ProfiledMutex threadQueue{"threadQueue"}; //for locking threadPool when creating, deleting threads
+   ProfiledCondition condition; // workers wait here for taskQueue
+   std::vector<std::thread> threadPool;
+   std::atomic<int> availableThreads{0};
+   std::atomic<int> activeThreads{0};
+   ProfiledMutex laneMutex{"laneMutex"}; //for laneActive and laneWaiting
+   int laneActive[(int)Lane::COUNT] = {}; // commands of the lane running on the shard's workers
+   std::deque<std::shared_ptr<Session>> laneWaiting[(int)Lane::COUNT]; // deferred sessions, oldest first
+};
+
+// One SEND waiting in the delivery queue of its receiver, lives on the sender's stack
+struct Delivery
+{
+   std::string_view sender;
+   std::string_view subject;
+   std::string_view message;
+   const char *path = nullptr; // set by the sender writing the batch
+   int number = 0;             // position in LIST, only set if someone is IDLE on the mailbox
+   bool written = false;       // its file is stored, the sender gets ERR_INTERNAL otherwise
+   bool committed = false;
+   Delivery *next = nullptr;
+};
+
+// Concurrent SENDs to one receiver are written in batches: the first sender finding no batch in
+// progress writes everything queued so far under one hold of the mailbox lock, the others wait
+// for it and get their OK when their batch is written
+struct DeliveryQueue
+{
+   ProfiledMutex mutex{"deliveryMutex"}; //for the fields below and Delivery::committed
+   ProfiledCondition committed;
+   Delivery *first = nullptr;  // queued, oldest first
+   Delivery *last = nullptr;
+   bool writing = false;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+void threadWorker(Shard *shard);
+int openListener(int port);
+int openUnixListener(const std::string &path);
+void acceptLoop(Shard *shard);
+void acceptTcpClient(Shard *shard);
+void acceptUnixClient(int listener, Shard *shard);
+void admitClient(Shard *shard, int socket, std::string peer, bool local);
+void enqueueSession(std::shared_ptr<Session> session, bool first = false);
+bool laneOf(Opcode opcode, Lane &lane);
+bool enterLane(Session &session, Opcode opcode);
+void leaveLane(Session &session, Opcode opcode);
+void waitForLane(std::shared_ptr<Session> session);
+void handoffServer(int listener);
+void drainSessions();
+void forgetSession(int socket);
+void closeSession(Session &session);
+void closeQueuedSessions(Shard &shard);
+void pinShardThread(Shard *shard);
+void placeShard(Shard &shard, const std::vector<int> &cpus, const std::vector<NumaNode> &nodes);
+std::vector<std::string> placementReport();
+int setTunable(const std::string &name, const std::string &value);
+std::vector<std::string> tunableValues();
+void clientCommunication(std::shared_ptr<Session> session);
 void signalHandler(int sig);
-bool login(int *current_socket, string &username, string baseDirectory, std::istringstream &stream);
-void emailSend(int* current_socket, string username, string baseDirectory, std::istringstream &stream);
-void list(int* current_socket, string username, string baseDirectory);
-void read(int* current_socket, string username, string baseDirectory, std::istringstream &stream);
-void del(int* current_socket, string username, string baseDirectory, std::istringstream &stream);
-void respond(int *current_socket, string response);
-string findFile(int *current_socket, string path, int position);
-void createDirIfNotCreated(string username, string baseDirectory);
-bool checkBlacklist(std::string username);
-bool checkLdap(std::string username, std::string password);
-void writeToFile(const std::string& filename, const std::string& username, const std::string& subject, const std::string& message);
-std::string getClientIPAddress(int* current_socket);
+size_t textCommandLength(std::string_view buffer, size_t &resume);
+bool processTextCommands(Session &session, bool paused);
+bool parseTextArguments(Opcode opcode, std::string_view text, std::vector<std::string_view> &args);
+void formatTextReply(Opcode opcode, Reply &reply, OutputBuffer &out);
+bool processFrames(Session &session);
+std::unique_ptr<RequestTrace> beginTrace(Session &session, TracePoint start);
+void finishTraces(std::vector<std::unique_ptr<RequestTrace>> &traces, TracePoint sendStart);
+Reply execute(Session &session, Opcode opcode, const std::vector<std::string_view> &args);
+Reply dispatch(Session &session, Opcode opcode, const std::vector<std::string_view> &args);
+Reply login(const string &peer, const string &username, const string &password, std::string_view baseDirectory);
+Reply resume(const string &peer, std::string_view ticket, string &username, std::string_view baseDirectory);
+Reply emailSend(std::string_view username, std::string_view baseDirectory, std::string_view receiver, std::string_view subject, std::string_view message);
+Reply list(std::string_view username, std::string_view baseDirectory);
+Reply read(std::string_view username, std::string_view baseDirectory, int msnr);
+Reply del(std::string_view username, std::string_view baseDirectory, int msnr);
+Reply mread(std::string_view username, std::string_view baseDirectory, const std::vector<int> &numbers, const std::vector<string> &ids);
+Reply mdel(std::string_view username, std::string_view baseDirectory, const std::vector<int> &numbers, const std::vector<string> &ids);
+Status readMailFile(const char *filepath, string &sender, string &subject, string &message);
+Status resolveSelection(const char *path, const std::vector<int> &numbers, const std::vector<string> &ids,
+                        std::vector<std::pair<string, string>> &selected);
+bool isMailboxName(std::string_view name);
+bool parseMessageNumber(std::string_view text, int &msnr);
+bool parseMessageSelection(std::string_view text, std::vector<int> &numbers, std::vector<string> &ids);
+bool sendToSession(Session &session, std::string_view data = {});
+Reply startIdle(Session &session, uint32_t requestId);
+void endIdle(Session &session);
+bool hasIdleSessions(std::string_view username);
+void notifyNewMessage(std::string_view username, int number);
+void parkSession(std::shared_ptr<Session> session);
+void watchParkedOutput(Session &session);
+void idleWatcher();
+int admissionDelay(Shard &shard, Rejection &reason);
+bool reserveConnection(const std::string &peer);
+void releaseConnection(const std::string &peer);
+void rejectConnection(int socket, int retryAfter, Rejection reason);
+Gauges currentGauges();
+void metricsServer(int port);
+const char *findFile(std::string_view path, int position);
+std::vector<string> listMailbox(std::string_view path);
+ProfiledMutex &mailboxMutex(std::string_view username);
+DeliveryQueue &deliveryQueue(std::string_view receiver);
+void commitDeliveries(std::string_view receiver, std::string_view baseDirectory, Delivery *batch);
+void createDirIfNotCreated(std::string_view username, std::string_view baseDirectory);
+bool checkBlacklist(const std::string &peer);
+bool writeToFile(const char *filename, std::string_view username, std::string_view subject, std::string_view message);
 void removeIdleThreads();
-std::string trim(const std::string& str);
\ No newline at end of file
+std::string_view trim(std::string_view str);
\ No newline at end of file
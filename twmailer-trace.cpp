@@ -0,0 +1,104 @@
+#include "twmailer-trace.h"
+
+#include <unistd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+
+Tracer tracer;
+thread_local RequestTrace *activeTrace = nullptr;
+
+static double microseconds(TracePoint from, TracePoint to)
+{
+   return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+//====================================================================================================================
+
+// The file is a JSON array that is only closed by close(), trace viewers accept it either way
+bool Tracer::open(const std::string &path, uint64_t sampleEvery, uint64_t slowMicroseconds)
+{
+   file = fopen(path.c_str(), "w");
+   if (file == nullptr)
+   {
+      perror("unable to open trace file");
+      return false;
+   }
+   fputs("[\n", file);
+   this->sampleEvery = sampleEvery == 0 ? 1 : sampleEvery;
+   this->slowMicroseconds = slowMicroseconds;
+   epoch = std::chrono::steady_clock::now();
+   return true;
+}
+
+void Tracer::close()
+{
+   std::lock_guard<std::mutex> lock(mutex);
+   if (file != nullptr)
+   {
+      fputs("\n]\n", file);
+      fclose(file);
+      file = nullptr;
+   }
+}
+
+std::unique_ptr<RequestTrace> Tracer::begin(uint32_t session, TracePoint start)
+{
+   uint64_t id = requests++;
+   if (file == nullptr || id % sampleEvery != 0)
+   {
+      return nullptr;
+   }
+   auto trace = std::make_unique<RequestTrace>();
+   trace->id = id;
+   trace->session = session;
+   trace->start = start;
+   return trace;
+}
+
+//====================================================================================================================
+
+void Tracer::finish(std::unique_ptr<RequestTrace> trace)
+{
+   TracePoint end = std::chrono::steady_clock::now();
+   TracePoint start = trace->start;
+   for (const TraceSpanRecord &span : trace->spans)
+   {
+      // the queue wait began before the request was read
+      start = std::min(start, span.start);
+      end = std::max(end, span.end);
+   }
+   if (microseconds(start, end) < slowMicroseconds)
+   {
+      return;
+   }
+
+   // one row (tid) per request, the request as the outer event and its spans nested inside
+   std::string events;
+   char event[512];
+   int pid = getpid();
+   snprintf(event, sizeof(event),
+            "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%lu,"
+            "\"args\":{\"request\":%lu,\"session\":%u,\"status\":\"%s\"}}",
+            trace->command, microseconds(epoch, start), microseconds(start, end), pid, (unsigned long)trace->id,
+            (unsigned long)trace->id, trace->session, trace->status);
+   events += event;
+   for (const TraceSpanRecord &span : trace->spans)
+   {
+      snprintf(event, sizeof(event),
+               ",\n{\"name\":\"%s\",\"cat\":\"span\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%lu}",
+               span.name, microseconds(epoch, span.start), microseconds(span.start, span.end), pid,
+               (unsigned long)trace->id);
+      events += event;
+   }
+
+   std::lock_guard<std::mutex> lock(mutex);
+   if (file != nullptr)
+   {
+      if (!first)
+      {
+         fputs(",\n", file);
+      }
+      first = false;
+      fwrite(events.data(), 1, events.size(), file);
+   }
+}
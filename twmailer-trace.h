@@ -0,0 +1,96 @@
+#ifndef TWMAILER_TRACE_H
+#define TWMAILER_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Request tracing. With --trace=<file> every sampled request collects spans (queue wait,
+// parse, locks, file I/O, authentication, send) and is written as Chrome trace events,
+// one row per request, ready for chrome://tracing or https://ui.perfetto.dev.
+// Spans are only recorded on the thread that began the request, through activeTrace.
+
+typedef std::chrono::steady_clock::time_point TracePoint;
+
+struct TraceSpanRecord
+{
+   const char *name;         // string literal
+   TracePoint start;
+   TracePoint end;
+};
+
+struct RequestTrace
+{
+   uint64_t id = 0;
+   const char *command = "?";
+   const char *status = "";
+   uint32_t session = 0;     // socket of the session
+   TracePoint start;
+   std::vector<TraceSpanRecord> spans;
+};
+
+class Tracer
+{
+public:
+   // every sampleEvery-th request is traced, of those only the ones taking at least slowMicroseconds are kept
+   bool open(const std::string &path, uint64_t sampleEvery, uint64_t slowMicroseconds);
+   bool isOpen() const { return file != nullptr; }
+   void close();
+
+   std::unique_ptr<RequestTrace> begin(uint32_t session, TracePoint start); // nullptr if this request is not sampled
+   void finish(std::unique_ptr<RequestTrace> trace);
+
+private:
+   FILE *file = nullptr;
+   std::mutex mutex; // for file and first
+   bool first = true;
+   uint64_t sampleEvery = 1;
+   uint64_t slowMicroseconds = 0;
+   std::atomic<uint64_t> requests{0};
+   TracePoint epoch;
+};
+
+extern Tracer tracer;
+extern thread_local RequestTrace *activeTrace;
+
+// Adds a span to the active trace of this thread, if there is one
+inline void traceSpan(const char *name, TracePoint start, TracePoint end)
+{
+   if (activeTrace != nullptr)
+   {
+      activeTrace->spans.push_back({name, start, end});
+   }
+}
+
+// Span from construction to the end of the scope
+class TraceScope
+{
+public:
+   explicit TraceScope(const char *name) : name(activeTrace != nullptr ? name : nullptr)
+   {
+      if (this->name != nullptr)
+      {
+         start = std::chrono::steady_clock::now();
+      }
+   }
+   ~TraceScope()
+   {
+      if (name != nullptr)
+      {
+         traceSpan(name, start, std::chrono::steady_clock::now());
+      }
+   }
+
+private:
+   const char *name;
+   TracePoint start;
+};
+
+#endif